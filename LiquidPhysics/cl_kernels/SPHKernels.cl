@@ -1,4 +1,5 @@
 #define cl_float float
+#define cl_float2 float2
 #define cl_float4 float4
 #define cl_uint unsigned int
 #define cl_uint4 uint4
@@ -65,29 +66,116 @@ void resolveCollision(cl_float4* position,
 
 __kernel void calcGridIndices(__global const cl_float4* inPositions,
 							  __global cl_uint* outGridIndices,
-							  const ParallelSPHParameters params)
+							  __global cl_uint* outParticleIndices,
+							  __constant ParallelSPHParameters* parameters)
 {
+	const ParallelSPHParameters params = *parameters;
 	const cl_uint i = get_global_id(0);
 
 	if (i < params.particleCount)
 	{
 		cl_float4 position = inPositions[i];
 
-		cl_uint xGrid = trunc((position.x + params.gridOffset.x) / params.gridSpacing);
-		cl_uint yGrid = trunc((position.y + params.gridOffset.y) / params.gridSpacing);
-		cl_uint zGrid = trunc((position.z + params.gridOffset.z) / params.gridSpacing);
+		// The grid may be built from the bounds of the previous step, so particles that left it are clamped to the border cells
+		cl_uint xGrid = clamp((cl_int)trunc((position.x + params.gridOffset.x) / params.gridSpacing), 0, (cl_int)params.gridSize.x - 1);
+		cl_uint yGrid = clamp((cl_int)trunc((position.y + params.gridOffset.y) / params.gridSpacing), 0, (cl_int)params.gridSize.y - 1);
+		cl_uint zGrid = clamp((cl_int)trunc((position.z + params.gridOffset.z) / params.gridSpacing), 0, (cl_int)params.gridSize.z - 1);
 
 		outGridIndices[i] = xGrid + params.gridSize.x * yGrid + params.gridSize.x * params.gridSize.y * zGrid;
+		outParticleIndices[i] = i;
 	}	
 }
 
+// Component wise min and max of the values, every work group strides over the values and writes its result to
+// outMinValues[group] and outMaxValues[group]. A second launch with a single work group reduces the group results.
+__kernel void reduceBounds(__global const cl_float4* inMinValues,
+						   __global const cl_float4* inMaxValues,
+						   __global cl_float4* outMinValues,
+						   __global cl_float4* outMaxValues,
+						   const cl_uint valueCount,
+						   __local cl_float4* localMinValues,
+						   __local cl_float4* localMaxValues)
+{
+	const cl_uint localId = get_local_id(0);
+	const cl_uint localSize = get_local_size(0);
+
+	cl_float4 minValue = (cl_float4)(FLT_MAX, FLT_MAX, FLT_MAX, 0.f);
+	cl_float4 maxValue = (cl_float4)(-FLT_MAX, -FLT_MAX, -FLT_MAX, 0.f);
+	for (cl_uint i = get_global_id(0); i < valueCount; i += get_global_size(0))
+	{
+		minValue = fmin(minValue, inMinValues[i]);
+		maxValue = fmax(maxValue, inMaxValues[i]);
+	}
+
+	localMinValues[localId] = minValue;
+	localMaxValues[localId] = maxValue;
+
+	for (cl_uint stride = localSize / 2; stride > 0; stride >>= 1)
+	{
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (localId < stride)
+		{
+			localMinValues[localId] = fmin(localMinValues[localId], localMinValues[localId + stride]);
+			localMaxValues[localId] = fmax(localMaxValues[localId], localMaxValues[localId + stride]);
+		}
+	}
+
+	if (localId == 0)
+	{
+		outMinValues[get_group_id(0)] = localMinValues[0];
+		outMaxValues[get_group_id(0)] = localMaxValues[0];
+	}
+}
+
+// Squared speed and squared acceleration maximum of the particles, every work group strides over the particles and writes
+// its result to outGroupMaxValues[group]. The few group results are combined on the host.
+__kernel void reduceTimeStepBounds(__global const cl_float4* inVelocities,
+								   __global const cl_float4* inAccumulatedForces,
+								   __global const cl_float* inDensities,
+								   __global cl_float2* outGroupMaxValues,
+								   const cl_uint particleCount,
+								   __local cl_float2* localMaxValues)
+{
+	const cl_uint localId = get_local_id(0);
+	const cl_uint localSize = get_local_size(0);
+
+	cl_float2 maxValue = (cl_float2)(0.f);
+	for (cl_uint i = get_global_id(0); i < particleCount; i += get_global_size(0))
+	{
+		cl_float4 velocity = inVelocities[i];
+		cl_float4 force = inAccumulatedForces[i];
+		cl_float density = inDensities[i];
+		velocity.w = 0.f;
+		force.w = 0.f;
+
+		cl_float acceleration2 = 0.f;
+		if (isgreater(density, 0.f))
+			acceleration2 = dot(force, force) / (density * density);
+
+		maxValue = fmax(maxValue, (cl_float2)(dot(velocity, velocity), acceleration2));
+	}
+
+	localMaxValues[localId] = maxValue;
+
+	for (cl_uint stride = localSize / 2; stride > 0; stride >>= 1)
+	{
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (localId < stride)
+			localMaxValues[localId] = fmax(localMaxValues[localId], localMaxValues[localId + stride]);
+	}
+
+	if (localId == 0)
+		outGroupMaxValues[get_group_id(0)] = localMaxValues[0];
+}
+
 __kernel void countDigitsInBuckets(__global const cl_uint* inGridIndices, 
 								   __global cl_uint* bucketCounts,
-								   const ParallelSPHParameters params,
+								   __constant ParallelSPHParameters* parameters,
 								   const cl_uint threadCount,
 								   const cl_uint passNumber,
 								   const cl_uint radixWidth)
 {
+	const ParallelSPHParameters params = *parameters;
 	const cl_uint i = get_global_id(0);
 
 	cl_uint particlesPerThread = params.particleCount / threadCount;
@@ -105,22 +193,91 @@ __kernel void countDigitsInBuckets(__global const cl_uint* inGridIndices,
 	}
 }
 
-__kernel void permuteParticles(__global const cl_float4* inPositions,
-							   __global cl_float4* outPositions,
-							   __global const cl_float4* inVelocities,
-							   __global cl_float4* outVelocities,
-							   __global const cl_float4* inHalfVelocities,
-							   __global cl_float4* outHalfVelocities,
-							   __global const cl_bool* inIsFirstTimeSteps,
-							   __global cl_bool* outIsFirstTimeSteps,
-							   __global const cl_uint* inGridIndices,
-							   __global cl_uint* outGridIndices,
-							   __global cl_uint* scannedBuckets,
-							   const ParallelSPHParameters params,
-							   const cl_uint threadCount,
-							   const cl_uint passNumber,
-							   const cl_uint radixWidth)
+// Work-efficient (Blelloch) exclusive scan of blocks of 2 * local size values in local memory.
+// The total of every block is written to outBlockSums, so the blocks can be combined with addBlockOffsets.
+__kernel void scanBuckets(__global cl_uint* inOutValues,
+						  __global cl_uint* outBlockSums,
+						  const cl_uint valueCount,
+						  __local cl_uint* localValues)
 {
+	const cl_uint localId = get_local_id(0);
+	const cl_uint localSize = get_local_size(0);
+	const cl_uint blockSize = 2 * localSize;
+	const cl_uint firstIndex = get_group_id(0) * blockSize + localId;
+	const cl_uint secondIndex = firstIndex + localSize;
+
+	localValues[localId] = firstIndex < valueCount ? inOutValues[firstIndex] : 0;
+	localValues[localId + localSize] = secondIndex < valueCount ? inOutValues[secondIndex] : 0;
+
+	// Up-sweep: build a tree of partial sums in place
+	cl_uint stride = 1;
+	for (cl_uint activeCount = localSize; activeCount > 0; activeCount >>= 1)
+	{
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (localId < activeCount)
+		{
+			cl_uint left = stride * (2 * localId + 1) - 1;
+			cl_uint right = stride * (2 * localId + 2) - 1;
+			localValues[right] += localValues[left];
+		}
+		stride <<= 1;
+	}
+
+	if (localId == 0)
+	{
+		outBlockSums[get_group_id(0)] = localValues[blockSize - 1];
+		localValues[blockSize - 1] = 0;
+	}
+
+	// Down-sweep: distribute the partial sums back down the tree
+	for (cl_uint activeCount = 1; activeCount < blockSize; activeCount <<= 1)
+	{
+		stride >>= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (localId < activeCount)
+		{
+			cl_uint left = stride * (2 * localId + 1) - 1;
+			cl_uint right = stride * (2 * localId + 2) - 1;
+			cl_uint leftValue = localValues[left];
+			localValues[left] = localValues[right];
+			localValues[right] += leftValue;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (firstIndex < valueCount)
+		inOutValues[firstIndex] = localValues[localId];
+	if (secondIndex < valueCount)
+		inOutValues[secondIndex] = localValues[localId + localSize];
+}
+
+__kernel void addBlockOffsets(__global cl_uint* inOutValues,
+							  __global const cl_uint* blockOffsets,
+							  const cl_uint valueCount)
+{
+	const cl_uint localSize = get_local_size(0);
+	const cl_uint firstIndex = get_group_id(0) * 2 * localSize + get_local_id(0);
+	const cl_uint secondIndex = firstIndex + localSize;
+	const cl_uint blockOffset = blockOffsets[get_group_id(0)];
+
+	if (firstIndex < valueCount)
+		inOutValues[firstIndex] += blockOffset;
+	if (secondIndex < valueCount)
+		inOutValues[secondIndex] += blockOffset;
+}
+
+// Radix sort pass over (grid index, particle index) pairs, the particle attributes are only gathered once by gatherParticles
+__kernel void permuteSortKeys(__global const cl_uint* inGridIndices,
+							  __global cl_uint* outGridIndices,
+							  __global const cl_uint* inParticleIndices,
+							  __global cl_uint* outParticleIndices,
+							  __global cl_uint* scannedBuckets,
+							  __constant ParallelSPHParameters* parameters,
+							  const cl_uint threadCount,
+							  const cl_uint passNumber,
+							  const cl_uint radixWidth)
+{
+	const ParallelSPHParameters params = *parameters;
 	const cl_uint i = get_global_id(0);
 
 	cl_uint particlesPerThread = params.particleCount / threadCount;
@@ -137,51 +294,57 @@ __kernel void permuteParticles(__global const cl_float4* inPositions,
 		cl_uint sortedIndex = scannedBuckets[bucket * threadCount + i];
 		++(scannedBuckets[bucket * threadCount + i]);
 
-		outPositions[sortedIndex] = inPositions[j];
-		outVelocities[sortedIndex] = inVelocities[j];
-		outHalfVelocities[sortedIndex] = inHalfVelocities[j];
-		outIsFirstTimeSteps[sortedIndex] = inIsFirstTimeSteps[j];
 		outGridIndices[sortedIndex] = inGridIndices[j];
+		outParticleIndices[sortedIndex] = inParticleIndices[j];
+	}
+}
+
+// Moves the particles into sorted order, afterwards the sorted particle indices are the identity
+__kernel void gatherParticles(__global const cl_float4* inPositions,
+							  __global cl_float4* outPositions,
+							  __global const cl_float4* inVelocities,
+							  __global cl_float4* outVelocities,
+							  __global const cl_float4* inHalfVelocities,
+							  __global cl_float4* outHalfVelocities,
+							  __global const cl_bool* inIsFirstTimeSteps,
+							  __global cl_bool* outIsFirstTimeSteps,
+							  __global cl_uint* inOutSortedParticleIndices,
+							  __constant ParallelSPHParameters* parameters)
+{
+	const ParallelSPHParameters params = *parameters;
+	const cl_uint i = get_global_id(0);
+
+	if (i < params.particleCount)
+	{
+		cl_uint j = inOutSortedParticleIndices[i];
+
+		outPositions[i] = inPositions[j];
+		outVelocities[i] = inVelocities[j];
+		outHalfVelocities[i] = inHalfVelocities[j];
+		outIsFirstTimeSteps[i] = inIsFirstTimeSteps[j];
+		inOutSortedParticleIndices[i] = i;
 	}
 }
 
+// Marks the first and last particle of every occupied cell in the sorted grid indices. Empty cells keep the
+// start and end of 0 they were cleared with, so the work does not depend on the number of cells.
 __kernel void buildCellList(__global const cl_uint* inGridIndices,
-							const ParallelSPHParameters params,
-							__global cl_int* cellList)
+							__constant ParallelSPHParameters* parameters,
+							__global cl_uint* cellStarts,
+							__global cl_uint* cellEnds)
 {
+	const ParallelSPHParameters params = *parameters;
 	const cl_uint i = get_global_id(0);
 
 	if (i < params.particleCount)
 	{
 		cl_uint particleGridIndex = inGridIndices[i];
 
-		if (i == 0)
-		{
-			for (cl_uint j = 0; j <= particleGridIndex; j++)
-			{
-				cellList[j] = i;
-			}
-		}
-		else
-		{
-			cl_uint prevParticleGridIndex = inGridIndices[i - 1];
+		if (i == 0 || inGridIndices[i - 1] != particleGridIndex)
+			cellStarts[particleGridIndex] = i;
 
-			if (particleGridIndex != prevParticleGridIndex)
-			{
-				for (cl_uint j = particleGridIndex; j > prevParticleGridIndex; j--)
-				{
-					cellList[j] = i;
-				}
-			}
-
-			if (i == params.particleCount - 1)
-			{
-				for (cl_uint j = particleGridIndex + 1; j < params.cellCount; j++)
-				{
-					cellList[j] = i + 1;
-				}
-			}
-		}
+		if (i == params.particleCount - 1 || inGridIndices[i + 1] != particleGridIndex)
+			cellEnds[particleGridIndex] = i + 1;
 	}
 }
 
@@ -190,8 +353,10 @@ __kernel void buildCellList(__global const cl_uint* inGridIndices,
 __kernel void calcDensityPressure(__global const cl_float4* inPositions,
 								  __global cl_float* outDensities,
 								  __global cl_float* outPressures,
-								  const ParallelSPHParameters parameters,
-								  __global const cl_int* cellList,
+								  __constant ParallelSPHParameters* parameters,
+								  __global const cl_uint* cellStarts,
+								  __global const cl_uint* cellEnds,
+								  __global const cl_uint* sortedParticleIndices,
 								  __global const cl_float* globalDefaultKernelWeights,
 								  __local cl_float* defaultKernelWeights)
 {
@@ -199,7 +364,7 @@ __kernel void calcDensityPressure(__global const cl_float4* inPositions,
 	const cl_uint workGroupSize = get_local_size(0);
 	const cl_uint localIndex = get_local_id(0);
 
-	ParallelSPHParameters params = parameters;
+	ParallelSPHParameters params = *parameters;
 
 	for (cl_uint kernelWeightIndex = 0; kernelWeightIndex < params.kernelWeightCount; kernelWeightIndex += workGroupSize)
 	{
@@ -216,9 +381,9 @@ __kernel void calcDensityPressure(__global const cl_float4* inPositions,
 
 		cl_float weightedSum = 0.f;
 
-		cl_int xGrid = trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing);
-		cl_int yGrid = trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing);
-		cl_int zGrid = trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing);
+		cl_int xGrid = clamp((cl_int)trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing), 0, (cl_int)params.gridSize.x - 1);
+		cl_int yGrid = clamp((cl_int)trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing), 0, (cl_int)params.gridSize.y - 1);
+		cl_int zGrid = clamp((cl_int)trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing), 0, (cl_int)params.gridSize.z - 1);
 		for (cl_int z = zGrid - 1; z <= zGrid + 1; z++) {
 			for (cl_int y = yGrid - 1; y <= yGrid + 1; y++) {
 				for (cl_int x = xGrid - 1; x <= xGrid + 1; x++) {
@@ -227,9 +392,10 @@ __kernel void calcDensityPressure(__global const cl_float4* inPositions,
 						(z >= 0 && z < params.gridSize.z))
 					{
 						cl_uint gridIndex = x + params.gridSize.x * y + params.gridSize.x * params.gridSize.y * z;
-						cl_uint neighborEnd = (gridIndex + 1 < params.cellCount) ? cellList[gridIndex + 1] : params.particleCount;
-						for (cl_uint j = cellList[gridIndex]; j < neighborEnd; j++)
+						cl_uint neighborEnd = cellEnds[gridIndex];
+						for (cl_uint k = cellStarts[gridIndex]; k < neighborEnd; k++)
 						{
+							cl_uint j = sortedParticleIndices[k];
 							cl_float4 neighborPosition = inPositions[j];
 							cl_float particleDistance = distance(neighborPosition, currentPosition);
 							if (isless(particleDistance, params.kernelRadius))
@@ -257,8 +423,10 @@ __kernel void accumulateNonPressureForces(__global const cl_float4* inPositions,
 							   __global const cl_float4* inVelocities,
 							   __global const cl_float* inDensities,
 							   __global cl_float4* outAccumulatedForces,
-							   const ParallelSPHParameters parameters,
-							   __global const cl_int* cellList,
+							   __constant ParallelSPHParameters* parameters,
+							   __global const cl_uint* cellStarts,
+							   __global const cl_uint* cellEnds,
+							   __global const cl_uint* sortedParticleIndices,
 							   __global const cl_float* globalDefaultKernelFirstDerivativeWeights,
 							   __local cl_float* defaultKernelFirstDerivativeWeights,
 							   __global const cl_float* globalDefaultKernelSecondDerivativeWeights,
@@ -270,7 +438,7 @@ __kernel void accumulateNonPressureForces(__global const cl_float4* inPositions,
 	const cl_uint workGroupSize = get_local_size(0);
 	const cl_uint localIndex = get_local_id(0);
 
-	ParallelSPHParameters params = parameters;
+	ParallelSPHParameters params = *parameters;
 
 	for (cl_uint kernelWeightIndex = 0; kernelWeightIndex < params.kernelWeightCount; kernelWeightIndex += workGroupSize)
 	{
@@ -296,9 +464,9 @@ __kernel void accumulateNonPressureForces(__global const cl_float4* inPositions,
 		cl_float laplacianColor = 0.f;
 		cl_float4 viscosityForce = (cl_float4)(0.f);
 
-		cl_int xGrid = trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing);
-		cl_int yGrid = trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing);
-		cl_int zGrid = trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing);
+		cl_int xGrid = clamp((cl_int)trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing), 0, (cl_int)params.gridSize.x - 1);
+		cl_int yGrid = clamp((cl_int)trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing), 0, (cl_int)params.gridSize.y - 1);
+		cl_int zGrid = clamp((cl_int)trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing), 0, (cl_int)params.gridSize.z - 1);
 		for (cl_int z = zGrid - 1; z <= zGrid + 1; z++) {
 			for (cl_int y = yGrid - 1; y <= yGrid + 1; y++) {
 				for (cl_int x = xGrid - 1; x <= xGrid + 1; x++) {
@@ -307,9 +475,10 @@ __kernel void accumulateNonPressureForces(__global const cl_float4* inPositions,
 						(z >= 0 && z < params.gridSize.z))
 					{
 						cl_uint gridIndex = x + params.gridSize.x * y + params.gridSize.x * params.gridSize.y * z;
-						cl_uint neighborEnd = (gridIndex + 1 < params.cellCount) ? cellList[gridIndex + 1] : params.particleCount;
-						for (cl_uint j = cellList[gridIndex]; j < neighborEnd; j++)
+						cl_uint neighborEnd = cellEnds[gridIndex];
+						for (cl_uint k = cellStarts[gridIndex]; k < neighborEnd; k++)
 						{
+							cl_uint j = sortedParticleIndices[k];
 							cl_float4 neighborPosition = inPositions[j];
 							cl_float4 neighborVelocity = inVelocities[j];
 							cl_float neighborDensity = inDensities[j];
@@ -352,8 +521,10 @@ __kernel void accumulatePressureForces(__global const cl_float4* inPositions,
 							   __global const cl_float* inDensities,
 							   __global const cl_float* inPressures,
 							   __global cl_float4* inOutAccumulatedForces,
-							   const ParallelSPHParameters parameters,
-							   __global const cl_int* cellList,
+							   __constant ParallelSPHParameters* parameters,
+							   __global const cl_uint* cellStarts,
+							   __global const cl_uint* cellEnds,
+							   __global const cl_uint* sortedParticleIndices,
 							   __global const cl_float* globalPressureKernelFirstDerivativeWeights,
 							   __local cl_float* pressureKernelFirstDerivativeWeights)
 {
@@ -361,7 +532,7 @@ __kernel void accumulatePressureForces(__global const cl_float4* inPositions,
 	const cl_uint workGroupSize = get_local_size(0);
 	const cl_uint localIndex = get_local_id(0);
 
-	ParallelSPHParameters params = parameters;
+	ParallelSPHParameters params = *parameters;
 
 	for (cl_uint kernelWeightIndex = 0; kernelWeightIndex < params.kernelWeightCount; kernelWeightIndex += workGroupSize)
 	{
@@ -382,9 +553,9 @@ __kernel void accumulatePressureForces(__global const cl_float4* inPositions,
 		cl_float4 pressureForce = (cl_float4)(0.f);
 		cl_float tempFactor = currentPressure / pown(currentDensity, 2);
 
-		cl_int xGrid = trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing);
-		cl_int yGrid = trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing);
-		cl_int zGrid = trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing);
+		cl_int xGrid = clamp((cl_int)trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing), 0, (cl_int)params.gridSize.x - 1);
+		cl_int yGrid = clamp((cl_int)trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing), 0, (cl_int)params.gridSize.y - 1);
+		cl_int zGrid = clamp((cl_int)trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing), 0, (cl_int)params.gridSize.z - 1);
 		for (cl_int z = zGrid - 1; z <= zGrid + 1; z++) {
 			for (cl_int y = yGrid - 1; y <= yGrid + 1; y++) {
 				for (cl_int x = xGrid - 1; x <= xGrid + 1; x++) {
@@ -393,9 +564,10 @@ __kernel void accumulatePressureForces(__global const cl_float4* inPositions,
 						(z >= 0 && z < params.gridSize.z))
 					{
 						cl_uint gridIndex = x + params.gridSize.x * y + params.gridSize.x * params.gridSize.y * z;
-						cl_uint neighborEnd = (gridIndex + 1 < params.cellCount) ? cellList[gridIndex + 1] : params.particleCount;
-						for (cl_uint j = cellList[gridIndex]; j < neighborEnd; j++)
+						cl_uint neighborEnd = cellEnds[gridIndex];
+						for (cl_uint k = cellStarts[gridIndex]; k < neighborEnd; k++)
 						{
+							cl_uint j = sortedParticleIndices[k];
 							cl_float4 neighborPosition = inPositions[j];
 							cl_float neighborDensity = inDensities[j];
 							cl_float neighborPressure = inPressures[j];
@@ -428,9 +600,10 @@ __kernel void integrate(__global cl_float4* inOutPositions,
 						__global const cl_float4* inAccumulatedForces,
 						__global const cl_float* inDensities,
 						__global cl_float4* outOldHalfVelocities,
-						const ParallelSPHParameters params,
+						__constant ParallelSPHParameters* parameters,
 						const cl_float deltaTime)
 {
+	const ParallelSPHParameters params = *parameters;
 	const cl_uint i = get_global_id(0);
 
 	if (i < params.particleCount)
@@ -458,10 +631,11 @@ __kernel void handleCollisions(__global cl_float4* inOutPositions,
 							   __global cl_float4* inOutHalfVelocities,
 							   __global const cl_float4* inOldHalfVelocities,
 							   __global cl_float4* outVelocities,
-							   const ParallelSPHParameters params,
+							   __constant ParallelSPHParameters* parameters,
 							   __global const ParallelSPHCollisionBox* collisionBoxes,
 							   __global const ParallelSPHCollisionSphere* collisionSpheres)
 {
+	const ParallelSPHParameters params = *parameters;
 	const cl_uint i = get_global_id(0);
 
 	if (i < params.particleCount)
@@ -485,6 +659,31 @@ __kernel void handleCollisions(__global cl_float4* inOutPositions,
 	}
 }
 
+// Instance data of the particle rendering, written into shared OpenGL buffers. Same colors as SPHParticleDrawable
+__kernel void writeInstanceData(__global const cl_float4* inPositions,
+								__global const cl_float4* inVelocities,
+								__global cl_float* outTranslations,
+								__global cl_float4* outColors,
+								const cl_uint instanceCount)
+{
+	const cl_uint i = get_global_id(0);
+
+	if (i < instanceCount)
+	{
+		vstore3(inPositions[i].xyz, i, outTranslations);
+
+		cl_float4 velocity = inVelocities[i];
+		cl_float velocityRatio = min(dot(velocity.xyz, velocity.xyz) / 6.f, 1.f);
+		if (isnan(velocityRatio))
+			velocityRatio = 0.f;
+
+		outColors[i] = (cl_float4)(floor(velocityRatio * 181.f) / 255.f,
+								   (66.f + floor(velocityRatio * 181.f)) / 255.f,
+								   (174.f + floor(velocityRatio * 81.f)) / 255.f,
+								   1.f);
+	}
+}
+
 void handleCollisionWithBox(cl_float4* position,
 							cl_float4* velocity,
 							const ParallelSPHParameters params,
@@ -660,10 +859,15 @@ void resolveCollision(cl_float4* position,
 
 __kernel void pciInit(__global cl_float* outPressures,
 	__global cl_float4* outPredictedPressureForces,
-	const ParallelSPHParameters params)
+	__global cl_uint* outConvergedIteration,
+	__constant ParallelSPHParameters* parameters)
 {
+	const ParallelSPHParameters params = *parameters;
 	const cl_uint i = get_global_id(0);
 
+	if (i == 0)
+		*outConvergedIteration = UINT_MAX;
+
 	if (i < params.particleCount)
 	{
 		outPressures[i] = 0.f;
@@ -673,6 +877,9 @@ __kernel void pciInit(__global cl_float* outPressures,
 
 // ---------- PCISPH KERNELS -----------
 
+// The iteration kernels return immediately once an earlier iteration has converged. The flag is uniform over
+// the whole launch, so all work items of a group skip the barriers together.
+
 __kernel void pciIntegrate(__global const cl_float4* inPositions,
 	__global const cl_float4* inVelocities,
 	__global const cl_float4* inHalfVelocities,
@@ -682,9 +889,17 @@ __kernel void pciIntegrate(__global const cl_float4* inPositions,
 	__global const cl_bool* inIsFirstTimeSteps,
 	__global cl_float4* outPredictedHalfVelocities,
 	__global cl_float4* outPredictedPositions,
-	const ParallelSPHParameters params,
+	__constant ParallelSPHParameters* parameters,
+	__global const ParallelSPHCollisionBox* collisionBoxes,
+	__global const ParallelSPHCollisionSphere* collisionSpheres,
+	__global const cl_uint* inConvergedIteration,
+	const cl_uint iteration,
 	const cl_float deltaTime)
 {
+	if (*inConvergedIteration < iteration)
+		return;
+
+	const ParallelSPHParameters params = *parameters;
 	const cl_uint i = get_global_id(0);
 
 	if (i < params.particleCount)
@@ -701,24 +916,7 @@ __kernel void pciIntegrate(__global const cl_float4* inPositions,
 		halfVelocity += acceleration * deltaTime;
 		position += halfVelocity * deltaTime;
 
-		outPredictedHalfVelocities[i] = halfVelocity;
-		outPredictedPositions[i] = position;
-	}
-}
-
-__kernel void pciHandleCollisions(__global cl_float4* inOutPredictedPositions,
-	__global cl_float4* inOutPredictedHalfVelocities,
-	const ParallelSPHParameters params,
-	__global const ParallelSPHCollisionBox* collisionBoxes,
-	__global const ParallelSPHCollisionSphere* collisionSpheres)
-{
-	const cl_uint i = get_global_id(0);
-
-	if (i < params.particleCount)
-	{
-		cl_float4 halfVelocity = inOutPredictedHalfVelocities[i];
-		cl_float4 position = inOutPredictedPositions[i];
-
+		// The collisions only depend on the particle itself, so they are resolved in the same launch
 		for (int j = 0; j < params.collisionBoxCount; j++)
 		{
 			handleCollisionWithBox(&position, &halfVelocity, params, collisionBoxes[j]);
@@ -729,26 +927,36 @@ __kernel void pciHandleCollisions(__global cl_float4* inOutPredictedPositions,
 			handleCollisionWithSphere(&position, &halfVelocity, params, collisionSpheres[j]);
 		}
 
-		inOutPredictedHalfVelocities[i] = halfVelocity;
-		inOutPredictedPositions[i] = position;
+		outPredictedHalfVelocities[i] = halfVelocity;
+		outPredictedPositions[i] = position;
 	}
 }
 
+// Also writes the maximum density error of every work group to outGroupMaxDensityErrors[group]
 __kernel void pciCalcDensityPressure(__global const cl_float4* inPositions,
 	__global const cl_float4* inPredictedPositions,
 	__global cl_float* outPredictedDensities,
 	__global cl_float* inOutPressures,
-	const ParallelSPHParameters parameters,
-	__global const cl_int* cellList,
+	__constant ParallelSPHParameters* parameters,
+	__global const cl_uint* cellStarts,
+	__global const cl_uint* cellEnds,
+	__global const cl_uint* sortedParticleIndices,
 	__global const cl_float* globalDefaultKernelWeights,
 	__local cl_float* defaultKernelWeights,
+	__global cl_float* outGroupMaxDensityErrors,
+	__local cl_float* localMaxDensityErrors,
+	__global const cl_uint* inConvergedIteration,
+	const cl_uint iteration,
 	const cl_float delta)
 {
+	if (*inConvergedIteration < iteration)
+		return;
+
 	const cl_uint i = get_global_id(0);
 	const cl_uint workGroupSize = get_local_size(0);
 	const cl_uint localIndex = get_local_id(0);
 
-	ParallelSPHParameters params = parameters;
+	ParallelSPHParameters params = *parameters;
 
 	for (cl_uint kernelWeightIndex = 0; kernelWeightIndex < params.kernelWeightCount; kernelWeightIndex += workGroupSize)
 	{
@@ -759,6 +967,7 @@ __kernel void pciCalcDensityPressure(__global const cl_float4* inPositions,
 	}
 	barrier(CLK_LOCAL_MEM_FENCE);
 
+	cl_float densityError = 0.f;
 	if (i < params.particleCount)
 	{
 		cl_float4 currentPosition = inPositions[i];
@@ -766,9 +975,9 @@ __kernel void pciCalcDensityPressure(__global const cl_float4* inPositions,
 
 		cl_float weightedSum = 0.f;
 
-		cl_int xGrid = trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing);
-		cl_int yGrid = trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing);
-		cl_int zGrid = trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing);
+		cl_int xGrid = clamp((cl_int)trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing), 0, (cl_int)params.gridSize.x - 1);
+		cl_int yGrid = clamp((cl_int)trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing), 0, (cl_int)params.gridSize.y - 1);
+		cl_int zGrid = clamp((cl_int)trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing), 0, (cl_int)params.gridSize.z - 1);
 		for (cl_int z = zGrid - 1; z <= zGrid + 1; z++) {
 			for (cl_int y = yGrid - 1; y <= yGrid + 1; y++) {
 				for (cl_int x = xGrid - 1; x <= xGrid + 1; x++) {
@@ -777,9 +986,10 @@ __kernel void pciCalcDensityPressure(__global const cl_float4* inPositions,
 						(z >= 0 && z < params.gridSize.z))
 					{
 						cl_uint gridIndex = x + params.gridSize.x * y + params.gridSize.x * params.gridSize.y * z;
-						cl_uint neighborEnd = (gridIndex + 1 < params.cellCount) ? cellList[gridIndex + 1] : params.particleCount;
-						for (cl_uint j = cellList[gridIndex]; j < neighborEnd; j++)
+						cl_uint neighborEnd = cellEnds[gridIndex];
+						for (cl_uint k = cellStarts[gridIndex]; k < neighborEnd; k++)
 						{
+							cl_uint j = sortedParticleIndices[k];
 							cl_float4 neighborPredictedPosition = inPredictedPositions[j];
 							cl_float particleDistance = distance(neighborPredictedPosition, currentPredictedPosition);
 							if (isless(particleDistance, params.kernelRadius))
@@ -794,30 +1004,58 @@ __kernel void pciCalcDensityPressure(__global const cl_float4* inPositions,
 		}
 
 		cl_float predictedDensity = params.particleMass * weightedSum;
-		cl_float predictedPressure = delta * (predictedDensity - params.restDensity);
+		densityError = predictedDensity - params.restDensity;
+		cl_float predictedPressure = delta * densityError;
 		if (isless(predictedPressure, 0.f))
+		{
+			densityError *= params.negativePressureFactor;
 			predictedPressure *= params.negativePressureFactor;
+		}
 
 		outPredictedDensities[i] = predictedDensity;
 		inOutPressures[i] += predictedPressure;
 	}
+
+	localMaxDensityErrors[localIndex] = fabs(densityError);
+	for (cl_uint stride = workGroupSize / 2; stride > 0; stride >>= 1)
+	{
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (localIndex < stride)
+			localMaxDensityErrors[localIndex] = fmax(localMaxDensityErrors[localIndex], localMaxDensityErrors[localIndex + stride]);
+	}
+
+	if (localIndex == 0)
+		outGroupMaxDensityErrors[get_group_id(0)] = localMaxDensityErrors[0];
 }
 
+// The first work group also combines the group maxima of pciCalcDensityPressure, which was launched with the same
+// number of groups, and marks the iteration as converged if the density error is below maxDensityError
 __kernel void pciCalcPressureForce(__global const cl_float4* inPositions,
 	__global const cl_float4* inPredictedPositions,
 	__global const cl_float* inPredictedDensities,
 	__global const cl_float* inPressures,
 	__global cl_float4* outPredictedPressureForces,
-	const ParallelSPHParameters parameters,
-	__global const cl_int* cellList,
+	__constant ParallelSPHParameters* parameters,
+	__global const cl_uint* cellStarts,
+	__global const cl_uint* cellEnds,
+	__global const cl_uint* sortedParticleIndices,
 	__global const cl_float* globalPressureKernelFirstDerivativeWeights,
-	__local cl_float* pressureKernelFirstDerivativeWeights)
+	__local cl_float* pressureKernelFirstDerivativeWeights,
+	__global const cl_float* inGroupMaxDensityErrors,
+	__local cl_float* localMaxDensityErrors,
+	__global cl_uint* inOutConvergedIteration,
+	const cl_uint iteration,
+	const cl_float maxDensityError)
 {
+	// Group 0 may already have marked this iteration, so only earlier iterations skip it
+	if (*inOutConvergedIteration < iteration)
+		return;
+
 	const cl_uint i = get_global_id(0);
 	const cl_uint workGroupSize = get_local_size(0);
 	const cl_uint localIndex = get_local_id(0);
 
-	ParallelSPHParameters params = parameters;
+	ParallelSPHParameters params = *parameters;
 
 	for (cl_uint kernelWeightIndex = 0; kernelWeightIndex < params.kernelWeightCount; kernelWeightIndex += workGroupSize)
 	{
@@ -838,9 +1076,9 @@ __kernel void pciCalcPressureForce(__global const cl_float4* inPositions,
 		cl_float4 pressureForce = (cl_float4)(0.f);
 		cl_float tempFactor = currentPressure / pown(currentPredictedDensity, 2);
 
-		cl_int xGrid = trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing);
-		cl_int yGrid = trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing);
-		cl_int zGrid = trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing);
+		cl_int xGrid = clamp((cl_int)trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing), 0, (cl_int)params.gridSize.x - 1);
+		cl_int yGrid = clamp((cl_int)trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing), 0, (cl_int)params.gridSize.y - 1);
+		cl_int zGrid = clamp((cl_int)trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing), 0, (cl_int)params.gridSize.z - 1);
 		for (cl_int z = zGrid - 1; z <= zGrid + 1; z++) {
 			for (cl_int y = yGrid - 1; y <= yGrid + 1; y++) {
 				for (cl_int x = xGrid - 1; x <= xGrid + 1; x++) {
@@ -849,9 +1087,10 @@ __kernel void pciCalcPressureForce(__global const cl_float4* inPositions,
 						(z >= 0 && z < params.gridSize.z))
 					{
 						cl_uint gridIndex = x + params.gridSize.x * y + params.gridSize.x * params.gridSize.y * z;
-						cl_uint neighborEnd = (gridIndex + 1 < params.cellCount) ? cellList[gridIndex + 1] : params.particleCount;
-						for (cl_uint j = cellList[gridIndex]; j < neighborEnd; j++)
+						cl_uint neighborEnd = cellEnds[gridIndex];
+						for (cl_uint k = cellStarts[gridIndex]; k < neighborEnd; k++)
 						{
+							cl_uint j = sortedParticleIndices[k];
 							cl_float4 neighborPredictedPosition = inPredictedPositions[j];
 							cl_float neighborPredictedDensity = inPredictedDensities[j];
 							cl_float neighborPressure = inPressures[j];
@@ -875,16 +1114,355 @@ __kernel void pciCalcPressureForce(__global const cl_float4* inPositions,
 
 		outPredictedPressureForces[i] = (-pressureForce) * params.particleMass * currentPredictedDensity;
 	}
+
+	if (get_group_id(0) == 0)
+	{
+		cl_float groupMaxDensityError = 0.f;
+		for (cl_uint group = localIndex; group < get_num_groups(0); group += workGroupSize)
+			groupMaxDensityError = fmax(groupMaxDensityError, inGroupMaxDensityErrors[group]);
+
+		localMaxDensityErrors[localIndex] = groupMaxDensityError;
+		for (cl_uint stride = workGroupSize / 2; stride > 0; stride >>= 1)
+		{
+			barrier(CLK_LOCAL_MEM_FENCE);
+			if (localIndex < stride)
+				localMaxDensityErrors[localIndex] = fmax(localMaxDensityErrors[localIndex], localMaxDensityErrors[localIndex + stride]);
+		}
+
+		if (localIndex == 0 && isless(localMaxDensityErrors[0], maxDensityError))
+			*inOutConvergedIteration = iteration;
+	}
 }
 
 __kernel void pciAddPressureForce(__global const cl_float4* inPredictedPressureForces,
 	__global cl_float4* inOutAccumulatedForces,
-	const ParallelSPHParameters params)
+	__constant ParallelSPHParameters* parameters)
 {
+	const ParallelSPHParameters params = *parameters;
 	const cl_uint i = get_global_id(0);
 
 	if (i < params.particleCount)
 	{
 		inOutAccumulatedForces[i] += inPredictedPressureForces[i];
 	}
+}
+
+// ---------- DFSPH KERNELS -----------
+
+// Index of the density solver into the converged iterations, the divergence solver uses 0 (DFSPHSolver::SolveType)
+#define DFSPH_DENSITY_SOLVE 1
+
+// Computes the factor that maps the density error of a particle to its stiffness and starts the predicted velocities at the
+// half velocities. The velocities are corrected directly, so the integration starts without the half step offset.
+__kernel void dfsphInit(__global const cl_float4* inPositions,
+	__global const cl_float4* inVelocities,
+	__global cl_float4* inOutHalfVelocities,
+	__global cl_bool* inOutIsFirstTimeSteps,
+	__global cl_float4* outPredictedVelocities,
+	__global cl_float* outFactors,
+	__global cl_uint* outConvergedIterations,
+	__constant ParallelSPHParameters* parameters,
+	__global const cl_uint* cellStarts,
+	__global const cl_uint* cellEnds,
+	__global const cl_uint* sortedParticleIndices,
+	__global const cl_float* globalPressureKernelFirstDerivativeWeights,
+	__local cl_float* pressureKernelFirstDerivativeWeights)
+{
+	const cl_uint i = get_global_id(0);
+	const cl_uint workGroupSize = get_local_size(0);
+	const cl_uint localIndex = get_local_id(0);
+
+	ParallelSPHParameters params = *parameters;
+
+	if (i == 0)
+	{
+		outConvergedIterations[0] = UINT_MAX;
+		outConvergedIterations[DFSPH_DENSITY_SOLVE] = UINT_MAX;
+	}
+
+	for (cl_uint kernelWeightIndex = 0; kernelWeightIndex < params.kernelWeightCount; kernelWeightIndex += workGroupSize)
+	{
+		if (kernelWeightIndex + localIndex < params.kernelWeightCount)
+		{
+			pressureKernelFirstDerivativeWeights[kernelWeightIndex + localIndex] = globalPressureKernelFirstDerivativeWeights[kernelWeightIndex + localIndex];
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (i < params.particleCount)
+	{
+		cl_float4 currentPosition = inPositions[i];
+
+		cl_float4 gradientSum = (cl_float4)(0.f);
+		cl_float gradientSquareSum = 0.f;
+
+		cl_int xGrid = clamp((cl_int)trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing), 0, (cl_int)params.gridSize.x - 1);
+		cl_int yGrid = clamp((cl_int)trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing), 0, (cl_int)params.gridSize.y - 1);
+		cl_int zGrid = clamp((cl_int)trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing), 0, (cl_int)params.gridSize.z - 1);
+		for (cl_int z = zGrid - 1; z <= zGrid + 1; z++) {
+			for (cl_int y = yGrid - 1; y <= yGrid + 1; y++) {
+				for (cl_int x = xGrid - 1; x <= xGrid + 1; x++) {
+					if ((x >= 0 && x < params.gridSize.x) &&
+						(y >= 0 && y < params.gridSize.y) &&
+						(z >= 0 && z < params.gridSize.z))
+					{
+						cl_uint gridIndex = x + params.gridSize.x * y + params.gridSize.x * params.gridSize.y * z;
+						cl_uint neighborEnd = cellEnds[gridIndex];
+						for (cl_uint k = cellStarts[gridIndex]; k < neighborEnd; k++)
+						{
+							cl_uint j = sortedParticleIndices[k];
+							cl_float4 neighborPosition = inPositions[j];
+							cl_float particleDistance = distance(neighborPosition, currentPosition);
+							if (isless(particleDistance, params.kernelRadius) && i != j)
+							{
+								cl_float4 direction = (currentPosition - neighborPosition) / particleDistance;
+								cl_uint index = trunc(particleDistance / params.kernelDivisionStep);
+								cl_float4 gradient = direction * params.particleMass * pressureKernelFirstDerivativeWeights[index];
+								gradientSum += gradient;
+								gradientSquareSum += dot(gradient, gradient);
+							}
+						}
+					}
+				}
+			}
+		}
+
+		cl_float denominator = dot(gradientSum, gradientSum) + gradientSquareSum;
+		outFactors[i] = isgreater(denominator, 1e-6f) ? 1.f / denominator : 0.f;
+
+		cl_float4 halfVelocity = inOutHalfVelocities[i];
+		if (inOutIsFirstTimeSteps[i])
+		{
+			halfVelocity = inVelocities[i];
+			inOutHalfVelocities[i] = halfVelocity;
+			inOutIsFirstTimeSteps[i] = false;
+		}
+		outPredictedVelocities[i] = halfVelocity;
+	}
+}
+
+__kernel void dfsphPredictVelocities(__global const cl_float4* inAccumulatedForces,
+	__global const cl_float* inDensities,
+	__global cl_float4* inOutPredictedVelocities,
+	__constant ParallelSPHParameters* parameters,
+	const cl_float deltaTime)
+{
+	const ParallelSPHParameters params = *parameters;
+	const cl_uint i = get_global_id(0);
+
+	if (i < params.particleCount)
+	{
+		inOutPredictedVelocities[i] += inAccumulatedForces[i] * (deltaTime / inDensities[i]);
+	}
+}
+
+// The iteration kernels return immediately once an earlier iteration of the same solver has converged, like the PCISPH
+// kernels. Also writes the sum of the density errors of every work group to outGroupDensityErrors[group]
+__kernel void dfsphCalcStiffness(__global const cl_float4* inPositions,
+	__global const cl_float* inDensities,
+	__global const cl_float4* inPredictedVelocities,
+	__global const cl_float* inFactors,
+	__global cl_float* outStiffnesses,
+	__constant ParallelSPHParameters* parameters,
+	__global const cl_uint* cellStarts,
+	__global const cl_uint* cellEnds,
+	__global const cl_uint* sortedParticleIndices,
+	__global const cl_float* globalPressureKernelFirstDerivativeWeights,
+	__local cl_float* pressureKernelFirstDerivativeWeights,
+	__global cl_float* outGroupDensityErrors,
+	__local cl_float* localDensityErrors,
+	__global const cl_uint* inConvergedIterations,
+	const cl_uint solveIndex,
+	const cl_uint iteration,
+	const cl_float deltaTime)
+{
+	if (inConvergedIterations[solveIndex] < iteration)
+		return;
+
+	const cl_uint i = get_global_id(0);
+	const cl_uint workGroupSize = get_local_size(0);
+	const cl_uint localIndex = get_local_id(0);
+
+	ParallelSPHParameters params = *parameters;
+
+	for (cl_uint kernelWeightIndex = 0; kernelWeightIndex < params.kernelWeightCount; kernelWeightIndex += workGroupSize)
+	{
+		if (kernelWeightIndex + localIndex < params.kernelWeightCount)
+		{
+			pressureKernelFirstDerivativeWeights[kernelWeightIndex + localIndex] = globalPressureKernelFirstDerivativeWeights[kernelWeightIndex + localIndex];
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	cl_float densityError = 0.f;
+	if (i < params.particleCount)
+	{
+		cl_float4 currentPosition = inPositions[i];
+		cl_float4 currentPredictedVelocity = inPredictedVelocities[i];
+
+		cl_float densityChange = 0.f;
+
+		cl_int xGrid = clamp((cl_int)trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing), 0, (cl_int)params.gridSize.x - 1);
+		cl_int yGrid = clamp((cl_int)trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing), 0, (cl_int)params.gridSize.y - 1);
+		cl_int zGrid = clamp((cl_int)trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing), 0, (cl_int)params.gridSize.z - 1);
+		for (cl_int z = zGrid - 1; z <= zGrid + 1; z++) {
+			for (cl_int y = yGrid - 1; y <= yGrid + 1; y++) {
+				for (cl_int x = xGrid - 1; x <= xGrid + 1; x++) {
+					if ((x >= 0 && x < params.gridSize.x) &&
+						(y >= 0 && y < params.gridSize.y) &&
+						(z >= 0 && z < params.gridSize.z))
+					{
+						cl_uint gridIndex = x + params.gridSize.x * y + params.gridSize.x * params.gridSize.y * z;
+						cl_uint neighborEnd = cellEnds[gridIndex];
+						for (cl_uint k = cellStarts[gridIndex]; k < neighborEnd; k++)
+						{
+							cl_uint j = sortedParticleIndices[k];
+							cl_float4 neighborPosition = inPositions[j];
+							cl_float particleDistance = distance(neighborPosition, currentPosition);
+							if (isless(particleDistance, params.kernelRadius) && i != j)
+							{
+								cl_float4 direction = (currentPosition - neighborPosition) / particleDistance;
+								cl_uint index = trunc(particleDistance / params.kernelDivisionStep);
+								densityChange += dot(currentPredictedVelocity - inPredictedVelocities[j], direction) * pressureKernelFirstDerivativeWeights[index];
+							}
+						}
+					}
+				}
+			}
+		}
+		densityChange *= params.particleMass * deltaTime;
+
+		// Only compression is corrected, particles at the free surface lack neighbors
+		densityError = densityChange;
+		if (solveIndex == DFSPH_DENSITY_SOLVE)
+			densityError += inDensities[i] - params.restDensity;
+		densityError = fmax(densityError, 0.f);
+
+		outStiffnesses[i] = densityError * inFactors[i] / (deltaTime * deltaTime);
+	}
+
+	localDensityErrors[localIndex] = densityError;
+	for (cl_uint stride = workGroupSize / 2; stride > 0; stride >>= 1)
+	{
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (localIndex < stride)
+			localDensityErrors[localIndex] += localDensityErrors[localIndex + stride];
+	}
+
+	if (localIndex == 0)
+		outGroupDensityErrors[get_group_id(0)] = localDensityErrors[0];
+}
+
+// The first work group also sums the group errors of dfsphCalcStiffness, which was launched with the same number of
+// groups, and marks the iteration as converged if the sum is not above maxDensityErrorSum. Unlike on the host, the
+// correction of that iteration is still applied.
+__kernel void dfsphCorrectVelocities(__global const cl_float4* inPositions,
+	__global const cl_float* inStiffnesses,
+	__global cl_float4* inOutPredictedVelocities,
+	__constant ParallelSPHParameters* parameters,
+	__global const cl_uint* cellStarts,
+	__global const cl_uint* cellEnds,
+	__global const cl_uint* sortedParticleIndices,
+	__global const cl_float* globalPressureKernelFirstDerivativeWeights,
+	__local cl_float* pressureKernelFirstDerivativeWeights,
+	__global const cl_float* inGroupDensityErrors,
+	__local cl_float* localDensityErrors,
+	__global cl_uint* inOutConvergedIterations,
+	const cl_uint solveIndex,
+	const cl_uint iteration,
+	const cl_float maxDensityErrorSum,
+	const cl_float deltaTime)
+{
+	// Group 0 may already have marked this iteration, so only earlier iterations skip it
+	if (inOutConvergedIterations[solveIndex] < iteration)
+		return;
+
+	const cl_uint i = get_global_id(0);
+	const cl_uint workGroupSize = get_local_size(0);
+	const cl_uint localIndex = get_local_id(0);
+
+	ParallelSPHParameters params = *parameters;
+
+	for (cl_uint kernelWeightIndex = 0; kernelWeightIndex < params.kernelWeightCount; kernelWeightIndex += workGroupSize)
+	{
+		if (kernelWeightIndex + localIndex < params.kernelWeightCount)
+		{
+			pressureKernelFirstDerivativeWeights[kernelWeightIndex + localIndex] = globalPressureKernelFirstDerivativeWeights[kernelWeightIndex + localIndex];
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (i < params.particleCount)
+	{
+		cl_float4 currentPosition = inPositions[i];
+		cl_float currentStiffness = inStiffnesses[i];
+
+		cl_float4 velocityCorrection = (cl_float4)(0.f);
+
+		cl_int xGrid = clamp((cl_int)trunc((currentPosition.x + params.gridOffset.x) / params.gridSpacing), 0, (cl_int)params.gridSize.x - 1);
+		cl_int yGrid = clamp((cl_int)trunc((currentPosition.y + params.gridOffset.y) / params.gridSpacing), 0, (cl_int)params.gridSize.y - 1);
+		cl_int zGrid = clamp((cl_int)trunc((currentPosition.z + params.gridOffset.z) / params.gridSpacing), 0, (cl_int)params.gridSize.z - 1);
+		for (cl_int z = zGrid - 1; z <= zGrid + 1; z++) {
+			for (cl_int y = yGrid - 1; y <= yGrid + 1; y++) {
+				for (cl_int x = xGrid - 1; x <= xGrid + 1; x++) {
+					if ((x >= 0 && x < params.gridSize.x) &&
+						(y >= 0 && y < params.gridSize.y) &&
+						(z >= 0 && z < params.gridSize.z))
+					{
+						cl_uint gridIndex = x + params.gridSize.x * y + params.gridSize.x * params.gridSize.y * z;
+						cl_uint neighborEnd = cellEnds[gridIndex];
+						for (cl_uint k = cellStarts[gridIndex]; k < neighborEnd; k++)
+						{
+							cl_uint j = sortedParticleIndices[k];
+							cl_float4 neighborPosition = inPositions[j];
+							cl_float particleDistance = distance(neighborPosition, currentPosition);
+							if (isless(particleDistance, params.kernelRadius) && i != j)
+							{
+								cl_float4 direction = (currentPosition - neighborPosition) / particleDistance;
+								cl_uint index = trunc(particleDistance / params.kernelDivisionStep);
+								velocityCorrection += direction * (currentStiffness + inStiffnesses[j]) * pressureKernelFirstDerivativeWeights[index];
+							}
+						}
+					}
+				}
+			}
+		}
+
+		inOutPredictedVelocities[i] -= velocityCorrection * params.particleMass * deltaTime;
+	}
+
+	if (get_group_id(0) == 0)
+	{
+		cl_float groupDensityErrorSum = 0.f;
+		for (cl_uint group = localIndex; group < get_num_groups(0); group += workGroupSize)
+			groupDensityErrorSum += inGroupDensityErrors[group];
+
+		localDensityErrors[localIndex] = groupDensityErrorSum;
+		for (cl_uint stride = workGroupSize / 2; stride > 0; stride >>= 1)
+		{
+			barrier(CLK_LOCAL_MEM_FENCE);
+			if (localIndex < stride)
+				localDensityErrors[localIndex] += localDensityErrors[localIndex + stride];
+		}
+
+		if (localIndex == 0 && islessequal(localDensityErrors[0], maxDensityErrorSum))
+			inOutConvergedIterations[solveIndex] = iteration;
+	}
+}
+
+// Sets the force that takes the particles from their half velocities to the corrected velocities in the integration
+__kernel void dfsphApplyVelocities(__global const cl_float4* inPredictedVelocities,
+	__global const cl_float4* inHalfVelocities,
+	__global const cl_float* inDensities,
+	__global cl_float4* outAccumulatedForces,
+	__constant ParallelSPHParameters* parameters,
+	const cl_float deltaTime)
+{
+	const ParallelSPHParameters params = *parameters;
+	const cl_uint i = get_global_id(0);
+
+	if (i < params.particleCount)
+	{
+		outAccumulatedForces[i] = (inPredictedVelocities[i] - inHalfVelocities[i]) * (inDensities[i] / deltaTime);
+	}
 }
\ No newline at end of file
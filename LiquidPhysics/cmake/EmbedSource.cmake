@@ -0,0 +1,6 @@
+# Writes the content of SOURCE_FILE into HEADER_FILE as the null terminated unsigned char array VARIABLE_NAME
+file(READ ${SOURCE_FILE} content HEX)
+string(REGEX REPLACE "(................................)" "\\1\n" content "${content}")
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," content "${content}")
+get_filename_component(sourceName ${SOURCE_FILE} NAME)
+file(WRITE ${HEADER_FILE} "#pragma once\n\n// Generated from ${sourceName} at build time, do not edit\nstatic const unsigned char ${VARIABLE_NAME}[] = {\n${content}0x00 };\n")
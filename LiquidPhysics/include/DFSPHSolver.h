@@ -0,0 +1,69 @@
+#pragma once
+
+#include "SPHSolver.h"
+
+namespace LiPhEn {
+	// Divergence-Free SPH of Bender and Koschier. A divergence solver removes the density change rate from the velocities
+	// at the start of the step and a density solver corrects the predicted velocities until the predicted density error is
+	// small enough. The pressure force is the force that takes a particle from its half velocity to the corrected velocity.
+	class DFSPHSolver : public SPHSolver
+	{
+	public:
+		DFSPHSolver();
+		~DFSPHSolver();
+
+		int getMaxDensityIterations() const;
+		int getMaxDivergenceIterations() const;
+		float getMaxDensityErrorRatio() const;
+		float getMaxDivergenceErrorRatio() const;
+		int getConvergenceCheckInterval() const;
+
+		void setMaxDensityIterations(int maxDensityIterations);
+		void setMaxDivergenceIterations(int maxDivergenceIterations);
+		// Average density error in relation to the rest density
+		void setMaxDensityErrorRatio(float maxDensityErrorRatio);
+		// Average density change per second in relation to the rest density
+		void setMaxDivergenceErrorRatio(float maxDivergenceErrorRatio);
+		// On the device the host reads the convergence flags after every convergenceCheckInterval iterations and stops
+		// enqueueing further ones once it is set. 0 never waits for the device, converged iterations are skipped there.
+		void setConvergenceCheckInterval(int convergenceCheckInterval);
+
+	protected:
+		virtual void accumulatePressureForces(float deltaTime);
+		virtual void reinitParallelContext();
+		virtual void initParallelBuffers();
+
+	private:
+		// Index into the converged iterations of the device, one for each solver
+		enum SolveType {
+			DIVERGENCE_SOLVE = 0,
+			DENSITY_SOLVE = 1
+		};
+
+		// Jacobi iterations on the predicted velocities until the average density error is below maxError
+		void correctVelocities(SolveType solveType, int maxIterations, float maxError, float deltaTime);
+		void correctParallelVelocities(SolveType solveType, int maxIterations, float maxError, float deltaTime);
+		void initParallelKernels();
+
+		int m_maxDensityIterations;
+		int m_maxDivergenceIterations;
+		float m_maxDensityErrorRatio;
+		float m_maxDivergenceErrorRatio;
+		int m_convergenceCheckInterval;
+		std::vector<float> m_workerDensityErrors;
+
+		ParallelBuffer* m_predictedVelocitiesBuffer;
+		ParallelBuffer* m_factorsBuffer;
+		ParallelBuffer* m_stiffnessesBuffer;
+		ParallelBuffer* m_groupDensityErrorsBuffer;
+		unsigned int m_predictedBufferCapacity;
+		// Index of the iteration in which the divergence and the density solver converged, UINT_MAX before
+		ParallelBuffer* m_convergedIterationsBuffer;
+
+		ParallelKernel* m_dfsphInitKernel;
+		ParallelKernel* m_dfsphPredictVelocitiesKernel;
+		ParallelKernel* m_dfsphCalcStiffnessKernel;
+		ParallelKernel* m_dfsphCorrectVelocitiesKernel;
+		ParallelKernel* m_dfsphApplyVelocitiesKernel;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Math/Vector3D.h"
+
+namespace LiPhEn {
+	enum class SIMDInstructionSet {
+		SCALAR,
+		SSE,
+		AVX2,
+		AVX512
+	};
+
+	struct SIMDKernelConstants {
+		float radius;
+		float radius2;
+		float densityCoefficient;
+		float pressureGradientCoefficient;
+	};
+
+	// Neighbor sums of the density and pressure force passes, evaluated for 4 (SSE), 8 (AVX2) or 16 (AVX-512)
+	// neighbors per instruction. The instruction set is picked at runtime from what the CPU supports.
+	// The kernels are evaluated analytically instead of through the lookup tables of SPHKernel: the poly6
+	// kernel of DefaultKernel works on the squared distance and the spiky gradient of PressureKernel needs one sqrt.
+	class SIMDKernels
+	{
+	public:
+		SIMDKernels();
+		~SIMDKernels();
+
+		static SIMDInstructionSet detectInstructionSet();
+
+		// Sum of the poly6 weights of all neighbors, including the particle itself
+		float calcDensityKernelSum(const Vector3D* positions, int particleIndex, const int* neighborIndices, int neighborCount) const;
+		// Sum of direction * spiky gradient * (p_i / rho_i^2 + p_j / rho_j^2) over all neighbors but the particle itself
+		Vector3D calcPressureGradientSum(const Vector3D* positions, const float* densities, const float* pressures,
+										 int particleIndex, const int* neighborIndices, int neighborCount) const;
+		// Same sums over the distances and normalized directions of a precomputed neighbor list, entries beyond the kernel radius are ignored
+		float calcDensityKernelSum(const float* neighborDistances, int neighborCount) const;
+		Vector3D calcPressureGradientSum(const float* densities, const float* pressures, int particleIndex, const int* neighborIndices,
+										 const float* neighborDistances, const Vector3D* neighborDirections, int neighborCount) const;
+
+		SIMDInstructionSet getInstructionSet() const;
+
+		// Falls back to the best supported instruction set if the requested one is not available
+		void setInstructionSet(SIMDInstructionSet instructionSet);
+		// Radius and coefficients of the poly6 kernel and the spiky gradient, as in DefaultKernel and PressureKernel
+		void setKernelConstants(float kernelRadius, float densityCoefficient, float pressureGradientCoefficient);
+
+	private:
+		typedef float (*DensityKernelSumFunction)(const float* positions, int particleIndex, const int* neighborIndices, int neighborCount,
+												  const SIMDKernelConstants& constants);
+		typedef void (*PressureGradientSumFunction)(const float* positions, const float* densities, const float* pressures,
+													int particleIndex, const int* neighborIndices, int neighborCount,
+													const SIMDKernelConstants& constants, float* result);
+		typedef float (*DistanceDensityKernelSumFunction)(const float* neighborDistances, int neighborCount, const SIMDKernelConstants& constants);
+		typedef void (*DistancePressureGradientSumFunction)(const float* densities, const float* pressures, int particleIndex, const int* neighborIndices,
+															const float* neighborDistances, const float* neighborDirections, int neighborCount,
+															const SIMDKernelConstants& constants, float* result);
+
+		SIMDInstructionSet m_instructionSet;
+		SIMDKernelConstants m_constants;
+		DensityKernelSumFunction m_densityKernelSumFunction;
+		PressureGradientSumFunction m_pressureGradientSumFunction;
+		DistanceDensityKernelSumFunction m_distanceDensityKernelSumFunction;
+		DistancePressureGradientSumFunction m_distancePressureGradientSumFunction;
+	};
+}
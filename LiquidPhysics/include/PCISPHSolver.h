@@ -15,9 +15,13 @@ namespace LiPhEn {
 
 		int getMinIterations() const;
 		float getMaxDensityErrorRatio() const;
+		int getConvergenceCheckInterval() const;
 
 		void setMinIterations(int maxIterations);
 		void setMaxDensityErrorRatio(float maxDensityErrorRatio);
+		// On the device the host reads the convergence flag after every convergenceCheckInterval iterations and stops
+		// enqueueing further ones once it is set. 0 never waits for the device, converged iterations are skipped there.
+		void setConvergenceCheckInterval(int convergenceCheckInterval);
 
 	protected:
 		virtual void accumulatePressureForces(float deltaTime);
@@ -25,19 +29,26 @@ namespace LiPhEn {
 		virtual void initParallelBuffers();
 
 	private:
-		float calcDelta(float deltaTime);
+		// delta of the PCISPH paper scales with 1 / deltaTime^2, only the deltaTime independent factor is computed
+		float calcDeltaCoefficient();
 
 		int m_minIterations;
 		float m_maxDensityErrorRatio;
+		int m_convergenceCheckInterval;
+		float m_deltaCoefficient;
+		std::vector<float> m_workerMaxDensityErrors;
 
 		ParallelBuffer* m_predictedPositionsBuffer;
 		ParallelBuffer* m_predictedHalfVelocitiesBuffer;
 		ParallelBuffer* m_predictedPressureForcesBuffer;
 		ParallelBuffer* m_predictedDensitiesBuffer;
+		ParallelBuffer* m_groupMaxDensityErrorsBuffer;
+		unsigned int m_predictedBufferCapacity;
+		// Index of the iteration in which the density error fell below the threshold, UINT_MAX before
+		ParallelBuffer* m_convergedIterationBuffer;
 
 		ParallelKernel* m_pciInitKernel;
 		ParallelKernel* m_pciIntegrateKernel;
-		ParallelKernel* m_pciHandleCollisionsKernel;
 		ParallelKernel* m_pciCalcDensityPressureKernel;
 		ParallelKernel* m_pciCalcPressureForceKernel;
 		ParallelKernel* m_pciAddPressureForceKernel;
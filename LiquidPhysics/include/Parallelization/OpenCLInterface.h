@@ -15,10 +15,29 @@ namespace LiPhEn {
 		virtual ~OpenCLBuffer();
 
 		cl::Buffer* getBuffer();
+		unsigned int getId();
 		void setBuffer(cl::Buffer* buffer);
 
 	private:
 		cl::Buffer* m_clBuffer;
+		// Unique for every created buffer, unlike the address of a deleted and reallocated one
+		unsigned int m_id;
+		static unsigned int s_bufferCount;
+	};
+
+	class OpenCLEvent : public ParallelEvent
+	{
+	public:
+		OpenCLEvent();
+		virtual ~OpenCLEvent();
+
+		cl::Event* getEvent();
+
+		virtual void wait();
+		virtual bool isComplete();
+
+	private:
+		cl::Event m_clEvent;
 	};
 
 	class OpenCLKernel : public ParallelKernel
@@ -34,7 +53,17 @@ namespace LiPhEn {
 		virtual void setArgument(unsigned int index, unsigned int size, void* data);
 
 	private:
+		// The last value of every argument, it is only passed to OpenCL again if it changed
+		struct Argument {
+			unsigned int bufferId;
+			unsigned int size;
+			std::vector<unsigned char> data;
+		};
+
+		Argument& getArgument(unsigned int index);
+
 		cl::Kernel* m_clKernel;
+		std::vector<Argument> m_arguments;
 	};
 
 	class OpenCLInterface : public ParallelComputationInterface
@@ -46,13 +75,40 @@ namespace LiPhEn {
 		virtual void reinitContext(ParallelSources sources, ParallelDeviceType deviceType, bool usePrint);
 		virtual ParallelKernel* createKernel(const char* name);
 		virtual ParallelBuffer* createBuffer(ParallelBufferType type, unsigned int size);
-		virtual void executeKernel(ParallelKernel* kernel, unsigned int globalSize, unsigned int localSize = 0);
-		virtual void writeToBuffer(ParallelBuffer* targetData, void* sourceData, unsigned int bufferSize, bool isBlocking);
-		virtual void readFromBuffer(ParallelBuffer* sourceData, void* targetData, unsigned int bufferSize, bool isBlocking);
-		virtual void fillBuffer(ParallelBuffer* targetData, int pattern, unsigned int bufferSize);
+		virtual ParallelEvent* createEvent();
+		virtual void executeKernel(ParallelKernel* kernel, unsigned int globalSize, unsigned int localSize = 0,
+								   ParallelEvent* completionEvent = NULL, const ParallelEvents& waitEvents = ParallelEvents());
+		virtual void writeToBuffer(ParallelBuffer* targetData, void* sourceData, unsigned int bufferSize, bool isBlocking, unsigned int targetOffset = 0,
+								   ParallelEvent* completionEvent = NULL, const ParallelEvents& waitEvents = ParallelEvents(), ParallelQueueType queueType = ParallelQueueType::COMPUTE);
+		virtual void readFromBuffer(ParallelBuffer* sourceData, void* targetData, unsigned int bufferSize, bool isBlocking,
+									ParallelEvent* completionEvent = NULL, const ParallelEvents& waitEvents = ParallelEvents(), ParallelQueueType queueType = ParallelQueueType::COMPUTE);
+		virtual void copyBuffer(ParallelBuffer* sourceData, ParallelBuffer* targetData, unsigned int bufferSize,
+								ParallelEvent* completionEvent = NULL, const ParallelEvents& waitEvents = ParallelEvents());
+		virtual void fillBuffer(ParallelBuffer* targetData, int pattern, unsigned int bufferSize,
+								ParallelEvent* completionEvent = NULL, const ParallelEvents& waitEvents = ParallelEvents());
+		virtual void enqueueMarker(ParallelEvent* completionEvent, ParallelQueueType queueType = ParallelQueueType::COMPUTE);
+		virtual void enqueueWait(const ParallelEvents& waitEvents, ParallelQueueType queueType = ParallelQueueType::COMPUTE);
+		virtual void flush();
+		virtual void* mapBuffer(ParallelBuffer* buffer, unsigned int bufferSize);
+		virtual void unmapBuffer(ParallelBuffer* buffer, void* mappedData);
+		virtual ParallelBuffer* createSharedBuffer(ParallelBufferType type, unsigned int graphicsBuffer);
+		virtual void acquireSharedBuffers(const std::vector<ParallelBuffer*>& buffers);
+		virtual void releaseSharedBuffers(const std::vector<ParallelBuffer*>& buffers);
 		virtual void waitUntilFinished();
 
 	private:
+		cl_mem_flags getMemFlags(ParallelBufferType type);
+		bool createSharedContext();
+		void buildProgram(const cl::Program::Sources& sources, const char* buildOptions);
+		// The file name is a hash of everything the compiled program depends on, empty if the cache is disabled
+		std::string getProgramCacheFile(const cl::Program::Sources& sources, const char* buildOptions);
+		bool loadProgramBinary(const std::string& cacheFile, const char* buildOptions);
+		void storeProgramBinary(const std::string& cacheFile);
+		cl::CommandQueue& getQueue(ParallelQueueType queueType);
+		// The other queue is flushed if it is waited for, otherwise its commands may never be submitted
+		std::vector<cl::Event> getWaitEvents(const ParallelEvents& waitEvents);
+		cl::Event* getEvent(ParallelEvent* event);
+
 		std::vector<cl::Platform> m_clPlatforms;
 		std::vector<cl::Device> m_clDevicesCPU;
 		std::vector<cl::Device> m_clDevicesGPU;
@@ -60,5 +116,6 @@ namespace LiPhEn {
 		cl::Program m_clProgram;
 		cl::Device m_clDefaultDevice;
 		cl::CommandQueue m_clQueue;
+		cl::CommandQueue m_clTransferQueue;
 	};
 }
\ No newline at end of file
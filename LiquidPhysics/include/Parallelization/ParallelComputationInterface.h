@@ -1,6 +1,8 @@
 #pragma once
 
 #include <vector>
+#include <string>
+#include <cstddef>
 
 namespace LiPhEn {
 	typedef std::vector<std::pair<const char*, unsigned int>> ParallelSources;
@@ -10,10 +12,16 @@ namespace LiPhEn {
 		CPU
 	};
 
+	enum class ParallelQueueType {
+		COMPUTE,
+		TRANSFER	// runs concurrently to COMPUTE if a transfer queue exists, commands of both queues are only ordered through events
+	};
+
 	enum class ParallelBufferType {
 		READ_WRITE,
 		READ_ONLY,
-		WRITE_ONLY
+		WRITE_ONLY,
+		HOST_PINNED		// page-locked host memory for fast asynchronous transfers, accessed through mapBuffer
 	};
 
 	class ParallelBuffer
@@ -23,6 +31,18 @@ namespace LiPhEn {
 		virtual ~ParallelBuffer() {};
 	};
 
+	class ParallelEvent
+	{
+	public:
+		ParallelEvent() {};
+		virtual ~ParallelEvent() {};
+
+		virtual void wait() = 0;
+		virtual bool isComplete() = 0;
+	};
+
+	typedef std::vector<ParallelEvent*> ParallelEvents;
+
 	class ParallelKernel
 	{
 	public:
@@ -40,20 +60,61 @@ namespace LiPhEn {
 		bool isValid() { return m_isValid; }
 		bool hasCPU() { return m_hasCPU; }
 		bool hasGPU() { return m_hasGPU; }
+		bool hasGraphicsSharing() { return m_hasGraphicsSharing; }
+		bool hasTransferQueue() { return m_hasTransferQueue; }
+		bool isOutOfOrderExecution() { return m_isOutOfOrderExecution; }
+
+		// The next reinitContext shares buffers with the OpenGL context current at that time, if the device supports it
+		void setGraphicsSharingRequested(bool isGraphicsSharingRequested) { m_isGraphicsSharingRequested = isGraphicsSharingRequested; }
+		// Applied by the next reinitContext. Without a transfer queue TRANSFER commands run on the compute queue. Commands of an
+		// out of order compute queue only wait for their wait events and the events passed to enqueueWait.
+		void setTransferQueueRequested(bool isTransferQueueRequested) { m_isTransferQueueRequested = isTransferQueueRequested; }
+		// Only for callers that pass every dependency as events, SPHSolver always turns it off for its stages
+		void setOutOfOrderExecutionRequested(bool isOutOfOrderExecutionRequested) { m_isOutOfOrderExecutionRequested = isOutOfOrderExecutionRequested; }
+		// reinitContext loads compiled programs from and stores them in this directory, an empty path disables the cache
+		void setProgramCacheDirectory(const std::string& programCacheDirectory) { m_programCacheDirectory = programCacheDirectory; }
+		const std::string& getProgramCacheDirectory() { return m_programCacheDirectory; }
 
 		virtual void initialize(bool usePrint) = 0;
 		virtual void reinitContext(ParallelSources sources, ParallelDeviceType deviceType, bool usePrint) = 0;
 		virtual ParallelKernel* createKernel(const char* name) = 0;
 		virtual ParallelBuffer* createBuffer(ParallelBufferType type, unsigned int size) = 0;
-		virtual void executeKernel(ParallelKernel* kernel, unsigned int globalSize, unsigned int localSize = 0) = 0;
-		virtual void writeToBuffer(ParallelBuffer* targetData, void* sourceData, unsigned int bufferSize, bool isBlocking) = 0;
-		virtual void readFromBuffer(ParallelBuffer* sourceData, void* targetData, unsigned int bufferSize, bool isBlocking) = 0;
-		virtual void fillBuffer(ParallelBuffer* targetData, int pattern, unsigned int bufferSize) = 0;
+		virtual ParallelEvent* createEvent() = 0;
+		// Every command signals completionEvent once it has finished and starts only after all waitEvents
+		virtual void executeKernel(ParallelKernel* kernel, unsigned int globalSize, unsigned int localSize = 0,
+								   ParallelEvent* completionEvent = NULL, const ParallelEvents& waitEvents = ParallelEvents()) = 0;
+		virtual void writeToBuffer(ParallelBuffer* targetData, void* sourceData, unsigned int bufferSize, bool isBlocking, unsigned int targetOffset = 0,
+								   ParallelEvent* completionEvent = NULL, const ParallelEvents& waitEvents = ParallelEvents(), ParallelQueueType queueType = ParallelQueueType::COMPUTE) = 0;
+		virtual void readFromBuffer(ParallelBuffer* sourceData, void* targetData, unsigned int bufferSize, bool isBlocking,
+									ParallelEvent* completionEvent = NULL, const ParallelEvents& waitEvents = ParallelEvents(), ParallelQueueType queueType = ParallelQueueType::COMPUTE) = 0;
+		virtual void copyBuffer(ParallelBuffer* sourceData, ParallelBuffer* targetData, unsigned int bufferSize,
+								ParallelEvent* completionEvent = NULL, const ParallelEvents& waitEvents = ParallelEvents()) = 0;
+		virtual void fillBuffer(ParallelBuffer* targetData, int pattern, unsigned int bufferSize,
+								ParallelEvent* completionEvent = NULL, const ParallelEvents& waitEvents = ParallelEvents()) = 0;
+		// completionEvent is signaled once all commands enqueued before on the queue have finished
+		virtual void enqueueMarker(ParallelEvent* completionEvent, ParallelQueueType queueType = ParallelQueueType::COMPUTE) = 0;
+		// Commands enqueued afterwards on the queue start only after all waitEvents
+		virtual void enqueueWait(const ParallelEvents& waitEvents, ParallelQueueType queueType = ParallelQueueType::COMPUTE) = 0;
+		// Submits the enqueued commands of all queues to the device without waiting for them
+		virtual void flush() = 0;
+		virtual void* mapBuffer(ParallelBuffer* buffer, unsigned int bufferSize) = 0;
+		virtual void unmapBuffer(ParallelBuffer* buffer, void* mappedData) = 0;
+		// Wraps an OpenGL buffer object, returns NULL without graphics sharing. Kernels may only use it between acquire and release
+		virtual ParallelBuffer* createSharedBuffer(ParallelBufferType type, unsigned int graphicsBuffer) = 0;
+		virtual void acquireSharedBuffers(const std::vector<ParallelBuffer*>& buffers) = 0;
+		virtual void releaseSharedBuffers(const std::vector<ParallelBuffer*>& buffers) = 0;
 		virtual void waitUntilFinished() = 0;
 
 	protected:
 		bool m_isValid = false;
 		bool m_hasCPU = false;
 		bool m_hasGPU = false;
+		bool m_hasGraphicsSharing = false;
+		bool m_isGraphicsSharingRequested = false;
+		bool m_hasTransferQueue = false;
+		bool m_isTransferQueueRequested = true;
+		bool m_isOutOfOrderExecution = false;
+		bool m_isOutOfOrderExecutionRequested = false;
+		std::string m_programCacheDirectory;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+
+namespace LiPhEn {
+	typedef std::function<void(int begin, int end, int workerIndex)> ParallelRangeFunction;
+
+	struct ThreadPoolStatistics {
+		double parallelSeconds;
+		std::vector<double> workerBusySeconds;
+		std::vector<int> workerTaskCounts;
+		std::vector<int> workerStolenTaskCounts;
+
+		// Fraction of the time spent in parallel regions that the worker was executing tasks
+		float getWorkerUtilisation(int workerIndex) const;
+	};
+
+	// Persistent worker threads for the native multithreaded CPU path. The calling thread takes part as worker 0,
+	// so a pool with n workers starts n - 1 threads.
+	class ThreadPool
+	{
+	public:
+		ThreadPool(int workerCount = 0);
+		~ThreadPool();
+
+		// Splits [0, count) into one contiguous range per worker and returns once all ranges are processed
+		void parallelFor(int count, const ParallelRangeFunction& function);
+		// Runs the tasks [taskBounds[t], taskBounds[t + 1]). Every worker starts on a contiguous block of tasks
+		// and steals single tasks from the end of the other workers' blocks once its own block is done
+		void parallelForTasks(const std::vector<int>& taskBounds, const ParallelRangeFunction& function);
+
+		void resetStatistics();
+
+		int getWorkerCount() const;
+		ThreadPoolStatistics getStatistics() const;
+
+	private:
+		struct WorkerQueue {
+			// Remaining task range of the worker, first task in the low and end in the high 32 bits
+			std::atomic<unsigned long long> taskRange;
+			char padding[64 - sizeof(std::atomic<unsigned long long>)];
+		};
+
+		void run(int count, const std::vector<int>* taskBounds, const ParallelRangeFunction& function);
+		void runWorker(int workerIndex);
+		void runJob(int workerIndex);
+		void runRange(int workerIndex);
+		void runTasks(int workerIndex);
+		void runTask(int taskIndex, int workerIndex);
+		int popTask(int workerIndex);
+		int stealTask(int workerIndex);
+
+		std::vector<std::thread> m_threads;
+		std::mutex m_mutex;
+		std::condition_variable m_startCondition;
+		std::condition_variable m_finishCondition;
+		const ParallelRangeFunction* m_function;
+		const std::vector<int>* m_taskBounds;
+		WorkerQueue* m_workerQueues;
+		int m_count;
+		int m_workerCount;
+		int m_pendingWorkerCount;
+		unsigned int m_generation;
+		bool m_isStopping;
+
+		ThreadPoolStatistics m_statistics;
+	};
+}
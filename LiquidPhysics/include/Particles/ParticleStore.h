@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include "Math/Vector3D.h"
+
+namespace LiPhEn {
+	class SPHParticle;
+
+	// Structure of arrays storage of all particle attributes used by the CPU solvers. Entry i belongs to the
+	// particle handle getParticle(i), which reads and writes its attributes through the store once it is added.
+	class ParticleStore
+	{
+	public:
+		ParticleStore();
+		~ParticleStore();
+
+		void addParticle(SPHParticle* particle);
+		void clear();
+
+		void integrate(int index, float deltaTime);
+		void aproximateVelocity(int index);
+
+		// Moves the particle at order[i] to entry i, the handles follow their particles
+		void reorder(const std::vector<int>& order);
+		// Orders the particles along a Morton (Z-order) curve through cells of size cellSize,
+		// so particles close to each other in space are also close to each other in memory
+		void sortByMortonCode(float cellSize);
+
+		int getSize() const;
+		SPHParticle* getParticle(int index) const;
+		const std::vector<SPHParticle*>& getParticles() const;
+
+		std::vector<Vector3D>& getPositions();
+		std::vector<Vector3D>& getVelocities();
+		std::vector<Vector3D>& getHalfVelocities();
+		std::vector<Vector3D>& getOldHalfVelocities();
+		std::vector<Vector3D>& getAccumulatedForces();
+		std::vector<float>& getDensities();
+		std::vector<float>& getPressures();
+		std::vector<unsigned int>& getIsFirstTimeSteps();
+
+		std::vector<Vector3D>& getPredictedPositions();
+		std::vector<Vector3D>& getPredictedHalfVelocities();
+		std::vector<Vector3D>& getPredictedPressureForces();
+		std::vector<float>& getPredictedDensities();
+		std::vector<float>& getDensityErrors();
+
+		std::vector<float>& getDFSPHFactors();
+		std::vector<float>& getDFSPHStiffnesses();
+
+	private:
+		static unsigned long long calcMortonCode(unsigned int i, unsigned int j, unsigned int k);
+
+		std::vector<SPHParticle*> m_particles;
+		std::vector<std::pair<unsigned long long, int>> m_mortonCodes;
+		std::vector<int> m_sortOrder;
+
+		std::vector<Vector3D> m_positions;
+		std::vector<Vector3D> m_velocities;
+		std::vector<Vector3D> m_halfVelocities;
+		std::vector<Vector3D> m_oldHalfVelocities;
+		std::vector<Vector3D> m_accumulatedForces;
+		std::vector<float> m_densities;
+		std::vector<float> m_pressures;
+		std::vector<unsigned int> m_isFirstTimeSteps;
+
+		// PCISPH, DFSPH also keeps its predicted velocities in m_predictedHalfVelocities
+		std::vector<Vector3D> m_predictedPositions;
+		std::vector<Vector3D> m_predictedHalfVelocities;
+		std::vector<Vector3D> m_predictedPressureForces;
+		std::vector<float> m_predictedDensities;
+		std::vector<float> m_densityErrors;
+
+		// DFSPH
+		std::vector<float> m_dfsphFactors;
+		std::vector<float> m_dfsphStiffnesses;
+	};
+}
@@ -3,16 +3,20 @@
 #include "Math/Vector3D.h"
 
 namespace LiPhEn {
+	class ParticleStore;
+
+	// Handle to one particle. Until the particle is added to a solver it keeps its attributes itself,
+	// afterwards they live in the solver's ParticleStore and the getters and setters forward to it.
 	class SPHParticle
 	{
+		friend class ParticleStore;
+
 	public:
 		SPHParticle();
 		virtual ~SPHParticle();
 
 		void clearAccumulatedForces();              
 		void addForce(const Vector3D& force);
-		void integrate(float deltaTime);
-		void aproximateVelocity();
 
 		Vector3D getPosition() const;
 		Vector3D getVelocity() const;
@@ -31,6 +35,9 @@ namespace LiPhEn {
 		void setIsFirstTimeStep(const bool isFirstTimeStep);
 
 	protected:
+		ParticleStore* m_store;
+		int m_index;
+
 		Vector3D m_position;
 		Vector3D m_velocity;
 		Vector3D m_halfVelocity;
@@ -8,6 +8,19 @@ namespace LiPhEn {
 		virtual ~PhysicSolver();
 
 		void update(float deltaTime);
+		// Advances the simulation by frameTime in as many steps as needed and returns their number. The steps are
+		// maxTimeStep long, with adaptive time stepping they are limited by calcMaxTimeStep and at least minTimeStep long.
+		int advance(float frameTime);
+
+		bool isAdaptiveTimeStepping() const;
+		float getMinTimeStep() const;
+		float getMaxTimeStep() const;
+		float getLastTimeStep() const;
+
+		void setAdaptiveTimeStepping(bool isAdaptiveTimeStepping);
+		// Non positive time steps are ignored
+		void setMinTimeStep(float minTimeStep);
+		void setMaxTimeStep(float maxTimeStep);
 
 	protected:
 		virtual void onBeginUpdate() = 0;
@@ -15,5 +28,13 @@ namespace LiPhEn {
 		virtual void integrate(float deltaTime) = 0;
 		virtual void handleCollisions() = 0;
 		virtual void onEndUpdate() = 0;
+		// Largest time step that keeps the simulation stable in its current state
+		virtual float calcMaxTimeStep() = 0;
+
+	private:
+		bool m_isAdaptiveTimeStepping;
+		float m_minTimeStep;
+		float m_maxTimeStep;
+		float m_lastTimeStep;
 	};
-}
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include "Math/Vector3D.h"
+#include "SPHSpatialGrid.h"
+
+namespace LiPhEn {
+	struct SPHNeighborListStatistics {
+		int buildCount;
+		int reuseCount;
+
+		float getReuseRatio() const;
+	};
+
+	// Neighbors of all particles in compressed sparse row layout: the neighbors of particle i are the entries
+	// m_offsets[i] ... m_offsets[i + 1] - 1 of the flat index, distance and direction arrays. The direction points
+	// from the neighbor to the particle and is normalized (zero for the particle itself). The neighbors j > i are stored
+	// after all others, starting at getUpperNeighborOffset(i), so symmetric passes can visit every pair only once.
+	// Workers first append into their own buffers, which are then merged into the flat arrays. All arrays keep their
+	// capacity between builds, so no memory is allocated once the particle count has settled.
+	class SPHNeighborList
+	{
+	public:
+		SPHNeighborList();
+		~SPHNeighborList();
+
+		// Starts a new build, every particle has to be passed to findNeighbors exactly once afterwards
+		void beginBuild(int particleCount, int workerCount);
+		void findNeighbors(int particleIndex, int workerIndex, const SPHSpatialGrid& grid, const std::vector<Vector3D>& positions, float searchRadius);
+		// Computes the offsets, has to be called after all particles were found and before mergeNeighbors
+		void calcOffsets();
+		// Copies the neighbors of the particles begin ... end - 1 from the worker buffers into the flat arrays
+		void mergeNeighbors(int begin, int end);
+		// Recomputes the distances and directions of the particles begin ... end - 1 for moved positions
+		void updateNeighbors(int begin, int end, const std::vector<Vector3D>& positions);
+		void clear();
+
+		int getParticleCount() const;
+		// Sum of the grid query counts of all workers since beginBuild
+		SPHSpatialGridQueryCounts getQueryCounts() const;
+		int getTotalNeighborCount() const;
+		int getNeighborCount(int particleIndex) const;
+		int getUpperNeighborOffset(int particleIndex) const;
+		const int* getNeighborIndices(int particleIndex) const;
+		const float* getNeighborDistances(int particleIndex) const;
+		const Vector3D* getNeighborDirections(int particleIndex) const;
+
+	private:
+		struct WorkerBuffer {
+			std::vector<int> candidates;
+			std::vector<int> neighborIndices;
+			std::vector<float> neighborDistances;
+			std::vector<Vector3D> neighborDirections;
+			SPHSpatialGridQueryCounts queryCounts;
+		};
+
+		std::vector<WorkerBuffer> m_workerBuffers;
+		std::vector<int> m_particleWorkers;
+		std::vector<int> m_workerOffsets;
+		std::vector<int> m_offsets;
+		std::vector<int> m_upperNeighborOffsets;
+		std::vector<int> m_neighborIndices;
+		std::vector<float> m_neighborDistances;
+		std::vector<Vector3D> m_neighborDirections;
+	};
+}
@@ -2,10 +2,13 @@
 
 #include "PhysicSolver.h"
 #include "Particles/SPHParticle.h"
+#include "Particles/ParticleStore.h"
 #include "Kernels/DefaultKernel.h"
 #include "Kernels/PressureKernel.h"
 #include "Kernels/ViscosityKernel.h"
+#include "Kernels/SIMDKernels.h"
 #include "SPHSpatialGrid.h"
+#include "SPHNeighborList.h"
 #include <vector>
 #include <algorithm>
 #include <unordered_map>
@@ -13,13 +16,31 @@
 #include "Collision/StaticCollisionSphere.h"
 #include "Parallelization/ParallelComputationInterface.h"
 #include "Parallelization/ParallelSPHStructs.h"
+#include "Parallelization/ThreadPool.h"
 #include <iostream>
 
 namespace LiPhEn {
 	enum class ParallelizationType {
 		NONE,
 		CPU,
-		GPU
+		GPU,
+		THREADS
+	};
+
+	// Particle data read back asynchronously into page-locked host memory
+	struct ParallelParticleReadback {
+		ParallelBuffer* positionsBuffer;
+		ParallelBuffer* velocitiesBuffer;
+		ParallelBuffer* halfVelocitiesBuffer;
+		ParallelBuffer* isFirstTimeStepsBuffer;
+		float4* positions;
+		float4* velocities;
+		float4* halfVelocities;
+		unsigned int* isFirstTimeSteps;
+		ParallelEvent* completionEvent;
+		int capacity;
+		int particleCount;
+		bool isPending;
 	};
 
     class SPHSolver : public PhysicSolver
@@ -37,6 +58,16 @@ namespace LiPhEn {
         void cleanUp();
 
 		ParallelizationType getParallelizationType() const;
+		SPHSpatialGridType getSpatialGridType() const;
+		SPHSpatialGridStatistics getSpatialGridStatistics() const;
+		ThreadPoolStatistics getThreadPoolStatistics() const;
+		SIMDInstructionSet getSIMDInstructionSet() const;
+		float getNeighborSkinFactor() const;
+		int getParticleReorderInterval() const;
+		bool isForceEvaluationSymmetric() const;
+		bool isDeviceResident() const;
+		int getParticleReadbackInterval() const;
+		SPHNeighborListStatistics getNeighborListStatistics() const;
         Vector3D getGravity() const;
         int getParticleCount() const;
 		float getParticleRadius() const;
@@ -51,11 +82,35 @@ namespace LiPhEn {
         float getSurfaceTensionThreshold() const;
 		float getResitutionCoefficient() const;
         float getFrictionCoefficient() const;
+		float getCourantFactor() const;
 		bool hasGPU() const;
 		bool hasCPU() const;
+		bool isGraphicsSharingEnabled() const;
+		// True if the particles are computed on a device whose context shares buffers with OpenGL
+		bool hasGraphicsSharing() const;
+		// False if writeGraphicsBuffers returns -1 without writing, e.g. on the host backends or after sharing failed
+		bool canWriteGraphicsBuffers() const;
 
 		void setHasCollisionObjectDataChanged(bool hasCollisionObjectDataChanged);
 		void setParallelizationType(ParallelizationType parallelizationType);
+		void setSpatialGridType(SPHSpatialGridType spatialGridType);
+		void resetThreadPoolStatistics();
+		void setSIMDInstructionSet(SIMDInstructionSet instructionSet);
+		void setNeighborSkinFactor(float neighborSkinFactor);
+		void setParticleReorderInterval(int particleReorderInterval);
+		// Off by default, the per worker pair sums grow with the worker count and the SIMD full neighbor list passes are as fast for PCISPH
+		void setForceEvaluationSymmetric(bool isForceEvaluationSymmetric);
+		void setDeviceResident(bool isDeviceResident);
+		void setParticleReadbackInterval(int particleReadbackInterval);
+		// Blocking readback of the device particle data, brings the particles up to date in device resident mode
+		void synchronizeParticleData();
+		// Falls back to the host particle data if the device can not share buffers with OpenGL (see writeGraphicsBuffers)
+		void setGraphicsSharingEnabled(bool isGraphicsSharingEnabled);
+		// Writes the translations (3 floats) and colors (4 floats) of up to instanceCapacity particles directly into the given
+		// OpenGL buffers and returns the number of written instances, -1 without graphics sharing. Has to be called with the
+		// OpenGL context current, the first call recreates the device context to share with it.
+		int writeGraphicsBuffers(unsigned int translationsBuffer, unsigned int colorsBuffer, int instanceCapacity, bool haveBuffersChanged);
+		void resetNeighborListStatistics();
         void setGravity(const Vector3D& gravity);
 		void setParticleRadius(float particleRadius);
 		void setKernelRadiusFactor(float kernelRadiusFactor);
@@ -67,6 +122,8 @@ namespace LiPhEn {
         void setSurfaceTensionThreshold(float surfaceTensionThreshold);
         void setRestitutionCoefficient(float resitutionCoefficient);
         void setFrictionCoefficient(float frictionCoefficient);
+		// Fraction of the particle diameter a particle may move per adaptive time step
+		void setCourantFactor(float courantFactor);
 
 	protected:
 		virtual void onBeginUpdate();
@@ -75,15 +132,41 @@ namespace LiPhEn {
 		virtual void integrate(float deltaTime);
 		virtual void handleCollisions();
 		virtual void onEndUpdate();
+		// Minimum of the CFL condition, the force bound and the viscosity bound
+		virtual float calcMaxTimeStep();
 
 		ParticleCollisionData handleCollision(ParticleCollisionData particleData);
 
-		std::vector<SPHParticle*> m_particles;
+		// Runs function over particle ranges, spread over the thread pool for ParallelizationType::THREADS
+		void forEachParticle(const ParallelRangeFunction& function);
+		// Runs function over ranges of the grid's sorted particle order, as work stealing tasks for ParallelizationType::THREADS
+		void forEachParticleBalanced(const ParallelRangeFunction& function);
+		int getWorkerCount() const;
+		bool isComputedOnHost() const;
+		// Per worker sums of symmetric pair terms, each worker adds to its own array to avoid write conflicts
+		void clearWorkerPairSums();
+		Vector3D reduceWorkerPairSums(int particleIndex) const;
+
+		ParticleStore m_particleStore;
 		SPHSpatialGrid m_spatialGrid;
-		std::vector<std::vector<SPHParticle*>> m_cachedNeighborLists;
+		SPHNeighborList m_neighborList;
+		// Neighbor lists are built with kernel radius * (1 + m_neighborSkinFactor) and reused until a particle moved more than half the skin
+		float m_neighborSkinFactor;
+		bool m_hasNeighborListChanged;
+		std::vector<Vector3D> m_neighborListPositions;
+		std::vector<float> m_workerMaxDisplacements;
+		SPHNeighborListStatistics m_neighborListStatistics;
+		// The particle storage is sorted every m_particleReorderInterval steps, 0 disables it. The host sorts along a Morton
+		// curve, the device gathers the particles in grid cell order and only sorts the particle indices in between
+		int m_particleReorderInterval;
+		int m_stepsSinceParticleReorder;
+		// Pressure and viscosity pair terms are evaluated once per pair and applied to both particles
+		bool m_isForceEvaluationSymmetric;
+		std::vector<std::vector<Vector3D>> m_workerPairSums;
 		DefaultKernel m_defaultKernel;
 		PressureKernel m_pressureKernel;
 		ViscosityKernel m_viscosityKernel;
+		SIMDKernels m_simdKernels;
 		float m_particleRadius;
 		float m_kernelRadius;
 		float m_kernelRadiusFactor;
@@ -97,15 +180,73 @@ namespace LiPhEn {
 		float m_surfaceTensionThreshold;
 		float m_restitutionCoefficient;
         float m_frictionCoefficient;
+		float m_courantFactor;
+		// Per worker maxima of the squared speed and acceleration for the adaptive time step
+		std::vector<float> m_workerMaxSpeeds2;
+		std::vector<float> m_workerMaxAccelerations2;
         Vector3D m_gravity;
 
 		// OpenCL
 		virtual void reinitParallelContext();
 		virtual void initParallelBuffers();
 		void buildParallelGrid();
+		// Exclusive prefix sum of valueCount uints on the device, the block sums of every level are scanned recursively
+		void scanParallelBuffer(ParallelBuffer* buffer, unsigned int valueCount, unsigned int level = 0);
+		// Writes m_parallelSPHParameters into the constant buffer of the kernels if it changed since the last upload
+		void uploadParallelParameters();
+		void reduceParallelBounds();
+		// Reduces the maximum speed and acceleration of the device particles and starts reading them back
+		void reduceParallelTimeStepBounds();
+		void readParticleData();
+		void readParticleDataAsync();
+		void applyParticleReadback(ParallelParticleReadback& readback);
+		void releaseParticleReadback(ParallelParticleReadback& readback);
+		void releaseParticleReadbacks();
+		void releaseGraphicsBuffers();
 
 		ParallelizationType m_parallelizationType;
 
+		// In device resident mode the particles stay on the device between steps and are only read back every
+		// m_particleReadbackInterval steps (0 only on demand), double buffered so the host never waits for the device
+		bool m_isDeviceResident;
+		int m_particleReadbackInterval;
+		int m_stepsSinceParticleReadback;
+		ParallelParticleReadback m_particleReadbacks[2];
+		int m_particleReadbackIndex;
+		// The grid is built from the particle bounds of the step before the last one, reduced on the device
+		float4 m_boundsReadbacks[2][2];
+		ParallelEvent* m_boundsReadbackEvents[2];
+		bool m_hasBoundsReadback[2];
+		int m_boundsReadbackIndex;
+		unsigned int m_boundsGroupCount;
+		// The time step bounds reduced on the device are read back without blocking and used by the next calcMaxTimeStep
+		std::vector<float> m_timeStepBoundsReadback;
+		ParallelEvent* m_timeStepBoundsReadbackEvent;
+		bool m_hasTimeStepBoundsReadback;
+
+		// New particles are uploaded on the transfer queue, the computation only waits for them when it needs them. The
+		// computation of the next step waits for a pending readback before it overwrites the particles
+		std::vector<float4> m_uploadPositions;
+		std::vector<float4> m_uploadVelocities;
+		std::vector<float4> m_uploadHalfVelocities;
+		std::vector<unsigned int> m_uploadIsFirstTimeSteps;
+		ParallelEvent* m_uploadEvent;
+		bool m_isUploadPending;
+		ParallelEvent* m_computeMarkerEvent;
+		ParallelEvent* m_pendingReadbackEvent;
+
+		// OpenGL buffers the particle instance data is written into, wrapped for the device
+		bool m_isGraphicsSharingEnabled;
+		bool m_hasGraphicsSharingFailed;
+		ParallelBuffer* m_sharedTranslationsBuffer;
+		ParallelBuffer* m_sharedColorsBuffer;
+		unsigned int m_sharedTranslationsGraphicsBuffer;
+		unsigned int m_sharedColorsGraphicsBuffer;
+
+		ThreadPool* m_threadPool;
+		std::vector<int> m_particleTaskBounds;
+		static const int s_tasksPerWorker = 16;
+
 		ParallelComputationInterface* m_parallelComputationInterface;
 
 		ParallelBuffer* m_positionsBuffer1;
@@ -118,6 +259,8 @@ namespace LiPhEn {
 		ParallelBuffer* m_isFirstTimeStepsBuffer2;
 		ParallelBuffer* m_gridIndicesBuffer1;
 		ParallelBuffer* m_gridIndicesBuffer2;
+		ParallelBuffer* m_particleIndicesBuffer1;
+		ParallelBuffer* m_particleIndicesBuffer2;
 		ParallelBuffer* m_oldHalfVelocitiesBuffer;
 		ParallelBuffer* m_accumulatedForcesBuffer;
 		ParallelBuffer* m_densitiesBuffer;
@@ -131,35 +274,63 @@ namespace LiPhEn {
 		ParallelBuffer* m_collisionBoxesBuffer;
 		ParallelBuffer* m_collisionSpheresBuffer;
 		ParallelBuffer* m_bucketCountsBuffer;
-		ParallelBuffer* m_cellListBuffer;
+		ParallelBuffer* m_cellStartsBuffer;
+		ParallelBuffer* m_cellEndsBuffer;
+		ParallelBuffer* m_minBoundsBuffer;
+		ParallelBuffer* m_maxBoundsBuffer;
+		ParallelBuffer* m_timeStepBoundsBuffer;
+		std::vector<ParallelBuffer*> m_scanBlockSumsBuffers;
 
+		ParallelKernel* m_reduceBoundsKernel;
+		ParallelKernel* m_reduceTimeStepBoundsKernel;
 		ParallelKernel* m_calcGridIndicesKernel;
 		ParallelKernel* m_countDigitsInBucketsKernel;
 		ParallelKernel* m_scanBucketsKernel;
-		ParallelKernel* m_permuteParticlesKernel;
+		ParallelKernel* m_addBlockOffsetsKernel;
+		ParallelKernel* m_permuteSortKeysKernel;
+		ParallelKernel* m_gatherParticlesKernel;
 		ParallelKernel* m_buildCellListKernel;
 		ParallelKernel* m_calcDensityPressureKernel;
 		ParallelKernel* m_accumulateNonPressureForcesKernel;
 		ParallelKernel* m_accumulatePressureForcesKernel;
 		ParallelKernel* m_integrateKernel;
 		ParallelKernel* m_handleCollisionsKernel;
+		ParallelKernel* m_writeInstanceDataKernel;
 
 		ParallelSPHParameters m_parallelSPHParameters;
+		// Double buffered, so the host can fill in the next parameters while the last upload may still be pending
+		ParallelBuffer* m_parametersBuffer;
+		ParallelSPHParameters m_parametersUploads[2];
+		ParallelEvent* m_parametersUploadEvents[2];
+		bool m_isParametersUploadPending[2];
+		int m_parametersUploadIndex;
+		bool m_hasUploadedParameters;
 		unsigned int m_radixThreadCount;
 		unsigned int m_radixWidth;
 		unsigned int m_radixBucketCount;
 		unsigned int m_radixPassCount;
 		unsigned int m_workGroupSize;
+		unsigned int m_scanWorkGroupSize;
 		unsigned int m_dummyParticleCount;
+		// Device particle buffers hold m_particleCapacity particles, the first m_uploadedParticleCount are in sync with the host
+		unsigned int m_particleCapacity;
+		int m_uploadedParticleCount;
+		int m_firstNewParticleIndex;
+		unsigned int m_cellListCapacity;
 
 		bool m_hasParallelContextChanged;
 		bool m_hasCollisionObjectDataChanged;
 		bool m_hasParticleDataChanged;
 		bool m_hasKernelWeightDataChanged;
+		// Set whenever the particle radius, kernel radius or rest density changed, subclasses reset it after updating derived constants
+		bool m_hasParticleMassChanged;
 
 	private:
 		virtual void accumulateForces(float deltaTime);
+		void reorderParticles();
 		void buildCachedNeighborLists();
+		float calcMaxNeighborListDisplacement();
+		void buildParticleTasks();
 		void calcParticleDensityPressure();
 		void recalcParticleMass();
 		void recalcKernelRadius();
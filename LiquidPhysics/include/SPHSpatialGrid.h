@@ -1,10 +1,37 @@
 #pragma once
 
-#include <unordered_map>
 #include <vector>
-#include "Particles/SPHParticle.h"
+#include "Math/Vector3D.h"
 
 namespace LiPhEn {
+	enum class SPHSpatialGridType {
+		AUTOMATIC,
+		DENSE,
+		HASHED
+	};
+
+	struct SPHSpatialGridStatistics {
+		int bucketCount;
+		int occupiedBucketCount;
+		int maxBucketLoad;
+		long long visitedEntryCount;
+		long long falsePositiveCount;
+
+		float getBucketOccupancy() const;
+		float getFalsePositiveRate() const;
+	};
+
+	// Bucket entries visited by hashed neighbor queries, every worker counts its own queries
+	struct SPHSpatialGridQueryCounts {
+		long long visitedEntryCount;
+		long long falsePositiveCount;
+	};
+
+	// Uniform grid with the particle indices counting sorted by cell, so the particles of cell (or bucket) c are
+	// m_sortedParticleIndices[m_cellStarts[c]] ... m_sortedParticleIndices[m_cellStarts[c + 1] - 1].
+	// DENSE spans the bounding box of the particles. HASHED maps unbounded cell coordinates into a power of two
+	// table with large prime XOR hashing and stores the cell coordinates per entry to reject colliding cells.
+	// AUTOMATIC picks HASHED once the bounding box has many more cells than there are particles.
 	class SPHSpatialGrid
 	{
 	public:
@@ -12,18 +39,52 @@ namespace LiPhEn {
 		SPHSpatialGrid(float gridSpacing);
 		~SPHSpatialGrid();
 
-		void build(std::vector<SPHParticle*> particles);
+		void build(const std::vector<Vector3D>& positions);
 		void clear();
-		std::vector<SPHParticle*> findNeighborParticles(SPHParticle* particle, float searchRadius);
+		void findNeighborParticles(const Vector3D& position, float searchRadius, std::vector<int>& neighborIndices, SPHSpatialGridQueryCounts& queryCounts) const;
+		// Adds the counts of a neighbor search to the statistics
+		void addQueryCounts(const SPHSpatialGridQueryCounts& queryCounts);
+		void resetStatistics();
 
+		SPHSpatialGridType getType() const;
+		bool isHashed() const;
+		int getCellCount() const;
+		const std::vector<int>& getCellStarts() const;
+		const std::vector<int>& getSortedParticleIndices() const;
 		float getGridSpacing() const;
+		SPHSpatialGridStatistics getStatistics() const;
+
+		void setType(SPHSpatialGridType type);
 		void setGridSpacing(float gridSpacing);
 
 	private:
-		int calcHashValue(SPHParticle* particle);
-		int calcHashValue(int i, int j, int k);
+		void buildDense(const std::vector<Vector3D>& positions, float minPosition[3], float maxPosition[3]);
+		void buildHashed(const std::vector<Vector3D>& positions);
+		void findNeighborParticlesDense(const Vector3D& position, float searchRadius, std::vector<int>& neighborIndices) const;
+		void findNeighborParticlesHashed(const Vector3D& position, float searchRadius, std::vector<int>& neighborIndices, SPHSpatialGridQueryCounts& queryCounts) const;
+		int calcCellCoordinate(float position, float gridOffset, int gridSize) const;
+		int calcCellIndex(int i, int j, int k) const;
+		int calcUnboundedCellCoordinate(float position) const;
+		int calcHashValue(int i, int j, int k) const;
 
-		std::unordered_map<int, std::vector<SPHParticle*>> m_hashedGrid;
+		static const int s_maxDenseCellsPerParticle = 8;
+
+		SPHSpatialGridType m_type;
+		bool m_isHashed;
+		std::vector<int> m_cellStarts;
+		std::vector<int> m_cellCursors;
+		std::vector<int> m_particleCellIndices;
+		std::vector<int> m_sortedParticleIndices;
+		std::vector<Vector3D> m_sortedPositions;
+		std::vector<int> m_sortedCellCoordinates;
+		float m_gridOffset[3];
+		int m_gridSize[3];
+		int m_cellCount;
 		float m_gridSpacing;
+
+		int m_occupiedBucketCount;
+		int m_maxBucketLoad;
+		long long m_visitedEntryCount;
+		long long m_falsePositiveCount;
 	};
-}
\ No newline at end of file
+}
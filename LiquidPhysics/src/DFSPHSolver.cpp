@@ -0,0 +1,399 @@
+#include "DFSPHSolver.h"
+
+#include <climits>
+
+namespace LiPhEn {
+	DFSPHSolver::DFSPHSolver()
+	{
+		m_maxDensityIterations = 100;
+		m_maxDivergenceIterations = 100;
+		m_maxDensityErrorRatio = 0.001f;
+		m_maxDivergenceErrorRatio = 0.01f;
+		m_convergenceCheckInterval = 2;
+
+		m_predictedVelocitiesBuffer = NULL;
+		m_factorsBuffer = NULL;
+		m_stiffnessesBuffer = NULL;
+		m_groupDensityErrorsBuffer = NULL;
+		m_predictedBufferCapacity = 0;
+		m_convergedIterationsBuffer = NULL;
+
+		m_dfsphInitKernel = NULL;
+		m_dfsphPredictVelocitiesKernel = NULL;
+		m_dfsphCalcStiffnessKernel = NULL;
+		m_dfsphCorrectVelocitiesKernel = NULL;
+		m_dfsphApplyVelocitiesKernel = NULL;
+
+		// the context was already created by the base class constructor, which can not reach the overridden version
+		if (!isComputedOnHost())
+			initParallelKernels();
+	}
+
+	DFSPHSolver::~DFSPHSolver()
+	{
+		delete m_predictedVelocitiesBuffer;
+		delete m_factorsBuffer;
+		delete m_stiffnessesBuffer;
+		delete m_groupDensityErrorsBuffer;
+		delete m_convergedIterationsBuffer;
+
+		delete m_dfsphInitKernel;
+		delete m_dfsphPredictVelocitiesKernel;
+		delete m_dfsphCalcStiffnessKernel;
+		delete m_dfsphCorrectVelocitiesKernel;
+		delete m_dfsphApplyVelocitiesKernel;
+	}
+
+	void DFSPHSolver::accumulatePressureForces(float deltaTime)
+	{
+		if (isComputedOnHost())
+		{
+			std::vector<Vector3D>& velocities = m_particleStore.getVelocities();
+			std::vector<Vector3D>& halfVelocities = m_particleStore.getHalfVelocities();
+			std::vector<Vector3D>& accumulatedForces = m_particleStore.getAccumulatedForces();
+			std::vector<float>& densities = m_particleStore.getDensities();
+			std::vector<unsigned int>& isFirstTimeSteps = m_particleStore.getIsFirstTimeSteps();
+			std::vector<Vector3D>& predictedVelocities = m_particleStore.getPredictedHalfVelocities();
+			std::vector<float>& factors = m_particleStore.getDFSPHFactors();
+			const std::vector<int>& sortedParticleIndices = m_spatialGrid.getSortedParticleIndices();
+
+			// DFSPH Init
+			forEachParticleBalanced([&](int begin, int end, int /*workerIndex*/) {
+				for (int sortedIndex = begin; sortedIndex < end; sortedIndex++) {
+					int i = sortedParticleIndices[sortedIndex];
+					int neighborCount = m_neighborList.getNeighborCount(i);
+					const float* neighborDistances = m_neighborList.getNeighborDistances(i);
+					const Vector3D* neighborDirections = m_neighborList.getNeighborDirections(i);
+
+					// Factor that maps the density error to the stiffness of a particle
+					Vector3D gradientSum;
+					float gradientSquareSum = 0.f;
+					for (int n = 0; n < neighborCount; n++)
+					{
+						Vector3D gradient = neighborDirections[n] * (m_particleMass * m_pressureKernel.getFirstDerivativeWeight(neighborDistances[n]));
+						gradientSum += gradient;
+						gradientSquareSum += gradient.squareMagnitude();
+					}
+
+					float denominator = gradientSum.squareMagnitude() + gradientSquareSum;
+					factors[i] = denominator > 1e-6f ? 1.f / denominator : 0.f;
+
+					// The velocities are corrected directly, so the integration starts without the half step offset
+					if (isFirstTimeSteps[i])
+					{
+						halfVelocities[i] = velocities[i];
+						isFirstTimeSteps[i] = false;
+					}
+					predictedVelocities[i] = halfVelocities[i];
+				}
+			});
+
+			// The density change rate is removed before the non pressure forces act
+			correctVelocities(DIVERGENCE_SOLVE, m_maxDivergenceIterations, m_maxDivergenceErrorRatio * m_restDensity * deltaTime, deltaTime);
+
+			// DFSPH Predict Velocities
+			forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+				for (int i = begin; i < end; i++) {
+					predictedVelocities[i] += accumulatedForces[i] * (deltaTime / densities[i]);
+				}
+			});
+
+			correctVelocities(DENSITY_SOLVE, m_maxDensityIterations, m_maxDensityErrorRatio * m_restDensity, deltaTime);
+
+			// DFSPH Apply Velocities
+			forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+				for (int i = begin; i < end; i++) {
+					accumulatedForces[i] = (predictedVelocities[i] - halfVelocities[i]) * (densities[i] / deltaTime);
+				}
+			});
+		}
+		else
+		{
+			// DFSPH Init
+			m_dfsphInitKernel->setArgument(0, m_positionsBuffer1);
+			m_dfsphInitKernel->setArgument(1, m_velocitiesBuffer1);
+			m_dfsphInitKernel->setArgument(2, m_halfVelocitiesBuffer1);
+			m_dfsphInitKernel->setArgument(3, m_isFirstTimeStepsBuffer1);
+			m_dfsphInitKernel->setArgument(4, m_predictedVelocitiesBuffer);
+			m_dfsphInitKernel->setArgument(5, m_factorsBuffer);
+			m_dfsphInitKernel->setArgument(6, m_convergedIterationsBuffer);
+			m_dfsphInitKernel->setArgument(7, m_parametersBuffer);
+			m_dfsphInitKernel->setArgument(8, m_cellStartsBuffer);
+			m_dfsphInitKernel->setArgument(9, m_cellEndsBuffer);
+			m_dfsphInitKernel->setArgument(10, m_particleIndicesBuffer1);
+			m_dfsphInitKernel->setArgument(11, m_pressureKernelFirstDerivativeWeightsBuffer);
+			m_dfsphInitKernel->setArgument(12, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
+
+			m_parallelComputationInterface->executeKernel(m_dfsphInitKernel, m_dummyParticleCount, m_workGroupSize);
+
+			correctParallelVelocities(DIVERGENCE_SOLVE, m_maxDivergenceIterations, m_maxDivergenceErrorRatio * m_restDensity * deltaTime, deltaTime);
+
+			// DFSPH Predict Velocities
+			m_dfsphPredictVelocitiesKernel->setArgument(0, m_accumulatedForcesBuffer);
+			m_dfsphPredictVelocitiesKernel->setArgument(1, m_densitiesBuffer);
+			m_dfsphPredictVelocitiesKernel->setArgument(2, m_predictedVelocitiesBuffer);
+			m_dfsphPredictVelocitiesKernel->setArgument(3, m_parametersBuffer);
+			m_dfsphPredictVelocitiesKernel->setArgument(4, sizeof(deltaTime), &deltaTime);
+
+			m_parallelComputationInterface->executeKernel(m_dfsphPredictVelocitiesKernel, m_dummyParticleCount, m_workGroupSize);
+
+			correctParallelVelocities(DENSITY_SOLVE, m_maxDensityIterations, m_maxDensityErrorRatio * m_restDensity, deltaTime);
+
+			// DFSPH Apply Velocities
+			m_dfsphApplyVelocitiesKernel->setArgument(0, m_predictedVelocitiesBuffer);
+			m_dfsphApplyVelocitiesKernel->setArgument(1, m_halfVelocitiesBuffer1);
+			m_dfsphApplyVelocitiesKernel->setArgument(2, m_densitiesBuffer);
+			m_dfsphApplyVelocitiesKernel->setArgument(3, m_accumulatedForcesBuffer);
+			m_dfsphApplyVelocitiesKernel->setArgument(4, m_parametersBuffer);
+			m_dfsphApplyVelocitiesKernel->setArgument(5, sizeof(deltaTime), &deltaTime);
+
+			m_parallelComputationInterface->executeKernel(m_dfsphApplyVelocitiesKernel, m_dummyParticleCount, m_workGroupSize);
+		}
+	}
+
+	void DFSPHSolver::correctVelocities(SolveType solveType, int maxIterations, float maxError, float deltaTime)
+	{
+		int particleCount = m_particleStore.getSize();
+		std::vector<float>& densities = m_particleStore.getDensities();
+		std::vector<Vector3D>& predictedVelocities = m_particleStore.getPredictedHalfVelocities();
+		std::vector<float>& factors = m_particleStore.getDFSPHFactors();
+		std::vector<float>& stiffnesses = m_particleStore.getDFSPHStiffnesses();
+		const std::vector<int>& sortedParticleIndices = m_spatialGrid.getSortedParticleIndices();
+
+		float inverseDeltaTime2 = 1.f / (deltaTime * deltaTime);
+		for (int k = 0; k < maxIterations; k++)
+		{
+			// Compute stiffness from the predicted density error, every worker also sums the errors of its ranges
+			m_workerDensityErrors.assign(getWorkerCount(), 0.f);
+			forEachParticleBalanced([&](int begin, int end, int workerIndex) {
+				float workerDensityError = m_workerDensityErrors[workerIndex];
+				for (int sortedIndex = begin; sortedIndex < end; sortedIndex++) {
+					int i = sortedParticleIndices[sortedIndex];
+					int neighborCount = m_neighborList.getNeighborCount(i);
+					const int* neighborIndices = m_neighborList.getNeighborIndices(i);
+					const float* neighborDistances = m_neighborList.getNeighborDistances(i);
+					const Vector3D* neighborDirections = m_neighborList.getNeighborDirections(i);
+
+					Vector3D predictedVelocity = predictedVelocities[i];
+					float densityChange = 0.f;
+					for (int n = 0; n < neighborCount; n++)
+					{
+						int j = neighborIndices[n];
+						densityChange += ((predictedVelocity - predictedVelocities[j]) * neighborDirections[n]) * m_pressureKernel.getFirstDerivativeWeight(neighborDistances[n]);
+					}
+					densityChange *= m_particleMass * deltaTime;
+
+					// Only compression is corrected, particles at the free surface lack neighbors
+					float densityError = densityChange;
+					if (solveType == DENSITY_SOLVE)
+						densityError += densities[i] - m_restDensity;
+					densityError = std::max(densityError, 0.f);
+
+					stiffnesses[i] = densityError * factors[i] * inverseDeltaTime2;
+					workerDensityError += densityError;
+				}
+				m_workerDensityErrors[workerIndex] = workerDensityError;
+			});
+
+			float densityErrorSum = 0.f;
+			for (float workerDensityError : m_workerDensityErrors)
+			{
+				densityErrorSum += workerDensityError;
+			}
+
+			if (densityErrorSum <= maxError * particleCount)
+				break;
+
+			// Correct the predicted velocities with the stiffness of both particles of a pair
+			forEachParticleBalanced([&](int begin, int end, int /*workerIndex*/) {
+				for (int sortedIndex = begin; sortedIndex < end; sortedIndex++) {
+					int i = sortedParticleIndices[sortedIndex];
+					int neighborCount = m_neighborList.getNeighborCount(i);
+					const int* neighborIndices = m_neighborList.getNeighborIndices(i);
+					const float* neighborDistances = m_neighborList.getNeighborDistances(i);
+					const Vector3D* neighborDirections = m_neighborList.getNeighborDirections(i);
+
+					float stiffness = stiffnesses[i];
+					Vector3D velocityCorrection;
+					for (int n = 0; n < neighborCount; n++)
+					{
+						int j = neighborIndices[n];
+						velocityCorrection += neighborDirections[n] * ((stiffness + stiffnesses[j]) * m_pressureKernel.getFirstDerivativeWeight(neighborDistances[n]));
+					}
+					predictedVelocities[i] -= velocityCorrection * (m_particleMass * deltaTime);
+				}
+			});
+		}
+	}
+
+	void DFSPHSolver::correctParallelVelocities(SolveType solveType, int maxIterations, float maxError, float deltaTime)
+	{
+		unsigned int solveIndex = solveType;
+		float maxDensityErrorSum = maxError * m_parallelSPHParameters.particleCount;
+		for (int k = 0; k < maxIterations; k++)
+		{
+			unsigned int iteration = k;
+
+			// DFSPH Calc Stiffness
+			m_dfsphCalcStiffnessKernel->setArgument(0, m_positionsBuffer1);
+			m_dfsphCalcStiffnessKernel->setArgument(1, m_densitiesBuffer);
+			m_dfsphCalcStiffnessKernel->setArgument(2, m_predictedVelocitiesBuffer);
+			m_dfsphCalcStiffnessKernel->setArgument(3, m_factorsBuffer);
+			m_dfsphCalcStiffnessKernel->setArgument(4, m_stiffnessesBuffer);
+			m_dfsphCalcStiffnessKernel->setArgument(5, m_parametersBuffer);
+			m_dfsphCalcStiffnessKernel->setArgument(6, m_cellStartsBuffer);
+			m_dfsphCalcStiffnessKernel->setArgument(7, m_cellEndsBuffer);
+			m_dfsphCalcStiffnessKernel->setArgument(8, m_particleIndicesBuffer1);
+			m_dfsphCalcStiffnessKernel->setArgument(9, m_pressureKernelFirstDerivativeWeightsBuffer);
+			m_dfsphCalcStiffnessKernel->setArgument(10, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
+			m_dfsphCalcStiffnessKernel->setArgument(11, m_groupDensityErrorsBuffer);
+			m_dfsphCalcStiffnessKernel->setArgument(12, m_workGroupSize * sizeof(float), NULL);
+			m_dfsphCalcStiffnessKernel->setArgument(13, m_convergedIterationsBuffer);
+			m_dfsphCalcStiffnessKernel->setArgument(14, sizeof(solveIndex), &solveIndex);
+			m_dfsphCalcStiffnessKernel->setArgument(15, sizeof(iteration), &iteration);
+			m_dfsphCalcStiffnessKernel->setArgument(16, sizeof(deltaTime), &deltaTime);
+
+			m_parallelComputationInterface->executeKernel(m_dfsphCalcStiffnessKernel, m_dummyParticleCount, m_workGroupSize);
+
+			// DFSPH Correct Velocities
+			m_dfsphCorrectVelocitiesKernel->setArgument(0, m_positionsBuffer1);
+			m_dfsphCorrectVelocitiesKernel->setArgument(1, m_stiffnessesBuffer);
+			m_dfsphCorrectVelocitiesKernel->setArgument(2, m_predictedVelocitiesBuffer);
+			m_dfsphCorrectVelocitiesKernel->setArgument(3, m_parametersBuffer);
+			m_dfsphCorrectVelocitiesKernel->setArgument(4, m_cellStartsBuffer);
+			m_dfsphCorrectVelocitiesKernel->setArgument(5, m_cellEndsBuffer);
+			m_dfsphCorrectVelocitiesKernel->setArgument(6, m_particleIndicesBuffer1);
+			m_dfsphCorrectVelocitiesKernel->setArgument(7, m_pressureKernelFirstDerivativeWeightsBuffer);
+			m_dfsphCorrectVelocitiesKernel->setArgument(8, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
+			m_dfsphCorrectVelocitiesKernel->setArgument(9, m_groupDensityErrorsBuffer);
+			m_dfsphCorrectVelocitiesKernel->setArgument(10, m_workGroupSize * sizeof(float), NULL);
+			m_dfsphCorrectVelocitiesKernel->setArgument(11, m_convergedIterationsBuffer);
+			m_dfsphCorrectVelocitiesKernel->setArgument(12, sizeof(solveIndex), &solveIndex);
+			m_dfsphCorrectVelocitiesKernel->setArgument(13, sizeof(iteration), &iteration);
+			m_dfsphCorrectVelocitiesKernel->setArgument(14, sizeof(maxDensityErrorSum), &maxDensityErrorSum);
+			m_dfsphCorrectVelocitiesKernel->setArgument(15, sizeof(deltaTime), &deltaTime);
+
+			m_parallelComputationInterface->executeKernel(m_dfsphCorrectVelocitiesKernel, m_dummyParticleCount, m_workGroupSize);
+
+			// Same as PCISPH, only the flag of this solver is read back
+			if (m_convergenceCheckInterval > 0 && (k + 1) % m_convergenceCheckInterval == 0 && k + 1 < maxIterations)
+			{
+				unsigned int convergedIterations[2];
+				m_parallelComputationInterface->readFromBuffer(m_convergedIterationsBuffer, convergedIterations, sizeof(convergedIterations), true);
+				if (convergedIterations[solveIndex] != UINT_MAX)
+					break;
+			}
+		}
+	}
+
+	void DFSPHSolver::reinitParallelContext()
+	{
+		SPHSolver::reinitParallelContext();
+
+		// The predicted buffers belong to the old context
+		m_predictedBufferCapacity = 0;
+
+		initParallelKernels();
+	}
+
+	void DFSPHSolver::initParallelKernels()
+	{
+		if (m_convergedIterationsBuffer)
+			delete m_convergedIterationsBuffer;
+		m_convergedIterationsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, 2 * sizeof(unsigned int));
+
+		if (m_dfsphInitKernel)
+			delete m_dfsphInitKernel;
+		if (m_dfsphPredictVelocitiesKernel)
+			delete m_dfsphPredictVelocitiesKernel;
+		if (m_dfsphCalcStiffnessKernel)
+			delete m_dfsphCalcStiffnessKernel;
+		if (m_dfsphCorrectVelocitiesKernel)
+			delete m_dfsphCorrectVelocitiesKernel;
+		if (m_dfsphApplyVelocitiesKernel)
+			delete m_dfsphApplyVelocitiesKernel;
+
+		m_dfsphInitKernel = m_parallelComputationInterface->createKernel("dfsphInit");
+		m_dfsphPredictVelocitiesKernel = m_parallelComputationInterface->createKernel("dfsphPredictVelocities");
+		m_dfsphCalcStiffnessKernel = m_parallelComputationInterface->createKernel("dfsphCalcStiffness");
+		m_dfsphCorrectVelocitiesKernel = m_parallelComputationInterface->createKernel("dfsphCorrectVelocities");
+		m_dfsphApplyVelocitiesKernel = m_parallelComputationInterface->createKernel("dfsphApplyVelocities");
+	}
+
+	void DFSPHSolver::initParallelBuffers()
+	{
+		SPHSolver::initParallelBuffers();
+
+		// The predicted values are recomputed every step, so the buffers only follow the capacity of the particle buffers
+		if (m_predictedBufferCapacity == m_particleCapacity)
+			return;
+		m_predictedBufferCapacity = m_particleCapacity;
+
+		if (m_predictedVelocitiesBuffer)
+			delete m_predictedVelocitiesBuffer;
+		if (m_factorsBuffer)
+			delete m_factorsBuffer;
+		if (m_stiffnessesBuffer)
+			delete m_stiffnessesBuffer;
+		if (m_groupDensityErrorsBuffer)
+			delete m_groupDensityErrorsBuffer;
+
+		m_predictedVelocitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_predictedBufferCapacity * sizeof(float4));
+		m_factorsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_predictedBufferCapacity * sizeof(float));
+		m_stiffnessesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_predictedBufferCapacity * sizeof(float));
+		m_groupDensityErrorsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE,
+			((m_predictedBufferCapacity + m_workGroupSize - 1) / m_workGroupSize) * sizeof(float));
+	}
+
+	// GETTER
+	int DFSPHSolver::getMaxDensityIterations() const
+	{
+		return m_maxDensityIterations;
+	}
+
+	int DFSPHSolver::getMaxDivergenceIterations() const
+	{
+		return m_maxDivergenceIterations;
+	}
+
+	float DFSPHSolver::getMaxDensityErrorRatio() const
+	{
+		return m_maxDensityErrorRatio;
+	}
+
+	float DFSPHSolver::getMaxDivergenceErrorRatio() const
+	{
+		return m_maxDivergenceErrorRatio;
+	}
+
+	int DFSPHSolver::getConvergenceCheckInterval() const
+	{
+		return m_convergenceCheckInterval;
+	}
+
+	// SETTER
+	void DFSPHSolver::setMaxDensityIterations(int maxDensityIterations)
+	{
+		m_maxDensityIterations = maxDensityIterations;
+	}
+
+	void DFSPHSolver::setMaxDivergenceIterations(int maxDivergenceIterations)
+	{
+		m_maxDivergenceIterations = maxDivergenceIterations;
+	}
+
+	void DFSPHSolver::setMaxDensityErrorRatio(float maxDensityErrorRatio)
+	{
+		m_maxDensityErrorRatio = maxDensityErrorRatio;
+	}
+
+	void DFSPHSolver::setMaxDivergenceErrorRatio(float maxDivergenceErrorRatio)
+	{
+		m_maxDivergenceErrorRatio = maxDivergenceErrorRatio;
+	}
+
+	void DFSPHSolver::setConvergenceCheckInterval(int convergenceCheckInterval)
+	{
+		m_convergenceCheckInterval = convergenceCheckInterval;
+	}
+}
\ No newline at end of file
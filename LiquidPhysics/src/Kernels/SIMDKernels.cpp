@@ -0,0 +1,731 @@
+#include "Kernels/SIMDKernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define LIPHEN_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit instructions of the target attribute in a function, MSVC accepts all intrinsics anywhere
+#if defined(__GNUC__)
+#define LIPHEN_SIMD_TARGET(instructionSet) __attribute__((target(instructionSet)))
+#else
+#define LIPHEN_SIMD_TARGET(instructionSet)
+#endif
+
+namespace LiPhEn {
+	static_assert(sizeof(Vector3D) == 3 * sizeof(float), "The SIMD kernels read Vector3D arrays as packed xyz floats");
+
+	namespace {
+		float calcDensityKernelSumScalar(const float* positions, int particleIndex, const int* neighborIndices, int neighborCount,
+										 const SIMDKernelConstants& constants, int firstNeighbor = 0)
+		{
+			const float* position = positions + 3 * particleIndex;
+			float sum = 0.f;
+			for (int n = firstNeighbor; n < neighborCount; n++)
+			{
+				const float* neighborPosition = positions + 3 * neighborIndices[n];
+				float dx = neighborPosition[0] - position[0];
+				float dy = neighborPosition[1] - position[1];
+				float dz = neighborPosition[2] - position[2];
+				float temp = constants.radius2 - (dx * dx + dy * dy + dz * dz);
+				if (temp > 0.f)
+					sum += temp * temp * temp;
+			}
+			return sum;
+		}
+
+		void calcPressureGradientSumScalar(const float* positions, const float* densities, const float* pressures,
+										   int particleIndex, const int* neighborIndices, int neighborCount,
+										   const SIMDKernelConstants& constants, float* result, int firstNeighbor = 0)
+		{
+			const float* position = positions + 3 * particleIndex;
+			float tempFactor = pressures[particleIndex] / (densities[particleIndex] * densities[particleIndex]);
+			for (int n = firstNeighbor; n < neighborCount; n++)
+			{
+				int neighborIndex = neighborIndices[n];
+				if (neighborIndex == particleIndex)
+					continue;
+
+				const float* neighborPosition = positions + 3 * neighborIndex;
+				float dx = position[0] - neighborPosition[0];
+				float dy = position[1] - neighborPosition[1];
+				float dz = position[2] - neighborPosition[2];
+				float distance2 = dx * dx + dy * dy + dz * dz;
+				if (distance2 >= constants.radius2)
+					continue;
+
+				float distance = sqrtf(distance2);
+				float temp = constants.radius - distance;
+				float scale = constants.pressureGradientCoefficient * temp * temp / distance *
+					(tempFactor + pressures[neighborIndex] / (densities[neighborIndex] * densities[neighborIndex]));
+				result[0] += dx * scale;
+				result[1] += dy * scale;
+				result[2] += dz * scale;
+			}
+		}
+
+		float calcDistanceDensityKernelSumScalar(const float* neighborDistances, int neighborCount, const SIMDKernelConstants& constants,
+												 int firstNeighbor = 0)
+		{
+			float sum = 0.f;
+			for (int n = firstNeighbor; n < neighborCount; n++)
+			{
+				float temp = constants.radius2 - neighborDistances[n] * neighborDistances[n];
+				if (temp > 0.f)
+					sum += temp * temp * temp;
+			}
+			return sum;
+		}
+
+		// The direction of the particle itself is zero, so it needs no special treatment. Lists built with a skin
+		// contain neighbors beyond the kernel radius, which are skipped.
+		void calcDistancePressureGradientSumScalar(const float* densities, const float* pressures, int particleIndex, const int* neighborIndices,
+												   const float* neighborDistances, const float* neighborDirections, int neighborCount,
+												   const SIMDKernelConstants& constants, float* result, int firstNeighbor = 0)
+		{
+			float tempFactor = pressures[particleIndex] / (densities[particleIndex] * densities[particleIndex]);
+			for (int n = firstNeighbor; n < neighborCount; n++)
+			{
+				if (neighborDistances[n] >= constants.radius)
+					continue;
+
+				int neighborIndex = neighborIndices[n];
+				float temp = constants.radius - neighborDistances[n];
+				float scale = constants.pressureGradientCoefficient * temp * temp *
+					(tempFactor + pressures[neighborIndex] / (densities[neighborIndex] * densities[neighborIndex]));
+				result[0] += neighborDirections[3 * n] * scale;
+				result[1] += neighborDirections[3 * n + 1] * scale;
+				result[2] += neighborDirections[3 * n + 2] * scale;
+			}
+		}
+
+		float calcDensityKernelSumNone(const float* positions, int particleIndex, const int* neighborIndices, int neighborCount,
+									   const SIMDKernelConstants& constants)
+		{
+			return calcDensityKernelSumScalar(positions, particleIndex, neighborIndices, neighborCount, constants);
+		}
+
+		void calcPressureGradientSumNone(const float* positions, const float* densities, const float* pressures,
+										 int particleIndex, const int* neighborIndices, int neighborCount,
+										 const SIMDKernelConstants& constants, float* result)
+		{
+			calcPressureGradientSumScalar(positions, densities, pressures, particleIndex, neighborIndices, neighborCount, constants, result);
+		}
+
+		float calcDistanceDensityKernelSumNone(const float* neighborDistances, int neighborCount, const SIMDKernelConstants& constants)
+		{
+			return calcDistanceDensityKernelSumScalar(neighborDistances, neighborCount, constants);
+		}
+
+		void calcDistancePressureGradientSumNone(const float* densities, const float* pressures, int particleIndex, const int* neighborIndices,
+												 const float* neighborDistances, const float* neighborDirections, int neighborCount,
+												 const SIMDKernelConstants& constants, float* result)
+		{
+			calcDistancePressureGradientSumScalar(densities, pressures, particleIndex, neighborIndices, neighborDistances, neighborDirections,
+												  neighborCount, constants, result);
+		}
+
+#ifdef LIPHEN_SIMD_X86
+		// SSE has no gather, the four neighbors are loaded one by one
+		LIPHEN_SIMD_TARGET("sse2")
+		float calcDensityKernelSumSSE(const float* positions, int particleIndex, const int* neighborIndices, int neighborCount,
+									  const SIMDKernelConstants& constants)
+		{
+			const float* position = positions + 3 * particleIndex;
+			__m128 x = _mm_set1_ps(position[0]);
+			__m128 y = _mm_set1_ps(position[1]);
+			__m128 z = _mm_set1_ps(position[2]);
+			__m128 radius2 = _mm_set1_ps(constants.radius2);
+			__m128 zero = _mm_setzero_ps();
+			__m128 sum = zero;
+
+			int n = 0;
+			for (; n + 4 <= neighborCount; n += 4)
+			{
+				const float* p0 = positions + 3 * neighborIndices[n];
+				const float* p1 = positions + 3 * neighborIndices[n + 1];
+				const float* p2 = positions + 3 * neighborIndices[n + 2];
+				const float* p3 = positions + 3 * neighborIndices[n + 3];
+				__m128 dx = _mm_sub_ps(_mm_setr_ps(p0[0], p1[0], p2[0], p3[0]), x);
+				__m128 dy = _mm_sub_ps(_mm_setr_ps(p0[1], p1[1], p2[1], p3[1]), y);
+				__m128 dz = _mm_sub_ps(_mm_setr_ps(p0[2], p1[2], p2[2], p3[2]), z);
+				__m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+				__m128 temp = _mm_max_ps(_mm_sub_ps(radius2, distance2), zero);
+				sum = _mm_add_ps(sum, _mm_mul_ps(_mm_mul_ps(temp, temp), temp));
+			}
+
+			float lanes[4];
+			_mm_storeu_ps(lanes, sum);
+			return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) +
+				calcDensityKernelSumScalar(positions, particleIndex, neighborIndices, neighborCount, constants, n);
+		}
+
+		LIPHEN_SIMD_TARGET("sse2")
+		void calcPressureGradientSumSSE(const float* positions, const float* densities, const float* pressures,
+										int particleIndex, const int* neighborIndices, int neighborCount,
+										const SIMDKernelConstants& constants, float* result)
+		{
+			const float* position = positions + 3 * particleIndex;
+			__m128 x = _mm_set1_ps(position[0]);
+			__m128 y = _mm_set1_ps(position[1]);
+			__m128 z = _mm_set1_ps(position[2]);
+			__m128 radius = _mm_set1_ps(constants.radius);
+			__m128 radius2 = _mm_set1_ps(constants.radius2);
+			__m128 coefficient = _mm_set1_ps(constants.pressureGradientCoefficient);
+			__m128 tempFactor = _mm_set1_ps(pressures[particleIndex] / (densities[particleIndex] * densities[particleIndex]));
+			__m128i self = _mm_set1_epi32(particleIndex);
+			__m128 sumX = _mm_setzero_ps();
+			__m128 sumY = _mm_setzero_ps();
+			__m128 sumZ = _mm_setzero_ps();
+
+			int n = 0;
+			for (; n + 4 <= neighborCount; n += 4)
+			{
+				int j0 = neighborIndices[n];
+				int j1 = neighborIndices[n + 1];
+				int j2 = neighborIndices[n + 2];
+				int j3 = neighborIndices[n + 3];
+				const float* p0 = positions + 3 * j0;
+				const float* p1 = positions + 3 * j1;
+				const float* p2 = positions + 3 * j2;
+				const float* p3 = positions + 3 * j3;
+				__m128 dx = _mm_sub_ps(x, _mm_setr_ps(p0[0], p1[0], p2[0], p3[0]));
+				__m128 dy = _mm_sub_ps(y, _mm_setr_ps(p0[1], p1[1], p2[1], p3[1]));
+				__m128 dz = _mm_sub_ps(z, _mm_setr_ps(p0[2], p1[2], p2[2], p3[2]));
+				__m128 density = _mm_setr_ps(densities[j0], densities[j1], densities[j2], densities[j3]);
+				__m128 pressure = _mm_setr_ps(pressures[j0], pressures[j1], pressures[j2], pressures[j3]);
+
+				__m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+				__m128 distance = _mm_sqrt_ps(distance2);
+				__m128 temp = _mm_sub_ps(radius, distance);
+				__m128 factor = _mm_add_ps(tempFactor, _mm_div_ps(pressure, _mm_mul_ps(density, density)));
+				__m128 scale = _mm_mul_ps(_mm_div_ps(_mm_mul_ps(_mm_mul_ps(coefficient, temp), temp), distance), factor);
+
+				// The particle itself and neighbors outside the kernel contribute nothing
+				__m128 isSelf = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_setr_epi32(j0, j1, j2, j3), self));
+				__m128 isValid = _mm_andnot_ps(isSelf, _mm_cmplt_ps(distance2, radius2));
+				scale = _mm_and_ps(scale, isValid);
+
+				sumX = _mm_add_ps(sumX, _mm_mul_ps(dx, scale));
+				sumY = _mm_add_ps(sumY, _mm_mul_ps(dy, scale));
+				sumZ = _mm_add_ps(sumZ, _mm_mul_ps(dz, scale));
+			}
+
+			float lanes[4];
+			_mm_storeu_ps(lanes, sumX);
+			result[0] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+			_mm_storeu_ps(lanes, sumY);
+			result[1] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+			_mm_storeu_ps(lanes, sumZ);
+			result[2] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+			calcPressureGradientSumScalar(positions, densities, pressures, particleIndex, neighborIndices, neighborCount, constants, result, n);
+		}
+
+		LIPHEN_SIMD_TARGET("sse2")
+		float calcDistanceDensityKernelSumSSE(const float* neighborDistances, int neighborCount, const SIMDKernelConstants& constants)
+		{
+			__m128 radius2 = _mm_set1_ps(constants.radius2);
+			__m128 zero = _mm_setzero_ps();
+			__m128 sum = zero;
+
+			int n = 0;
+			for (; n + 4 <= neighborCount; n += 4)
+			{
+				__m128 distance = _mm_loadu_ps(neighborDistances + n);
+				__m128 temp = _mm_max_ps(_mm_sub_ps(radius2, _mm_mul_ps(distance, distance)), zero);
+				sum = _mm_add_ps(sum, _mm_mul_ps(_mm_mul_ps(temp, temp), temp));
+			}
+
+			float lanes[4];
+			_mm_storeu_ps(lanes, sum);
+			return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + calcDistanceDensityKernelSumScalar(neighborDistances, neighborCount, constants, n);
+		}
+
+		LIPHEN_SIMD_TARGET("sse2")
+		void calcDistancePressureGradientSumSSE(const float* densities, const float* pressures, int particleIndex, const int* neighborIndices,
+												const float* neighborDistances, const float* neighborDirections, int neighborCount,
+												const SIMDKernelConstants& constants, float* result)
+		{
+			__m128 radius = _mm_set1_ps(constants.radius);
+			__m128 coefficient = _mm_set1_ps(constants.pressureGradientCoefficient);
+			__m128 tempFactor = _mm_set1_ps(pressures[particleIndex] / (densities[particleIndex] * densities[particleIndex]));
+			__m128 sumX = _mm_setzero_ps();
+			__m128 sumY = _mm_setzero_ps();
+			__m128 sumZ = _mm_setzero_ps();
+
+			int n = 0;
+			for (; n + 4 <= neighborCount; n += 4)
+			{
+				int j0 = neighborIndices[n];
+				int j1 = neighborIndices[n + 1];
+				int j2 = neighborIndices[n + 2];
+				int j3 = neighborIndices[n + 3];
+				__m128 density = _mm_setr_ps(densities[j0], densities[j1], densities[j2], densities[j3]);
+				__m128 pressure = _mm_setr_ps(pressures[j0], pressures[j1], pressures[j2], pressures[j3]);
+
+				// Transpose the four xyz directions into x, y and z registers
+				const float* direction = neighborDirections + 3 * n;
+				__m128 directionX = _mm_setr_ps(direction[0], direction[3], direction[6], direction[9]);
+				__m128 directionY = _mm_setr_ps(direction[1], direction[4], direction[7], direction[10]);
+				__m128 directionZ = _mm_setr_ps(direction[2], direction[5], direction[8], direction[11]);
+
+				__m128 distance = _mm_loadu_ps(neighborDistances + n);
+				__m128 temp = _mm_sub_ps(radius, distance);
+				__m128 factor = _mm_add_ps(tempFactor, _mm_div_ps(pressure, _mm_mul_ps(density, density)));
+				__m128 scale = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(coefficient, temp), temp), factor);
+				scale = _mm_and_ps(scale, _mm_cmplt_ps(distance, radius));
+
+				sumX = _mm_add_ps(sumX, _mm_mul_ps(directionX, scale));
+				sumY = _mm_add_ps(sumY, _mm_mul_ps(directionY, scale));
+				sumZ = _mm_add_ps(sumZ, _mm_mul_ps(directionZ, scale));
+			}
+
+			float lanes[4];
+			_mm_storeu_ps(lanes, sumX);
+			result[0] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+			_mm_storeu_ps(lanes, sumY);
+			result[1] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+			_mm_storeu_ps(lanes, sumZ);
+			result[2] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+			calcDistancePressureGradientSumScalar(densities, pressures, particleIndex, neighborIndices, neighborDistances, neighborDirections,
+												  neighborCount, constants, result, n);
+		}
+
+		LIPHEN_SIMD_TARGET("avx2")
+		float sumLanesAVX2(__m256 value)
+		{
+			__m128 sum = _mm_add_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+			sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+			sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+			return _mm_cvtss_f32(sum);
+		}
+
+		LIPHEN_SIMD_TARGET("avx2")
+		float calcDensityKernelSumAVX2(const float* positions, int particleIndex, const int* neighborIndices, int neighborCount,
+									   const SIMDKernelConstants& constants)
+		{
+			const float* position = positions + 3 * particleIndex;
+			__m256 x = _mm256_set1_ps(position[0]);
+			__m256 y = _mm256_set1_ps(position[1]);
+			__m256 z = _mm256_set1_ps(position[2]);
+			__m256 radius2 = _mm256_set1_ps(constants.radius2);
+			__m256 zero = _mm256_setzero_ps();
+			__m256i three = _mm256_set1_epi32(3);
+			__m256 sum = zero;
+
+			int n = 0;
+			for (; n + 8 <= neighborCount; n += 8)
+			{
+				__m256i offsets = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(neighborIndices + n)), three);
+				__m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(positions, offsets, 4), x);
+				__m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(positions + 1, offsets, 4), y);
+				__m256 dz = _mm256_sub_ps(_mm256_i32gather_ps(positions + 2, offsets, 4), z);
+				__m256 distance2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+				__m256 temp = _mm256_max_ps(_mm256_sub_ps(radius2, distance2), zero);
+				sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_mul_ps(temp, temp), temp));
+			}
+
+			return sumLanesAVX2(sum) + calcDensityKernelSumScalar(positions, particleIndex, neighborIndices, neighborCount, constants, n);
+		}
+
+		LIPHEN_SIMD_TARGET("avx2")
+		void calcPressureGradientSumAVX2(const float* positions, const float* densities, const float* pressures,
+										 int particleIndex, const int* neighborIndices, int neighborCount,
+										 const SIMDKernelConstants& constants, float* result)
+		{
+			const float* position = positions + 3 * particleIndex;
+			__m256 x = _mm256_set1_ps(position[0]);
+			__m256 y = _mm256_set1_ps(position[1]);
+			__m256 z = _mm256_set1_ps(position[2]);
+			__m256 radius = _mm256_set1_ps(constants.radius);
+			__m256 radius2 = _mm256_set1_ps(constants.radius2);
+			__m256 coefficient = _mm256_set1_ps(constants.pressureGradientCoefficient);
+			__m256 tempFactor = _mm256_set1_ps(pressures[particleIndex] / (densities[particleIndex] * densities[particleIndex]));
+			__m256i self = _mm256_set1_epi32(particleIndex);
+			__m256i three = _mm256_set1_epi32(3);
+			__m256 sumX = _mm256_setzero_ps();
+			__m256 sumY = _mm256_setzero_ps();
+			__m256 sumZ = _mm256_setzero_ps();
+
+			int n = 0;
+			for (; n + 8 <= neighborCount; n += 8)
+			{
+				__m256i indices = _mm256_loadu_si256((const __m256i*)(neighborIndices + n));
+				__m256i offsets = _mm256_mullo_epi32(indices, three);
+				__m256 dx = _mm256_sub_ps(x, _mm256_i32gather_ps(positions, offsets, 4));
+				__m256 dy = _mm256_sub_ps(y, _mm256_i32gather_ps(positions + 1, offsets, 4));
+				__m256 dz = _mm256_sub_ps(z, _mm256_i32gather_ps(positions + 2, offsets, 4));
+				__m256 density = _mm256_i32gather_ps(densities, indices, 4);
+				__m256 pressure = _mm256_i32gather_ps(pressures, indices, 4);
+
+				__m256 distance2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+				__m256 distance = _mm256_sqrt_ps(distance2);
+				__m256 temp = _mm256_sub_ps(radius, distance);
+				__m256 factor = _mm256_add_ps(tempFactor, _mm256_div_ps(pressure, _mm256_mul_ps(density, density)));
+				__m256 scale = _mm256_mul_ps(_mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(coefficient, temp), temp), distance), factor);
+
+				// The particle itself and neighbors outside the kernel contribute nothing
+				__m256 isSelf = _mm256_castsi256_ps(_mm256_cmpeq_epi32(indices, self));
+				__m256 isValid = _mm256_andnot_ps(isSelf, _mm256_cmp_ps(distance2, radius2, _CMP_LT_OQ));
+				scale = _mm256_and_ps(scale, isValid);
+
+				sumX = _mm256_add_ps(sumX, _mm256_mul_ps(dx, scale));
+				sumY = _mm256_add_ps(sumY, _mm256_mul_ps(dy, scale));
+				sumZ = _mm256_add_ps(sumZ, _mm256_mul_ps(dz, scale));
+			}
+
+			result[0] += sumLanesAVX2(sumX);
+			result[1] += sumLanesAVX2(sumY);
+			result[2] += sumLanesAVX2(sumZ);
+
+			calcPressureGradientSumScalar(positions, densities, pressures, particleIndex, neighborIndices, neighborCount, constants, result, n);
+		}
+
+		LIPHEN_SIMD_TARGET("avx2")
+		float calcDistanceDensityKernelSumAVX2(const float* neighborDistances, int neighborCount, const SIMDKernelConstants& constants)
+		{
+			__m256 radius2 = _mm256_set1_ps(constants.radius2);
+			__m256 zero = _mm256_setzero_ps();
+			__m256 sum = zero;
+
+			int n = 0;
+			for (; n + 8 <= neighborCount; n += 8)
+			{
+				__m256 distance = _mm256_loadu_ps(neighborDistances + n);
+				__m256 temp = _mm256_max_ps(_mm256_sub_ps(radius2, _mm256_mul_ps(distance, distance)), zero);
+				sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_mul_ps(temp, temp), temp));
+			}
+
+			return sumLanesAVX2(sum) + calcDistanceDensityKernelSumScalar(neighborDistances, neighborCount, constants, n);
+		}
+
+		LIPHEN_SIMD_TARGET("avx2")
+		void calcDistancePressureGradientSumAVX2(const float* densities, const float* pressures, int particleIndex, const int* neighborIndices,
+												 const float* neighborDistances, const float* neighborDirections, int neighborCount,
+												 const SIMDKernelConstants& constants, float* result)
+		{
+			__m256 radius = _mm256_set1_ps(constants.radius);
+			__m256 coefficient = _mm256_set1_ps(constants.pressureGradientCoefficient);
+			__m256 tempFactor = _mm256_set1_ps(pressures[particleIndex] / (densities[particleIndex] * densities[particleIndex]));
+			__m256i directionOffsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+			__m256 sumX = _mm256_setzero_ps();
+			__m256 sumY = _mm256_setzero_ps();
+			__m256 sumZ = _mm256_setzero_ps();
+
+			int n = 0;
+			for (; n + 8 <= neighborCount; n += 8)
+			{
+				__m256i indices = _mm256_loadu_si256((const __m256i*)(neighborIndices + n));
+				__m256 density = _mm256_i32gather_ps(densities, indices, 4);
+				__m256 pressure = _mm256_i32gather_ps(pressures, indices, 4);
+
+				const float* direction = neighborDirections + 3 * n;
+				__m256 directionX = _mm256_i32gather_ps(direction, directionOffsets, 4);
+				__m256 directionY = _mm256_i32gather_ps(direction + 1, directionOffsets, 4);
+				__m256 directionZ = _mm256_i32gather_ps(direction + 2, directionOffsets, 4);
+
+				__m256 distance = _mm256_loadu_ps(neighborDistances + n);
+				__m256 temp = _mm256_sub_ps(radius, distance);
+				__m256 factor = _mm256_add_ps(tempFactor, _mm256_div_ps(pressure, _mm256_mul_ps(density, density)));
+				__m256 scale = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(coefficient, temp), temp), factor);
+				scale = _mm256_and_ps(scale, _mm256_cmp_ps(distance, radius, _CMP_LT_OQ));
+
+				sumX = _mm256_add_ps(sumX, _mm256_mul_ps(directionX, scale));
+				sumY = _mm256_add_ps(sumY, _mm256_mul_ps(directionY, scale));
+				sumZ = _mm256_add_ps(sumZ, _mm256_mul_ps(directionZ, scale));
+			}
+
+			result[0] += sumLanesAVX2(sumX);
+			result[1] += sumLanesAVX2(sumY);
+			result[2] += sumLanesAVX2(sumZ);
+
+			calcDistancePressureGradientSumScalar(densities, pressures, particleIndex, neighborIndices, neighborDistances, neighborDirections,
+												  neighborCount, constants, result, n);
+		}
+
+		LIPHEN_SIMD_TARGET("avx512f")
+		float calcDensityKernelSumAVX512(const float* positions, int particleIndex, const int* neighborIndices, int neighborCount,
+										 const SIMDKernelConstants& constants)
+		{
+			const float* position = positions + 3 * particleIndex;
+			__m512 x = _mm512_set1_ps(position[0]);
+			__m512 y = _mm512_set1_ps(position[1]);
+			__m512 z = _mm512_set1_ps(position[2]);
+			__m512 radius2 = _mm512_set1_ps(constants.radius2);
+			__m512 zero = _mm512_setzero_ps();
+			__m512i three = _mm512_set1_epi32(3);
+			__m512 sum = zero;
+
+			int n = 0;
+			for (; n + 16 <= neighborCount; n += 16)
+			{
+				__m512i offsets = _mm512_mullo_epi32(_mm512_loadu_si512(neighborIndices + n), three);
+				__m512 dx = _mm512_sub_ps(_mm512_i32gather_ps(offsets, positions, 4), x);
+				__m512 dy = _mm512_sub_ps(_mm512_i32gather_ps(offsets, positions + 1, 4), y);
+				__m512 dz = _mm512_sub_ps(_mm512_i32gather_ps(offsets, positions + 2, 4), z);
+				__m512 distance2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz));
+				__m512 temp = _mm512_max_ps(_mm512_sub_ps(radius2, distance2), zero);
+				sum = _mm512_add_ps(sum, _mm512_mul_ps(_mm512_mul_ps(temp, temp), temp));
+			}
+
+			return _mm512_reduce_add_ps(sum) + calcDensityKernelSumScalar(positions, particleIndex, neighborIndices, neighborCount, constants, n);
+		}
+
+		LIPHEN_SIMD_TARGET("avx512f")
+		void calcPressureGradientSumAVX512(const float* positions, const float* densities, const float* pressures,
+										   int particleIndex, const int* neighborIndices, int neighborCount,
+										   const SIMDKernelConstants& constants, float* result)
+		{
+			const float* position = positions + 3 * particleIndex;
+			__m512 x = _mm512_set1_ps(position[0]);
+			__m512 y = _mm512_set1_ps(position[1]);
+			__m512 z = _mm512_set1_ps(position[2]);
+			__m512 radius = _mm512_set1_ps(constants.radius);
+			__m512 radius2 = _mm512_set1_ps(constants.radius2);
+			__m512 coefficient = _mm512_set1_ps(constants.pressureGradientCoefficient);
+			__m512 tempFactor = _mm512_set1_ps(pressures[particleIndex] / (densities[particleIndex] * densities[particleIndex]));
+			__m512i self = _mm512_set1_epi32(particleIndex);
+			__m512i three = _mm512_set1_epi32(3);
+			__m512 sumX = _mm512_setzero_ps();
+			__m512 sumY = _mm512_setzero_ps();
+			__m512 sumZ = _mm512_setzero_ps();
+
+			int n = 0;
+			for (; n + 16 <= neighborCount; n += 16)
+			{
+				__m512i indices = _mm512_loadu_si512(neighborIndices + n);
+				__m512i offsets = _mm512_mullo_epi32(indices, three);
+				__m512 dx = _mm512_sub_ps(x, _mm512_i32gather_ps(offsets, positions, 4));
+				__m512 dy = _mm512_sub_ps(y, _mm512_i32gather_ps(offsets, positions + 1, 4));
+				__m512 dz = _mm512_sub_ps(z, _mm512_i32gather_ps(offsets, positions + 2, 4));
+				__m512 density = _mm512_i32gather_ps(indices, densities, 4);
+				__m512 pressure = _mm512_i32gather_ps(indices, pressures, 4);
+
+				__m512 distance2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz));
+
+				// The particle itself and neighbors outside the kernel contribute nothing
+				__mmask16 isValid = _mm512_mask_cmp_ps_mask(_mm512_cmpneq_epi32_mask(indices, self), distance2, radius2, _CMP_LT_OQ);
+
+				__m512 distance = _mm512_sqrt_ps(distance2);
+				__m512 temp = _mm512_sub_ps(radius, distance);
+				__m512 factor = _mm512_add_ps(tempFactor, _mm512_div_ps(pressure, _mm512_mul_ps(density, density)));
+				__m512 scale = _mm512_maskz_mul_ps(isValid, _mm512_div_ps(_mm512_mul_ps(_mm512_mul_ps(coefficient, temp), temp), distance), factor);
+
+				sumX = _mm512_add_ps(sumX, _mm512_mul_ps(dx, scale));
+				sumY = _mm512_add_ps(sumY, _mm512_mul_ps(dy, scale));
+				sumZ = _mm512_add_ps(sumZ, _mm512_mul_ps(dz, scale));
+			}
+
+			result[0] += _mm512_reduce_add_ps(sumX);
+			result[1] += _mm512_reduce_add_ps(sumY);
+			result[2] += _mm512_reduce_add_ps(sumZ);
+
+			calcPressureGradientSumScalar(positions, densities, pressures, particleIndex, neighborIndices, neighborCount, constants, result, n);
+		}
+		LIPHEN_SIMD_TARGET("avx512f")
+		float calcDistanceDensityKernelSumAVX512(const float* neighborDistances, int neighborCount, const SIMDKernelConstants& constants)
+		{
+			__m512 radius2 = _mm512_set1_ps(constants.radius2);
+			__m512 zero = _mm512_setzero_ps();
+			__m512 sum = zero;
+
+			int n = 0;
+			for (; n + 16 <= neighborCount; n += 16)
+			{
+				__m512 distance = _mm512_loadu_ps(neighborDistances + n);
+				__m512 temp = _mm512_max_ps(_mm512_sub_ps(radius2, _mm512_mul_ps(distance, distance)), zero);
+				sum = _mm512_add_ps(sum, _mm512_mul_ps(_mm512_mul_ps(temp, temp), temp));
+			}
+
+			return _mm512_reduce_add_ps(sum) + calcDistanceDensityKernelSumScalar(neighborDistances, neighborCount, constants, n);
+		}
+
+		LIPHEN_SIMD_TARGET("avx512f")
+		void calcDistancePressureGradientSumAVX512(const float* densities, const float* pressures, int particleIndex, const int* neighborIndices,
+												   const float* neighborDistances, const float* neighborDirections, int neighborCount,
+												   const SIMDKernelConstants& constants, float* result)
+		{
+			__m512 radius = _mm512_set1_ps(constants.radius);
+			__m512 coefficient = _mm512_set1_ps(constants.pressureGradientCoefficient);
+			__m512 tempFactor = _mm512_set1_ps(pressures[particleIndex] / (densities[particleIndex] * densities[particleIndex]));
+			__m512i directionOffsets = _mm512_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21, 24, 27, 30, 33, 36, 39, 42, 45);
+			__m512 sumX = _mm512_setzero_ps();
+			__m512 sumY = _mm512_setzero_ps();
+			__m512 sumZ = _mm512_setzero_ps();
+
+			int n = 0;
+			for (; n + 16 <= neighborCount; n += 16)
+			{
+				__m512i indices = _mm512_loadu_si512(neighborIndices + n);
+				__m512 density = _mm512_i32gather_ps(indices, densities, 4);
+				__m512 pressure = _mm512_i32gather_ps(indices, pressures, 4);
+
+				const float* direction = neighborDirections + 3 * n;
+				__m512 directionX = _mm512_i32gather_ps(directionOffsets, direction, 4);
+				__m512 directionY = _mm512_i32gather_ps(directionOffsets, direction + 1, 4);
+				__m512 directionZ = _mm512_i32gather_ps(directionOffsets, direction + 2, 4);
+
+				__m512 distance = _mm512_loadu_ps(neighborDistances + n);
+				__mmask16 isInside = _mm512_cmp_ps_mask(distance, radius, _CMP_LT_OQ);
+				__m512 temp = _mm512_sub_ps(radius, distance);
+				__m512 factor = _mm512_add_ps(tempFactor, _mm512_div_ps(pressure, _mm512_mul_ps(density, density)));
+				__m512 scale = _mm512_maskz_mul_ps(isInside, _mm512_mul_ps(_mm512_mul_ps(coefficient, temp), temp), factor);
+
+				sumX = _mm512_add_ps(sumX, _mm512_mul_ps(directionX, scale));
+				sumY = _mm512_add_ps(sumY, _mm512_mul_ps(directionY, scale));
+				sumZ = _mm512_add_ps(sumZ, _mm512_mul_ps(directionZ, scale));
+			}
+
+			result[0] += _mm512_reduce_add_ps(sumX);
+			result[1] += _mm512_reduce_add_ps(sumY);
+			result[2] += _mm512_reduce_add_ps(sumZ);
+
+			calcDistancePressureGradientSumScalar(densities, pressures, particleIndex, neighborIndices, neighborDistances, neighborDirections,
+												  neighborCount, constants, result, n);
+		}
+#endif
+	}
+
+	SIMDKernels::SIMDKernels() :
+		m_instructionSet(SIMDInstructionSet::SCALAR),
+		m_densityKernelSumFunction(NULL),
+		m_pressureGradientSumFunction(NULL),
+		m_distanceDensityKernelSumFunction(NULL),
+		m_distancePressureGradientSumFunction(NULL)
+	{
+		setKernelConstants(1.f, 0.f, 0.f);
+		setInstructionSet(detectInstructionSet());
+	}
+
+	SIMDKernels::~SIMDKernels()
+	{
+	}
+
+	SIMDInstructionSet SIMDKernels::detectInstructionSet()
+	{
+#if defined(LIPHEN_SIMD_X86) && defined(_MSC_VER)
+		int cpuInfo[4];
+		__cpuid(cpuInfo, 0);
+		int maxLeaf = cpuInfo[0];
+
+		__cpuid(cpuInfo, 1);
+		bool hasSSE2 = (cpuInfo[3] & (1 << 26)) != 0;
+		bool hasOSXSave = (cpuInfo[2] & (1 << 27)) != 0;
+		unsigned long long enabledStates = hasOSXSave ? _xgetbv(0) : 0;
+		bool hasAVXState = (enabledStates & 0x6) == 0x6;
+		bool hasAVX512State = (enabledStates & 0xE6) == 0xE6;
+
+		bool hasAVX2 = false;
+		bool hasAVX512 = false;
+		if (maxLeaf >= 7)
+		{
+			__cpuidex(cpuInfo, 7, 0);
+			hasAVX2 = hasAVXState && (cpuInfo[1] & (1 << 5)) != 0;
+			hasAVX512 = hasAVX512State && (cpuInfo[1] & (1 << 16)) != 0;
+		}
+
+		if (hasAVX512)
+			return SIMDInstructionSet::AVX512;
+		if (hasAVX2)
+			return SIMDInstructionSet::AVX2;
+		if (hasSSE2)
+			return SIMDInstructionSet::SSE;
+#elif defined(LIPHEN_SIMD_X86) && defined(__GNUC__)
+		// Also checks that the operating system saves the wider registers
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return SIMDInstructionSet::AVX512;
+		if (__builtin_cpu_supports("avx2"))
+			return SIMDInstructionSet::AVX2;
+		if (__builtin_cpu_supports("sse2"))
+			return SIMDInstructionSet::SSE;
+#endif
+		return SIMDInstructionSet::SCALAR;
+	}
+
+	float SIMDKernels::calcDensityKernelSum(const Vector3D* positions, int particleIndex, const int* neighborIndices, int neighborCount) const
+	{
+		return m_constants.densityCoefficient *
+			m_densityKernelSumFunction((const float*)positions, particleIndex, neighborIndices, neighborCount, m_constants);
+	}
+
+	Vector3D SIMDKernels::calcPressureGradientSum(const Vector3D* positions, const float* densities, const float* pressures,
+												  int particleIndex, const int* neighborIndices, int neighborCount) const
+	{
+		float result[3] = { 0.f, 0.f, 0.f };
+		m_pressureGradientSumFunction((const float*)positions, densities, pressures, particleIndex, neighborIndices, neighborCount, m_constants, result);
+		return Vector3D(result[0], result[1], result[2]);
+	}
+
+	float SIMDKernels::calcDensityKernelSum(const float* neighborDistances, int neighborCount) const
+	{
+		return m_constants.densityCoefficient * m_distanceDensityKernelSumFunction(neighborDistances, neighborCount, m_constants);
+	}
+
+	Vector3D SIMDKernels::calcPressureGradientSum(const float* densities, const float* pressures, int particleIndex, const int* neighborIndices,
+												  const float* neighborDistances, const Vector3D* neighborDirections, int neighborCount) const
+	{
+		float result[3] = { 0.f, 0.f, 0.f };
+		m_distancePressureGradientSumFunction(densities, pressures, particleIndex, neighborIndices, neighborDistances,
+											  (const float*)neighborDirections, neighborCount, m_constants, result);
+		return Vector3D(result[0], result[1], result[2]);
+	}
+
+	// GETTER
+	SIMDInstructionSet SIMDKernels::getInstructionSet() const
+	{
+		return m_instructionSet;
+	}
+
+	// SETTER
+	void SIMDKernels::setInstructionSet(SIMDInstructionSet instructionSet)
+	{
+		SIMDInstructionSet supportedInstructionSet = detectInstructionSet();
+		if (instructionSet > supportedInstructionSet)
+			instructionSet = supportedInstructionSet;
+
+		m_instructionSet = instructionSet;
+		switch (m_instructionSet)
+		{
+#ifdef LIPHEN_SIMD_X86
+		case SIMDInstructionSet::AVX512:
+			m_densityKernelSumFunction = calcDensityKernelSumAVX512;
+			m_pressureGradientSumFunction = calcPressureGradientSumAVX512;
+			m_distanceDensityKernelSumFunction = calcDistanceDensityKernelSumAVX512;
+			m_distancePressureGradientSumFunction = calcDistancePressureGradientSumAVX512;
+			break;
+		case SIMDInstructionSet::AVX2:
+			m_densityKernelSumFunction = calcDensityKernelSumAVX2;
+			m_pressureGradientSumFunction = calcPressureGradientSumAVX2;
+			m_distanceDensityKernelSumFunction = calcDistanceDensityKernelSumAVX2;
+			m_distancePressureGradientSumFunction = calcDistancePressureGradientSumAVX2;
+			break;
+		case SIMDInstructionSet::SSE:
+			m_densityKernelSumFunction = calcDensityKernelSumSSE;
+			m_pressureGradientSumFunction = calcPressureGradientSumSSE;
+			m_distanceDensityKernelSumFunction = calcDistanceDensityKernelSumSSE;
+			m_distancePressureGradientSumFunction = calcDistancePressureGradientSumSSE;
+			break;
+#endif
+		default:
+			m_densityKernelSumFunction = calcDensityKernelSumNone;
+			m_pressureGradientSumFunction = calcPressureGradientSumNone;
+			m_distanceDensityKernelSumFunction = calcDistanceDensityKernelSumNone;
+			m_distancePressureGradientSumFunction = calcDistancePressureGradientSumNone;
+			break;
+		}
+	}
+
+	void SIMDKernels::setKernelConstants(float kernelRadius, float densityCoefficient, float pressureGradientCoefficient)
+	{
+		m_constants.radius = kernelRadius;
+		m_constants.radius2 = kernelRadius * kernelRadius;
+		m_constants.densityCoefficient = densityCoefficient;
+		m_constants.pressureGradientCoefficient = pressureGradientCoefficient;
+	}
+}
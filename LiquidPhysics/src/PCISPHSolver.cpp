@@ -1,19 +1,25 @@
 #include "PCISPHSolver.h"
 
+#include <climits>
+
 namespace LiPhEn {
 	PCISPHSolver::PCISPHSolver()
 	{
 		m_minIterations = 4;
 		m_maxDensityErrorRatio = 0.1f;
+		m_convergenceCheckInterval = 2;
+		m_deltaCoefficient = 0.f;
 
 		m_predictedPositionsBuffer = NULL;
 		m_predictedHalfVelocitiesBuffer = NULL;
 		m_predictedPressureForcesBuffer = NULL;
 		m_predictedDensitiesBuffer = NULL;
+		m_groupMaxDensityErrorsBuffer = NULL;
+		m_predictedBufferCapacity = 0;
+		m_convergedIterationBuffer = NULL;
 
 		m_pciInitKernel = NULL;
 		m_pciIntegrateKernel = NULL;
-		m_pciHandleCollisionsKernel = NULL;
 		m_pciCalcDensityPressureKernel = NULL;
 		m_pciCalcPressureForceKernel = NULL;
 		m_pciAddPressureForceKernel = NULL;
@@ -25,10 +31,11 @@ namespace LiPhEn {
 		delete m_predictedHalfVelocitiesBuffer;
 		delete m_predictedPressureForcesBuffer;
 		delete m_predictedDensitiesBuffer;
+		delete m_groupMaxDensityErrorsBuffer;
+		delete m_convergedIterationBuffer;
 
 		delete m_pciInitKernel;
 		delete m_pciIntegrateKernel;
-		delete m_pciHandleCollisionsKernel;
 		delete m_pciCalcDensityPressureKernel;
 		delete m_pciCalcPressureForceKernel;
 		delete m_pciAddPressureForceKernel;
@@ -49,111 +56,154 @@ namespace LiPhEn {
 
 	void PCISPHSolver::accumulatePressureForces(float deltaTime)
 	{
-		// Mapping from Density Error to Pressure
-		float delta = calcDelta(deltaTime);
+		// Mapping from Density Error to Pressure, the stencil sum is only redone if the particle mass was recomputed
+		if (m_hasParticleMassChanged)
+		{
+			m_deltaCoefficient = calcDeltaCoefficient();
+			m_hasParticleMassChanged = false;
+		}
+		float delta = m_deltaCoefficient / (deltaTime * deltaTime);
 		
-		if (m_parallelizationType == ParallelizationType::NONE)
+		if (isComputedOnHost())
 		{
+			std::vector<Vector3D>& positions = m_particleStore.getPositions();
+			std::vector<Vector3D>& velocities = m_particleStore.getVelocities();
+			std::vector<Vector3D>& halfVelocities = m_particleStore.getHalfVelocities();
+			std::vector<Vector3D>& accumulatedForces = m_particleStore.getAccumulatedForces();
+			std::vector<float>& densities = m_particleStore.getDensities();
+			std::vector<float>& pressures = m_particleStore.getPressures();
+			std::vector<unsigned int>& isFirstTimeSteps = m_particleStore.getIsFirstTimeSteps();
+			std::vector<Vector3D>& predictedPositions = m_particleStore.getPredictedPositions();
+			std::vector<Vector3D>& predictedHalfVelocities = m_particleStore.getPredictedHalfVelocities();
+			std::vector<Vector3D>& predictedPressureForces = m_particleStore.getPredictedPressureForces();
+			std::vector<float>& predictedDensities = m_particleStore.getPredictedDensities();
+			std::vector<float>& densityErrors = m_particleStore.getDensityErrors();
+			const std::vector<int>& sortedParticleIndices = m_spatialGrid.getSortedParticleIndices();
+
 			// PCI Init
-			for (int i = 0; i < m_particles.size(); i++) {
-				PCISPHParticle* particle = dynamic_cast<PCISPHParticle*>(m_particles[i]);
-				particle->setPressure(0.f);
-				particle->setPredictedPressureForce(Vector3D(0.f, 0.f, 0.f));
-			}
+			forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+				for (int i = begin; i < end; i++) {
+					pressures[i] = 0.f;
+					predictedPressureForces[i] = Vector3D(0.f, 0.f, 0.f);
+				}
+			});
 
 			for (int k = 0; k < m_minIterations; k++)
 			{
-				// Predict velocity and m_position
-				for (int i = 0; i < m_particles.size(); i++) {
-					PCISPHParticle* particle = dynamic_cast<PCISPHParticle*>(m_particles[i]);
-					Vector3D halfVelocity = particle->getHalfVelocity();
-					Vector3D predictedAcceleration = (particle->getAccumulatedForces() + particle->getPredictedPressureForce()) / particle->getDensity();
-					if (particle->getIsFirstTimeStep())
-					{
-						halfVelocity = particle->getVelocity() - predictedAcceleration * deltaTime / 2.f;
-					}
-
-					Vector3D predictedHalfVelocity = halfVelocity + predictedAcceleration * deltaTime;
-					Vector3D predictedPosition = particle->getPosition() + predictedHalfVelocity * deltaTime;
-
-					particle->setPredictedHalfVelocity(predictedHalfVelocity);
-					particle->setPredictedPosition(predictedPosition);
-				}
-
-				// Resolve collisions
-				for (int i = 0; i < m_particles.size(); i++) {
-					PCISPHParticle* particle = dynamic_cast<PCISPHParticle*>(m_particles[i]);
-
-					ParticleCollisionData particleData;
-					particleData.position = particle->getPredictedPosition();
-					particleData.velocity = particle->getPredictedHalfVelocity();
-
-					particleData = handleCollision(particleData);
-
-					particle->setPredictedPosition(particleData.position);
-					particle->setPredictedHalfVelocity(particleData.velocity);
+				// Predict velocity and m_position and resolve collisions in the same sweep
+				forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+					for (int i = begin; i < end; i++) {
+						Vector3D halfVelocity = halfVelocities[i];
+						Vector3D predictedAcceleration = (accumulatedForces[i] + predictedPressureForces[i]) / densities[i];
+						if (isFirstTimeSteps[i])
+						{
+							halfVelocity = velocities[i] - predictedAcceleration * deltaTime / 2.f;
+						}
 
-					particle->aproximateVelocity();
-				}
+						ParticleCollisionData particleData;
+						particleData.velocity = halfVelocity + predictedAcceleration * deltaTime;
+						particleData.position = positions[i] + particleData.velocity * deltaTime;
 
-				// Compute pressure from density error
-				for (int i = 0; i < m_particles.size(); i++) {
-					PCISPHParticle* particle = dynamic_cast<PCISPHParticle*>(m_particles[i]);
+						particleData = handleCollision(particleData);
 
-					// Measure the predicted density with particles' predicted locations
-					float weightedSum = 0.f;
+						predictedPositions[i] = particleData.position;
+						predictedHalfVelocities[i] = particleData.velocity;
 
-					for (SPHParticle* neighborParticle : m_cachedNeighborLists[i])
-					{
-						PCISPHParticle* pciNeighborParticle = dynamic_cast<PCISPHParticle*>(neighborParticle);
-						float distance = (pciNeighborParticle->getPredictedPosition() - particle->getPredictedPosition()).magnitude();
-						weightedSum += m_defaultKernel.getKernelWeight(distance);
+						m_particleStore.aproximateVelocity(i);
 					}
+				});
+
+				// Compute pressure from density error, every worker also keeps the maximum error of its ranges
+				m_workerMaxDensityErrors.assign(getWorkerCount(), 0.f);
+				forEachParticleBalanced([&](int begin, int end, int workerIndex) {
+					float workerMaxDensityError = m_workerMaxDensityErrors[workerIndex];
+					for (int sortedIndex = begin; sortedIndex < end; sortedIndex++) {
+						int i = sortedParticleIndices[sortedIndex];
+						// Measure the predicted density with particles' predicted locations
+						float predictedDensity = m_particleMass * m_simdKernels.calcDensityKernelSum(predictedPositions.data(), i,
+																									 m_neighborList.getNeighborIndices(i), m_neighborList.getNeighborCount(i));
+						float densityError = predictedDensity - m_restDensity;
+						float predictedPressure = delta * densityError;
+
+						if (predictedPressure < 0.f)
+						{
+							densityError *= m_negativePressureFactor;
+							predictedPressure *= m_negativePressureFactor;
+						}
 
-					float predictedDensity = m_particleMass * weightedSum;
-					float densityError = predictedDensity - m_restDensity;
-					float predictedPressure = delta * densityError;
-
-					if (predictedPressure < 0.f)
-					{
-						densityError *= m_negativePressureFactor;
-						predictedPressure *= m_negativePressureFactor;
+						predictedDensities[i] = predictedDensity;
+						densityErrors[i] = densityError;
+						pressures[i] += predictedPressure;
+						workerMaxDensityError = std::max(workerMaxDensityError, fabs(densityError));
 					}
-
-					particle->setPredictedDensity(predictedDensity);
-					particle->setDensityError(densityError);
-					particle->setPressure(particle->getPressure() + predictedPressure);
-				}
+					m_workerMaxDensityErrors[workerIndex] = workerMaxDensityError;
+				});
 
 				// Compute pressure gradient force
-				for (int i = 0; i < m_particles.size(); i++) {
-					PCISPHParticle* particle = dynamic_cast<PCISPHParticle*>(m_particles[i]);
-					Vector3D pressureForce;
-					float tempFactor = particle->getPressure() / (particle->getPredictedDensity() * particle->getPredictedDensity());
-
-					for (SPHParticle* neighborParticle : m_cachedNeighborLists[i])
-					{
-						PCISPHParticle* pciNeighborParticle = dynamic_cast<PCISPHParticle*>(neighborParticle);
-						if (pciNeighborParticle != particle)
-						{
-							float distance = (pciNeighborParticle->getPredictedPosition() - particle->getPredictedPosition()).magnitude();
-							Vector3D direction = (particle->getPredictedPosition() - pciNeighborParticle->getPredictedPosition()) / distance;
-							pressureForce += direction * m_pressureKernel.getFirstDerivativeWeight(distance) *
-								(tempFactor + neighborParticle->getPressure() / (pciNeighborParticle->getPredictedDensity() * pciNeighborParticle->getPredictedDensity()));
+				if (m_isForceEvaluationSymmetric)
+				{
+					// the pair (i, j) is only visited from i < j, j gets the opposite term
+					float kernelRadius2 = m_kernelRadius * m_kernelRadius;
+					float pressureGradientCoefficient = m_pressureKernel.getFirstDerivativeCoefficient();
+					clearWorkerPairSums();
+					forEachParticleBalanced([&](int begin, int end, int workerIndex) {
+						std::vector<Vector3D>& pairSums = m_workerPairSums[workerIndex];
+						for (int sortedIndex = begin; sortedIndex < end; sortedIndex++) {
+							int i = sortedParticleIndices[sortedIndex];
+							int neighborCount = m_neighborList.getNeighborCount(i);
+							const int* neighborIndices = m_neighborList.getNeighborIndices(i);
+
+							float tempFactor = pressures[i] / (predictedDensities[i] * predictedDensities[i]);
+							Vector3D pressureGradientSum;
+							for (int n = m_neighborList.getUpperNeighborOffset(i); n < neighborCount; n++)
+							{
+								int j = neighborIndices[n];
+								Vector3D difference = predictedPositions[i] - predictedPositions[j];
+								float distance2 = difference.squareMagnitude();
+								if (distance2 >= kernelRadius2)
+									continue;
+
+								float distance = sqrtf(distance2);
+								float temp = m_kernelRadius - distance;
+								Vector3D pairTerm = difference * (pressureGradientCoefficient * temp * temp / distance *
+									(tempFactor + pressures[j] / (predictedDensities[j] * predictedDensities[j])));
+								pressureGradientSum += pairTerm;
+								pairSums[j] -= pairTerm;
+							}
+							pairSums[i] += pressureGradientSum;
 						}
-					}
-					pressureForce *= -(m_particleMass * particle->getDensity());
-					if (isnan(pressureForce.getX()))
-						pressureForce = Vector3D(0.f, 0.f, 0.f);
+					});
+
+					forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+						for (int i = begin; i < end; i++) {
+							Vector3D pressureForce = reduceWorkerPairSums(i) * -(m_particleMass * densities[i]);
+							if (isnan(pressureForce.getX()))
+								pressureForce = Vector3D(0.f, 0.f, 0.f);
 
-					particle->setPredictedPressureForce(pressureForce);
+							predictedPressureForces[i] = pressureForce;
+						}
+					});
+				}
+				else
+				{
+					forEachParticleBalanced([&](int begin, int end, int /*workerIndex*/) {
+						for (int sortedIndex = begin; sortedIndex < end; sortedIndex++) {
+							int i = sortedParticleIndices[sortedIndex];
+							Vector3D pressureForce = m_simdKernels.calcPressureGradientSum(predictedPositions.data(), predictedDensities.data(), pressures.data(), i,
+																						   m_neighborList.getNeighborIndices(i), m_neighborList.getNeighborCount(i));
+							pressureForce *= -(m_particleMass * densities[i]);
+							if (isnan(pressureForce.getX()))
+								pressureForce = Vector3D(0.f, 0.f, 0.f);
+
+							predictedPressureForces[i] = pressureForce;
+						}
+					});
 				}
 
 				float maxDensityError = 0.f;
-				for (SPHParticle* particle : m_particles)
+				for (float workerMaxDensityError : m_workerMaxDensityErrors)
 				{
-					PCISPHParticle* pciParticle = dynamic_cast<PCISPHParticle*>(particle);
-					maxDensityError = std::max(maxDensityError, fabs(pciParticle->getDensityError()));
+					maxDensityError = std::max(maxDensityError, workerMaxDensityError);
 				}
 
 				float densityErrorRatio = maxDensityError / m_restDensity;
@@ -163,23 +213,28 @@ namespace LiPhEn {
 			}
 
 			// PCI Add Pressure Force
-			for (int i = 0; i < m_particles.size(); i++) {
-				PCISPHParticle* particle = dynamic_cast<PCISPHParticle*>(m_particles[i]);
-				particle->addForce(particle->getPredictedPressureForce());
-			}
+			forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+				for (int i = begin; i < end; i++) {
+					accumulatedForces[i] += predictedPressureForces[i];
+				}
+			});
 		}
 		else
 		{
 			// PCI Init
 			m_pciInitKernel->setArgument(0, m_pressuresBuffer);
 			m_pciInitKernel->setArgument(1, m_predictedPressureForcesBuffer);
-			m_pciInitKernel->setArgument(2, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
+			m_pciInitKernel->setArgument(2, m_convergedIterationBuffer);
+			m_pciInitKernel->setArgument(3, m_parametersBuffer);
 
 			m_parallelComputationInterface->executeKernel(m_pciInitKernel, m_dummyParticleCount, m_workGroupSize);
 
+			float maxDensityError = m_maxDensityErrorRatio * m_restDensity;
 			for (int k = 0; k < m_minIterations; k++)
 			{
-				// PCI Integrate
+				unsigned int iteration = k;
+
+				// PCI Integrate and Handle Collisions
 				m_pciIntegrateKernel->setArgument(0, m_positionsBuffer1);
 				m_pciIntegrateKernel->setArgument(1, m_velocitiesBuffer1);
 				m_pciIntegrateKernel->setArgument(2, m_halfVelocitiesBuffer1);
@@ -189,30 +244,31 @@ namespace LiPhEn {
 				m_pciIntegrateKernel->setArgument(6, m_isFirstTimeStepsBuffer1);
 				m_pciIntegrateKernel->setArgument(7, m_predictedHalfVelocitiesBuffer);
 				m_pciIntegrateKernel->setArgument(8, m_predictedPositionsBuffer);
-				m_pciIntegrateKernel->setArgument(9, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
-				m_pciIntegrateKernel->setArgument(10, sizeof(deltaTime), &deltaTime);
+				m_pciIntegrateKernel->setArgument(9, m_parametersBuffer);
+				m_pciIntegrateKernel->setArgument(10, m_collisionBoxesBuffer);
+				m_pciIntegrateKernel->setArgument(11, m_collisionSpheresBuffer);
+				m_pciIntegrateKernel->setArgument(12, m_convergedIterationBuffer);
+				m_pciIntegrateKernel->setArgument(13, sizeof(iteration), &iteration);
+				m_pciIntegrateKernel->setArgument(14, sizeof(deltaTime), &deltaTime);
 
 				m_parallelComputationInterface->executeKernel(m_pciIntegrateKernel, m_dummyParticleCount, m_workGroupSize);
 
-				// PCI Handle Collisions
-				m_pciHandleCollisionsKernel->setArgument(0, m_predictedPositionsBuffer);
-				m_pciHandleCollisionsKernel->setArgument(1, m_predictedHalfVelocitiesBuffer);
-				m_pciHandleCollisionsKernel->setArgument(2, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
-				m_pciHandleCollisionsKernel->setArgument(3, m_collisionBoxesBuffer);
-				m_pciHandleCollisionsKernel->setArgument(4, m_collisionSpheresBuffer);
-
-				m_parallelComputationInterface->executeKernel(m_pciHandleCollisionsKernel, m_dummyParticleCount, m_workGroupSize);
-
 				// PCI Calc Density Pressure
 				m_pciCalcDensityPressureKernel->setArgument(0, m_positionsBuffer1);
 				m_pciCalcDensityPressureKernel->setArgument(1, m_predictedPositionsBuffer);
 				m_pciCalcDensityPressureKernel->setArgument(2, m_predictedDensitiesBuffer);
 				m_pciCalcDensityPressureKernel->setArgument(3, m_pressuresBuffer);
-				m_pciCalcDensityPressureKernel->setArgument(4, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
-				m_pciCalcDensityPressureKernel->setArgument(5, m_cellListBuffer);
-				m_pciCalcDensityPressureKernel->setArgument(6, m_defaultKernelWeightsBuffer);
-				m_pciCalcDensityPressureKernel->setArgument(7, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
-				m_pciCalcDensityPressureKernel->setArgument(8, sizeof(delta), &delta);
+				m_pciCalcDensityPressureKernel->setArgument(4, m_parametersBuffer);
+				m_pciCalcDensityPressureKernel->setArgument(5, m_cellStartsBuffer);
+				m_pciCalcDensityPressureKernel->setArgument(6, m_cellEndsBuffer);
+				m_pciCalcDensityPressureKernel->setArgument(7, m_particleIndicesBuffer1);
+				m_pciCalcDensityPressureKernel->setArgument(8, m_defaultKernelWeightsBuffer);
+				m_pciCalcDensityPressureKernel->setArgument(9, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
+				m_pciCalcDensityPressureKernel->setArgument(10, m_groupMaxDensityErrorsBuffer);
+				m_pciCalcDensityPressureKernel->setArgument(11, m_workGroupSize * sizeof(float), NULL);
+				m_pciCalcDensityPressureKernel->setArgument(12, m_convergedIterationBuffer);
+				m_pciCalcDensityPressureKernel->setArgument(13, sizeof(iteration), &iteration);
+				m_pciCalcDensityPressureKernel->setArgument(14, sizeof(delta), &delta);
 
 				m_parallelComputationInterface->executeKernel(m_pciCalcDensityPressureKernel, m_dummyParticleCount, m_workGroupSize);
 
@@ -222,18 +278,34 @@ namespace LiPhEn {
 				m_pciCalcPressureForceKernel->setArgument(2, m_predictedDensitiesBuffer);
 				m_pciCalcPressureForceKernel->setArgument(3, m_pressuresBuffer);
 				m_pciCalcPressureForceKernel->setArgument(4, m_predictedPressureForcesBuffer);
-				m_pciCalcPressureForceKernel->setArgument(5, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
-				m_pciCalcPressureForceKernel->setArgument(6, m_cellListBuffer);
-				m_pciCalcPressureForceKernel->setArgument(7, m_pressureKernelFirstDerivativeWeightsBuffer);
-				m_pciCalcPressureForceKernel->setArgument(8, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
+				m_pciCalcPressureForceKernel->setArgument(5, m_parametersBuffer);
+				m_pciCalcPressureForceKernel->setArgument(6, m_cellStartsBuffer);
+				m_pciCalcPressureForceKernel->setArgument(7, m_cellEndsBuffer);
+				m_pciCalcPressureForceKernel->setArgument(8, m_particleIndicesBuffer1);
+				m_pciCalcPressureForceKernel->setArgument(9, m_pressureKernelFirstDerivativeWeightsBuffer);
+				m_pciCalcPressureForceKernel->setArgument(10, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
+				m_pciCalcPressureForceKernel->setArgument(11, m_groupMaxDensityErrorsBuffer);
+				m_pciCalcPressureForceKernel->setArgument(12, m_workGroupSize * sizeof(float), NULL);
+				m_pciCalcPressureForceKernel->setArgument(13, m_convergedIterationBuffer);
+				m_pciCalcPressureForceKernel->setArgument(14, sizeof(iteration), &iteration);
+				m_pciCalcPressureForceKernel->setArgument(15, sizeof(maxDensityError), &maxDensityError);
 
 				m_parallelComputationInterface->executeKernel(m_pciCalcPressureForceKernel, m_dummyParticleCount, m_workGroupSize);
+
+				// A single flag instead of the density errors is read back, the remaining iterations are not even enqueued once it is set
+				if (m_convergenceCheckInterval > 0 && (k + 1) % m_convergenceCheckInterval == 0 && k + 1 < m_minIterations)
+				{
+					unsigned int convergedIteration;
+					m_parallelComputationInterface->readFromBuffer(m_convergedIterationBuffer, &convergedIteration, sizeof(convergedIteration), true);
+					if (convergedIteration != UINT_MAX)
+						break;
+				}
 			}
 
 			// PCI Add Pressure Force
 			m_pciAddPressureForceKernel->setArgument(0, m_predictedPressureForcesBuffer);
 			m_pciAddPressureForceKernel->setArgument(1, m_accumulatedForcesBuffer);
-			m_pciAddPressureForceKernel->setArgument(2, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
+			m_pciAddPressureForceKernel->setArgument(2, m_parametersBuffer);
 
 			m_parallelComputationInterface->executeKernel(m_pciAddPressureForceKernel, m_dummyParticleCount, m_workGroupSize);
 		}	
@@ -243,12 +315,17 @@ namespace LiPhEn {
 	{
 		SPHSolver::reinitParallelContext();
 
+		// The predicted buffers belong to the old context
+		m_predictedBufferCapacity = 0;
+
+		if (m_convergedIterationBuffer)
+			delete m_convergedIterationBuffer;
+		m_convergedIterationBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, sizeof(unsigned int));
+
 		if (m_pciInitKernel)
 			delete m_pciInitKernel;
 		if (m_pciIntegrateKernel)
 			delete m_pciIntegrateKernel;
-		if (m_pciHandleCollisionsKernel)
-			delete m_pciHandleCollisionsKernel;
 		if (m_pciCalcDensityPressureKernel)
 			delete m_pciCalcDensityPressureKernel;
 		if (m_pciCalcPressureForceKernel)
@@ -258,7 +335,6 @@ namespace LiPhEn {
 
 		m_pciInitKernel = m_parallelComputationInterface->createKernel("pciInit");
 		m_pciIntegrateKernel = m_parallelComputationInterface->createKernel("pciIntegrate");
-		m_pciHandleCollisionsKernel = m_parallelComputationInterface->createKernel("pciHandleCollisions");
 		m_pciCalcDensityPressureKernel = m_parallelComputationInterface->createKernel("pciCalcDensityPressure");
 		m_pciCalcPressureForceKernel = m_parallelComputationInterface->createKernel("pciCalcPressureForce");
 		m_pciAddPressureForceKernel = m_parallelComputationInterface->createKernel("pciAddPressureForce");
@@ -268,6 +344,11 @@ namespace LiPhEn {
 	{
 		SPHSolver::initParallelBuffers();
 
+		// The predicted values are recomputed every step, so the buffers only follow the capacity of the particle buffers
+		if (m_predictedBufferCapacity == m_particleCapacity)
+			return;
+		m_predictedBufferCapacity = m_particleCapacity;
+
 		if (m_predictedPositionsBuffer)
 			delete m_predictedPositionsBuffer;
 		if (m_predictedHalfVelocitiesBuffer)
@@ -276,16 +357,20 @@ namespace LiPhEn {
 			delete m_predictedPressureForcesBuffer;
 		if (m_predictedDensitiesBuffer)
 			delete m_predictedDensitiesBuffer;
-
-		m_predictedPositionsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-		m_predictedHalfVelocitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-		m_predictedPressureForcesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-		m_predictedDensitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float));
+		if (m_groupMaxDensityErrorsBuffer)
+			delete m_groupMaxDensityErrorsBuffer;
+
+		m_predictedPositionsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_predictedBufferCapacity * sizeof(float4));
+		m_predictedHalfVelocitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_predictedBufferCapacity * sizeof(float4));
+		m_predictedPressureForcesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_predictedBufferCapacity * sizeof(float4));
+		m_predictedDensitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_predictedBufferCapacity * sizeof(float));
+		m_groupMaxDensityErrorsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE,
+			((m_predictedBufferCapacity + m_workGroupSize - 1) / m_workGroupSize) * sizeof(float));
 	}
 
-	float PCISPHSolver::calcDelta(float deltaTime)
+	float PCISPHSolver::calcDeltaCoefficient()
 	{
-		float delta = 0.f;
+		float deltaCoefficient = 0.f;
 
 		std::vector<Vector3D> neighborPoints;
 		float stepSize = 1.6f * m_particleRadius;
@@ -318,13 +403,14 @@ namespace LiPhEn {
 		}
 
 		denom = -(denom1 * denom1) - denom2;
-		float beta = deltaTime * m_particleMass / m_restDensity;
+		float particleMass = isComputedOnHost() ? m_particleMass : m_parallelSPHParameters.particleMass;
+		float beta = particleMass / m_restDensity;
 		beta = 2.f * beta * beta;
 
 		if (fabs(denom) > 0.f)
-			delta = -1.f / (beta * denom);
+			deltaCoefficient = -1.f / (beta * denom);
 
-		return delta;
+		return deltaCoefficient;
 	}
 
 	// GETTER
@@ -338,6 +424,11 @@ namespace LiPhEn {
 		return m_maxDensityErrorRatio;
 	}
 
+	int PCISPHSolver::getConvergenceCheckInterval() const
+	{
+		return m_convergenceCheckInterval;
+	}
+
 	// SETTER
 	void PCISPHSolver::setMinIterations(int maxIterations)
 	{
@@ -348,4 +439,9 @@ namespace LiPhEn {
 	{
 		m_maxDensityErrorRatio = maxDensityErrorRatio;
 	}
+
+	void PCISPHSolver::setConvergenceCheckInterval(int convergenceCheckInterval)
+	{
+		m_convergenceCheckInterval = convergenceCheckInterval;
+	}
 }
\ No newline at end of file
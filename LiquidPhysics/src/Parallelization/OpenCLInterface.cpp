@@ -1,13 +1,36 @@
 #include "Parallelization/OpenCLInterface.h"
 #include <iostream>
 #include <regex>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#ifdef LIPHEN_GRAPHICS_SHARING
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <GL/glx.h>
+#endif
+#endif
 
 namespace LiPhEn {
 
 	// OPENCL BUFFER
+	unsigned int OpenCLBuffer::s_bufferCount = 0;
+
 	OpenCLBuffer::OpenCLBuffer()
 	{
 		m_clBuffer = NULL;
+		m_id = ++s_bufferCount;
 	}
 
 	OpenCLBuffer::~OpenCLBuffer()
@@ -20,11 +43,40 @@ namespace LiPhEn {
 		return m_clBuffer;
 	}
 
+	unsigned int OpenCLBuffer::getId()
+	{
+		return m_id;
+	}
+
 	void OpenCLBuffer::setBuffer(cl::Buffer* buffer)
 	{
 		m_clBuffer = buffer;
 	}
 
+	// OPENCL EVENT
+	OpenCLEvent::OpenCLEvent()
+	{
+	}
+
+	OpenCLEvent::~OpenCLEvent()
+	{
+	}
+
+	cl::Event* OpenCLEvent::getEvent()
+	{
+		return &m_clEvent;
+	}
+
+	void OpenCLEvent::wait()
+	{
+		m_clEvent.wait();
+	}
+
+	bool OpenCLEvent::isComplete()
+	{
+		return m_clEvent.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+	}
+
 	// OPENCL KERNEL
 	OpenCLKernel::OpenCLKernel()
 	{
@@ -49,17 +101,55 @@ namespace LiPhEn {
 	void OpenCLKernel::setArgument(unsigned int index, ParallelBuffer* data)
 	{
 		OpenCLBuffer* clBuffer = dynamic_cast<OpenCLBuffer*>(data);
+		Argument& argument = getArgument(index);
+		if (argument.bufferId == clBuffer->getId())
+			return;
+
 		m_clKernel->setArg(index, *clBuffer->getBuffer());
+		argument.bufferId = clBuffer->getId();
 	}
 
 	void OpenCLKernel::setArgument(unsigned int index, unsigned int size, void* data)
 	{
+		// Local memory (data is NULL) is compared by its size only
+		Argument& argument = getArgument(index);
+		unsigned int dataSize = data ? size : 0;
+		if (argument.bufferId == 0 && argument.size == size && argument.data.size() == dataSize &&
+			(!data || memcmp(argument.data.data(), data, size) == 0))
+			return;
+
 		m_clKernel->setArg(index, size, data);
+		argument.bufferId = 0;
+		argument.size = size;
+		if (data)
+			argument.data.assign((unsigned char*)data, (unsigned char*)data + size);
+		else
+			argument.data.clear();
+	}
+
+	OpenCLKernel::Argument& OpenCLKernel::getArgument(unsigned int index)
+	{
+		// size 0 marks arguments that were never set
+		if (index >= m_arguments.size())
+			m_arguments.resize(index + 1, { 0, 0, std::vector<unsigned char>() });
+		return m_arguments[index];
 	}
 
 	// OPENCL INTERFACE
 	OpenCLInterface::OpenCLInterface()
 	{
+#ifdef _WIN32
+		const char* cacheRoot = getenv("LOCALAPPDATA");
+		if (cacheRoot)
+			m_programCacheDirectory = std::string(cacheRoot) + "/LiquidPhysics/ProgramCache";
+#else
+		const char* cacheRoot = getenv("XDG_CACHE_HOME");
+		const char* homeDirectory = getenv("HOME");
+		if (cacheRoot && cacheRoot[0] != '\0')
+			m_programCacheDirectory = std::string(cacheRoot) + "/LiquidPhysics/ProgramCache";
+		else if (homeDirectory)
+			m_programCacheDirectory = std::string(homeDirectory) + "/.cache/LiquidPhysics/ProgramCache";
+#endif
 	}
 
 	void OpenCLInterface::initialize(bool usePrint)
@@ -118,20 +208,173 @@ namespace LiPhEn {
 		else
 			m_clDefaultDevice = m_clDevicesGPU[0];
 
-		m_clContext = cl::Context(m_clDefaultDevice);
+		m_hasGraphicsSharing = m_isGraphicsSharingRequested && createSharedContext();
+		if (!m_hasGraphicsSharing)
+			m_clContext = cl::Context(m_clDefaultDevice);
 
 		cl::Program::Sources clSources;
 		for (std::pair<const char*, unsigned int> source : sources)
 			clSources.push_back(std::make_pair(source.first, source.second));
 
-		m_clProgram = cl::Program(m_clContext, clSources);
-		m_clProgram.build("-cl-std=CL1.2");
-		std::string buildInfo = m_clProgram.getBuildInfo<CL_PROGRAM_BUILD_LOG>(m_clDefaultDevice);
+		buildProgram(clSources, "-cl-std=CL1.2");
 
-		m_clQueue = cl::CommandQueue(m_clContext, m_clDefaultDevice, CL_QUEUE_PROFILING_ENABLE);
+		cl_int error;
+		m_clQueue = cl::CommandQueue(m_clContext, m_clDefaultDevice, m_isOutOfOrderExecutionRequested ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0, &error);
+		m_isOutOfOrderExecution = m_isOutOfOrderExecutionRequested && error == CL_SUCCESS;
+		if (!m_isOutOfOrderExecution)
+			m_clQueue = cl::CommandQueue(m_clContext, m_clDefaultDevice);
+
+		m_hasTransferQueue = false;
+		if (m_isTransferQueueRequested)
+		{
+			m_clTransferQueue = cl::CommandQueue(m_clContext, m_clDefaultDevice, 0, &error);
+			m_hasTransferQueue = error == CL_SUCCESS;
+		}
 
 		if (usePrint)
-			std::cout << "Using " << std::regex_replace(m_clDefaultDevice.getInfo<CL_DEVICE_NAME>(), std::regex("^ +"), "") << std::endl << std::endl;
+		{
+			std::cout << "Using " << std::regex_replace(m_clDefaultDevice.getInfo<CL_DEVICE_NAME>(), std::regex("^ +"), "") << std::endl;
+			if (m_isGraphicsSharingRequested)
+				std::cout << "OpenGL Sharing: " << (m_hasGraphicsSharing ? "yes" : "no") << std::endl;
+			std::cout << std::endl;
+		}
+	}
+
+	void OpenCLInterface::buildProgram(const cl::Program::Sources& sources, const char* buildOptions)
+	{
+		std::string cacheFile = getProgramCacheFile(sources, buildOptions);
+		if (!cacheFile.empty() && loadProgramBinary(cacheFile, buildOptions))
+			return;
+
+		m_clProgram = cl::Program(m_clContext, sources);
+		cl_int error = m_clProgram.build(buildOptions);
+		std::string buildInfo = m_clProgram.getBuildInfo<CL_PROGRAM_BUILD_LOG>(m_clDefaultDevice);
+
+		if (!cacheFile.empty() && error == CL_SUCCESS)
+			storeProgramBinary(cacheFile);
+	}
+
+	std::string OpenCLInterface::getProgramCacheFile(const cl::Program::Sources& sources, const char* buildOptions)
+	{
+		if (m_programCacheDirectory.empty())
+			return "";
+
+		// A new driver may not load the binaries of an older one, so its version is part of the key
+		std::vector<std::string> keys;
+		keys.push_back(m_clDefaultDevice.getInfo<CL_DEVICE_NAME>());
+		keys.push_back(m_clDefaultDevice.getInfo<CL_DEVICE_VERSION>());
+		keys.push_back(m_clDefaultDevice.getInfo<CL_DRIVER_VERSION>());
+		keys.push_back(buildOptions);
+		for (std::pair<const char*, size_t> source : sources)
+			keys.push_back(std::string(source.first, source.second));
+
+		// FNV-1a, the separator keeps "ab" + "c" and "a" + "bc" apart
+		unsigned long long hash = 14695981039346656037ull;
+		for (const std::string& key : keys)
+		{
+			for (unsigned char character : key)
+				hash = (hash ^ character) * 1099511628211ull;
+			hash = (hash ^ 0xff) * 1099511628211ull;
+		}
+
+		std::ostringstream fileName;
+		fileName << m_programCacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+		return fileName.str();
+	}
+
+	bool OpenCLInterface::loadProgramBinary(const std::string& cacheFile, const char* buildOptions)
+	{
+		std::ifstream file(cacheFile, std::ios::binary);
+		if (!file)
+			return false;
+
+		std::vector<unsigned char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (binary.empty())
+			return false;
+
+		std::vector<cl::Device> devices(1, m_clDefaultDevice);
+		cl::Program::Binaries binaries(1, std::make_pair((const void*)binary.data(), binary.size()));
+		std::vector<cl_int> binaryStatus;
+		cl_int error;
+		cl::Program program(m_clContext, devices, binaries, &binaryStatus, &error);
+		if (error != CL_SUCCESS || program.build(devices, buildOptions) != CL_SUCCESS)
+			return false;
+
+		m_clProgram = program;
+		return true;
+	}
+
+	void OpenCLInterface::storeProgramBinary(const std::string& cacheFile)
+	{
+		// Creates the missing directories of the path one after another, existing ones make mkdir fail harmlessly
+		for (size_t separator = cacheFile.find_first_of("/\\", 1); separator != std::string::npos; separator = cacheFile.find_first_of("/\\", separator + 1))
+		{
+			std::string directory = cacheFile.substr(0, separator);
+#ifdef _WIN32
+			_mkdir(directory.c_str());
+#else
+			mkdir(directory.c_str(), 0755);
+#endif
+		}
+
+		// The context has a single device, so the program has a single binary
+		size_t binarySize = 0;
+		if (clGetProgramInfo(m_clProgram(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL) != CL_SUCCESS || binarySize == 0)
+			return;
+
+		std::vector<unsigned char> binary(binarySize);
+		unsigned char* binaryData = binary.data();
+		if (clGetProgramInfo(m_clProgram(), CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binaryData, NULL) != CL_SUCCESS)
+			return;
+
+		// Written to a temporary file first, so another process never loads a partially written binary
+		std::string temporaryFile = cacheFile + ".tmp";
+		{
+			std::ofstream file(temporaryFile, std::ios::binary | std::ios::trunc);
+			if (!file.write((const char*)binary.data(), binary.size()))
+				return;
+		}
+		std::remove(cacheFile.c_str());
+		std::rename(temporaryFile.c_str(), cacheFile.c_str());
+	}
+
+	bool OpenCLInterface::createSharedContext()
+	{
+#ifdef LIPHEN_GRAPHICS_SHARING
+		std::string extensions = m_clDefaultDevice.getInfo<CL_DEVICE_EXTENSIONS>();
+		if (extensions.find("cl_khr_gl_sharing") == std::string::npos)
+			return false;
+
+		// The context shares with the OpenGL context that is current on this thread
+		cl_platform_id platform = m_clDefaultDevice.getInfo<CL_DEVICE_PLATFORM>();
+#ifdef _WIN32
+		HGLRC glContext = wglGetCurrentContext();
+		if (!glContext)
+			return false;
+
+		cl_context_properties properties[] = {
+			CL_GL_CONTEXT_KHR, (cl_context_properties)glContext,
+			CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
+			CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+			0 };
+#else
+		GLXContext glContext = glXGetCurrentContext();
+		if (!glContext)
+			return false;
+
+		cl_context_properties properties[] = {
+			CL_GL_CONTEXT_KHR, (cl_context_properties)glContext,
+			CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(),
+			CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+			0 };
+#endif
+		// Fails if the OpenGL context runs on another device than the default device
+		cl_int error;
+		m_clContext = cl::Context(m_clDefaultDevice, properties, NULL, NULL, &error);
+		return error == CL_SUCCESS;
+#else
+		return false;
+#endif
 	}
 
 	ParallelKernel* OpenCLInterface::createKernel(const char* name)
@@ -142,6 +385,13 @@ namespace LiPhEn {
 	}
 
 	ParallelBuffer* OpenCLInterface::createBuffer(ParallelBufferType type, unsigned int size)
+	{
+		OpenCLBuffer* buffer = new OpenCLBuffer();
+		buffer->setBuffer(new cl::Buffer(m_clContext, getMemFlags(type), size));
+		return buffer;
+	}
+
+	cl_mem_flags OpenCLInterface::getMemFlags(ParallelBufferType type)
 	{
 		cl_mem_flags bufferType;
 		switch (type)
@@ -152,50 +402,160 @@ namespace LiPhEn {
 		case ParallelBufferType::WRITE_ONLY:
 			bufferType = CL_MEM_WRITE_ONLY;
 			break;
+		case ParallelBufferType::HOST_PINNED:
+			bufferType = CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR;
+			break;
 		default:
 		case ParallelBufferType::READ_WRITE:
 			bufferType = CL_MEM_READ_WRITE;
 			break;
 		}
 
-		OpenCLBuffer* buffer = new OpenCLBuffer();
-		buffer->setBuffer(new cl::Buffer(m_clContext, bufferType, size));
-		return buffer;
+		return bufferType;
 	}
 
-	void OpenCLInterface::executeKernel(ParallelKernel* kernel, unsigned int globalSize, unsigned int localSize)
+	ParallelEvent* OpenCLInterface::createEvent()
+	{
+		return new OpenCLEvent();
+	}
+
+	void OpenCLInterface::executeKernel(ParallelKernel* kernel, unsigned int globalSize, unsigned int localSize,
+										ParallelEvent* completionEvent, const ParallelEvents& waitEvents)
 	{
-		cl::Event event;
 		OpenCLKernel* clKernel = dynamic_cast<OpenCLKernel*>(kernel);
+		std::vector<cl::Event> clWaitEvents = getWaitEvents(waitEvents);
 		if(localSize > 0)
-			m_clQueue.enqueueNDRangeKernel(*clKernel->getKernel(), cl::NullRange, cl::NDRange(globalSize), cl::NDRange(localSize), NULL, &event);
+			m_clQueue.enqueueNDRangeKernel(*clKernel->getKernel(), cl::NullRange, cl::NDRange(globalSize), cl::NDRange(localSize), &clWaitEvents, getEvent(completionEvent));
 		else
-			m_clQueue.enqueueNDRangeKernel(*clKernel->getKernel(), cl::NullRange, cl::NDRange(globalSize), cl::NullRange, NULL, &event);
+			m_clQueue.enqueueNDRangeKernel(*clKernel->getKernel(), cl::NullRange, cl::NDRange(globalSize), cl::NullRange, &clWaitEvents, getEvent(completionEvent));
 	}
 
-	void OpenCLInterface::writeToBuffer(ParallelBuffer* targetData, void* sourceData, unsigned int bufferSize, bool isBlocking)
+	void OpenCLInterface::writeToBuffer(ParallelBuffer* targetData, void* sourceData, unsigned int bufferSize, bool isBlocking, unsigned int targetOffset,
+										ParallelEvent* completionEvent, const ParallelEvents& waitEvents, ParallelQueueType queueType)
 	{
-		cl::Event event;
 		OpenCLBuffer* clBuffer = dynamic_cast<OpenCLBuffer*>(targetData);
-		m_clQueue.enqueueWriteBuffer(*clBuffer->getBuffer(), isBlocking, 0, bufferSize, sourceData, NULL, &event);
+		std::vector<cl::Event> clWaitEvents = getWaitEvents(waitEvents);
+		getQueue(queueType).enqueueWriteBuffer(*clBuffer->getBuffer(), isBlocking, targetOffset, bufferSize, sourceData, &clWaitEvents, getEvent(completionEvent));
 	}
 
-	void OpenCLInterface::readFromBuffer(ParallelBuffer* sourceData, void* targetData, unsigned int bufferSize, bool isBlocking)
+	void OpenCLInterface::readFromBuffer(ParallelBuffer* sourceData, void* targetData, unsigned int bufferSize, bool isBlocking,
+										 ParallelEvent* completionEvent, const ParallelEvents& waitEvents, ParallelQueueType queueType)
 	{
-		cl::Event event;
 		OpenCLBuffer* clBuffer = dynamic_cast<OpenCLBuffer*>(sourceData);
-		m_clQueue.enqueueReadBuffer(*clBuffer->getBuffer(), isBlocking, 0, bufferSize, targetData, NULL, &event);
+		std::vector<cl::Event> clWaitEvents = getWaitEvents(waitEvents);
+		getQueue(queueType).enqueueReadBuffer(*clBuffer->getBuffer(), isBlocking, 0, bufferSize, targetData, &clWaitEvents, getEvent(completionEvent));
 	}
 
-	void OpenCLInterface::fillBuffer(ParallelBuffer* targetData, int pattern, unsigned int bufferSize)
+	void OpenCLInterface::copyBuffer(ParallelBuffer* sourceData, ParallelBuffer* targetData, unsigned int bufferSize,
+									 ParallelEvent* completionEvent, const ParallelEvents& waitEvents)
+	{
+		OpenCLBuffer* clSourceBuffer = dynamic_cast<OpenCLBuffer*>(sourceData);
+		OpenCLBuffer* clTargetBuffer = dynamic_cast<OpenCLBuffer*>(targetData);
+		std::vector<cl::Event> clWaitEvents = getWaitEvents(waitEvents);
+		m_clQueue.enqueueCopyBuffer(*clSourceBuffer->getBuffer(), *clTargetBuffer->getBuffer(), 0, 0, bufferSize, &clWaitEvents, getEvent(completionEvent));
+	}
+
+	void OpenCLInterface::fillBuffer(ParallelBuffer* targetData, int pattern, unsigned int bufferSize,
+									 ParallelEvent* completionEvent, const ParallelEvents& waitEvents)
 	{
-		cl::Event event;
 		OpenCLBuffer* clBuffer = dynamic_cast<OpenCLBuffer*>(targetData);
-		m_clQueue.enqueueFillBuffer(*clBuffer->getBuffer(), pattern, 0, bufferSize, NULL, &event);
+		std::vector<cl::Event> clWaitEvents = getWaitEvents(waitEvents);
+		m_clQueue.enqueueFillBuffer(*clBuffer->getBuffer(), pattern, 0, bufferSize, &clWaitEvents, getEvent(completionEvent));
+	}
+
+	void OpenCLInterface::enqueueMarker(ParallelEvent* completionEvent, ParallelQueueType queueType)
+	{
+		getQueue(queueType).enqueueMarkerWithWaitList(NULL, getEvent(completionEvent));
+	}
+
+	void OpenCLInterface::enqueueWait(const ParallelEvents& waitEvents, ParallelQueueType queueType)
+	{
+		std::vector<cl::Event> clWaitEvents = getWaitEvents(waitEvents);
+		getQueue(queueType).enqueueBarrierWithWaitList(&clWaitEvents);
+	}
+
+	void OpenCLInterface::flush()
+	{
+		m_clQueue.flush();
+		if (m_hasTransferQueue)
+			m_clTransferQueue.flush();
+	}
+
+	void* OpenCLInterface::mapBuffer(ParallelBuffer* buffer, unsigned int bufferSize)
+	{
+		OpenCLBuffer* clBuffer = dynamic_cast<OpenCLBuffer*>(buffer);
+		return m_clQueue.enqueueMapBuffer(*clBuffer->getBuffer(), true, CL_MAP_READ | CL_MAP_WRITE, 0, bufferSize);
+	}
+
+	void OpenCLInterface::unmapBuffer(ParallelBuffer* buffer, void* mappedData)
+	{
+		cl::Event event;
+		OpenCLBuffer* clBuffer = dynamic_cast<OpenCLBuffer*>(buffer);
+		m_clQueue.enqueueUnmapMemObject(*clBuffer->getBuffer(), mappedData, NULL, &event);
+	}
+
+	ParallelBuffer* OpenCLInterface::createSharedBuffer(ParallelBufferType type, unsigned int graphicsBuffer)
+	{
+		if (!m_hasGraphicsSharing)
+			return NULL;
+
+		cl_int error;
+		cl_mem sharedMemory = clCreateFromGLBuffer(m_clContext(), getMemFlags(type), graphicsBuffer, &error);
+		if (error != CL_SUCCESS)
+			return NULL;
+
+		OpenCLBuffer* buffer = new OpenCLBuffer();
+		buffer->setBuffer(new cl::Buffer(sharedMemory));
+		return buffer;
+	}
+
+	void OpenCLInterface::acquireSharedBuffers(const std::vector<ParallelBuffer*>& buffers)
+	{
+		cl::Event event;
+		std::vector<cl::Memory> clMemoryObjects;
+		for (ParallelBuffer* buffer : buffers)
+			clMemoryObjects.push_back(*dynamic_cast<OpenCLBuffer*>(buffer)->getBuffer());
+		m_clQueue.enqueueAcquireGLObjects(&clMemoryObjects, NULL, &event);
+	}
+
+	void OpenCLInterface::releaseSharedBuffers(const std::vector<ParallelBuffer*>& buffers)
+	{
+		cl::Event event;
+		std::vector<cl::Memory> clMemoryObjects;
+		for (ParallelBuffer* buffer : buffers)
+			clMemoryObjects.push_back(*dynamic_cast<OpenCLBuffer*>(buffer)->getBuffer());
+		m_clQueue.enqueueReleaseGLObjects(&clMemoryObjects, NULL, &event);
 	}
 
 	void OpenCLInterface::waitUntilFinished()
 	{
 		m_clQueue.finish();
+		if (m_hasTransferQueue)
+			m_clTransferQueue.finish();
+	}
+
+	cl::CommandQueue& OpenCLInterface::getQueue(ParallelQueueType queueType)
+	{
+		if (queueType == ParallelQueueType::TRANSFER && m_hasTransferQueue)
+			return m_clTransferQueue;
+		return m_clQueue;
+	}
+
+	std::vector<cl::Event> OpenCLInterface::getWaitEvents(const ParallelEvents& waitEvents)
+	{
+		std::vector<cl::Event> clWaitEvents;
+		for (ParallelEvent* waitEvent : waitEvents)
+			clWaitEvents.push_back(*dynamic_cast<OpenCLEvent*>(waitEvent)->getEvent());
+
+		if (!clWaitEvents.empty())
+			flush();
+		return clWaitEvents;
+	}
+
+	cl::Event* OpenCLInterface::getEvent(ParallelEvent* event)
+	{
+		// Events nobody waits for are not created at all
+		OpenCLEvent* clEvent = dynamic_cast<OpenCLEvent*>(event);
+		return clEvent ? clEvent->getEvent() : NULL;
 	}
 }
\ No newline at end of file
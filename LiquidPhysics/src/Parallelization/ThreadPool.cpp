@@ -0,0 +1,234 @@
+#include "Parallelization/ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace LiPhEn {
+	typedef std::chrono::steady_clock ThreadPoolClock;
+
+	float ThreadPoolStatistics::getWorkerUtilisation(int workerIndex) const
+	{
+		if (parallelSeconds <= 0.0)
+			return 0.f;
+		return (float)(workerBusySeconds[workerIndex] / parallelSeconds);
+	}
+
+	ThreadPool::ThreadPool(int workerCount) :
+		m_function(NULL),
+		m_taskBounds(NULL),
+		m_workerQueues(NULL),
+		m_count(0),
+		m_workerCount(workerCount),
+		m_pendingWorkerCount(0),
+		m_generation(0),
+		m_isStopping(false)
+	{
+		if (m_workerCount <= 0)
+			m_workerCount = std::max(1u, std::thread::hardware_concurrency());
+
+		m_workerQueues = new WorkerQueue[m_workerCount];
+		resetStatistics();
+
+		for (int workerIndex = 1; workerIndex < m_workerCount; workerIndex++)
+		{
+			m_threads.push_back(std::thread(&ThreadPool::runWorker, this, workerIndex));
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_isStopping = true;
+		}
+		m_startCondition.notify_all();
+
+		for (std::thread& thread : m_threads)
+		{
+			thread.join();
+		}
+
+		delete[] m_workerQueues;
+	}
+
+	void ThreadPool::parallelFor(int count, const ParallelRangeFunction& function)
+	{
+		if (count <= 0)
+			return;
+
+		run(count, NULL, function);
+	}
+
+	void ThreadPool::parallelForTasks(const std::vector<int>& taskBounds, const ParallelRangeFunction& function)
+	{
+		int taskCount = (int)taskBounds.size() - 1;
+		if (taskCount <= 0)
+			return;
+
+		// Hand out equally many tasks per worker, the tasks are expected to be of similar cost already
+		for (int workerIndex = 0; workerIndex < m_workerCount; workerIndex++)
+		{
+			unsigned long long firstTask = (unsigned long long)taskCount * workerIndex / m_workerCount;
+			unsigned long long endTask = (unsigned long long)taskCount * (workerIndex + 1) / m_workerCount;
+			m_workerQueues[workerIndex].taskRange.store(firstTask | (endTask << 32), std::memory_order_relaxed);
+		}
+
+		run(taskCount, &taskBounds, function);
+	}
+
+	void ThreadPool::run(int count, const std::vector<int>* taskBounds, const ParallelRangeFunction& function)
+	{
+		ThreadPoolClock::time_point startTime = ThreadPoolClock::now();
+
+		if (m_workerCount == 1)
+		{
+			m_function = &function;
+			m_taskBounds = taskBounds;
+			m_count = count;
+			runJob(0);
+		}
+		else
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_function = &function;
+				m_taskBounds = taskBounds;
+				m_count = count;
+				m_pendingWorkerCount = m_workerCount - 1;
+				m_generation++;
+			}
+			m_startCondition.notify_all();
+
+			runJob(0);
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_finishCondition.wait(lock, [this] { return m_pendingWorkerCount == 0; });
+		}
+
+		m_function = NULL;
+		m_taskBounds = NULL;
+		m_statistics.parallelSeconds += std::chrono::duration<double>(ThreadPoolClock::now() - startTime).count();
+	}
+
+	void ThreadPool::runWorker(int workerIndex)
+	{
+		unsigned int lastGeneration = 0;
+
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_startCondition.wait(lock, [&] { return m_isStopping || m_generation != lastGeneration; });
+				if (m_isStopping)
+					return;
+				lastGeneration = m_generation;
+			}
+
+			runJob(workerIndex);
+
+			bool isLastWorker;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				isLastWorker = --m_pendingWorkerCount == 0;
+			}
+			if (isLastWorker)
+				m_finishCondition.notify_one();
+		}
+	}
+
+	void ThreadPool::runJob(int workerIndex)
+	{
+		if (m_taskBounds)
+			runTasks(workerIndex);
+		else
+			runRange(workerIndex);
+	}
+
+	void ThreadPool::runRange(int workerIndex)
+	{
+		int begin = (int)((long long)m_count * workerIndex / m_workerCount);
+		int end = (int)((long long)m_count * (workerIndex + 1) / m_workerCount);
+		if (begin >= end)
+			return;
+
+		ThreadPoolClock::time_point startTime = ThreadPoolClock::now();
+		(*m_function)(begin, end, workerIndex);
+		m_statistics.workerBusySeconds[workerIndex] += std::chrono::duration<double>(ThreadPoolClock::now() - startTime).count();
+		m_statistics.workerTaskCounts[workerIndex]++;
+	}
+
+	void ThreadPool::runTasks(int workerIndex)
+	{
+		int taskIndex;
+		while ((taskIndex = popTask(workerIndex)) >= 0)
+		{
+			runTask(taskIndex, workerIndex);
+		}
+
+		while ((taskIndex = stealTask(workerIndex)) >= 0)
+		{
+			runTask(taskIndex, workerIndex);
+			m_statistics.workerStolenTaskCounts[workerIndex]++;
+		}
+	}
+
+	void ThreadPool::runTask(int taskIndex, int workerIndex)
+	{
+		ThreadPoolClock::time_point startTime = ThreadPoolClock::now();
+		(*m_function)((*m_taskBounds)[taskIndex], (*m_taskBounds)[taskIndex + 1], workerIndex);
+		m_statistics.workerBusySeconds[workerIndex] += std::chrono::duration<double>(ThreadPoolClock::now() - startTime).count();
+		m_statistics.workerTaskCounts[workerIndex]++;
+	}
+
+	int ThreadPool::popTask(int workerIndex)
+	{
+		std::atomic<unsigned long long>& taskRange = m_workerQueues[workerIndex].taskRange;
+		unsigned long long range = taskRange.load();
+		while (true)
+		{
+			unsigned long long firstTask = range & 0xFFFFFFFFull;
+			unsigned long long endTask = range >> 32;
+			if (firstTask >= endTask)
+				return -1;
+			if (taskRange.compare_exchange_weak(range, (firstTask + 1) | (endTask << 32)))
+				return (int)firstTask;
+		}
+	}
+
+	int ThreadPool::stealTask(int workerIndex)
+	{
+		for (int offset = 1; offset < m_workerCount; offset++)
+		{
+			std::atomic<unsigned long long>& taskRange = m_workerQueues[(workerIndex + offset) % m_workerCount].taskRange;
+			unsigned long long range = taskRange.load();
+			while (true)
+			{
+				unsigned long long firstTask = range & 0xFFFFFFFFull;
+				unsigned long long endTask = range >> 32;
+				if (firstTask >= endTask)
+					break;
+				if (taskRange.compare_exchange_weak(range, firstTask | ((endTask - 1) << 32)))
+					return (int)(endTask - 1);
+			}
+		}
+		return -1;
+	}
+
+	void ThreadPool::resetStatistics()
+	{
+		m_statistics.parallelSeconds = 0.0;
+		m_statistics.workerBusySeconds.assign(m_workerCount, 0.0);
+		m_statistics.workerTaskCounts.assign(m_workerCount, 0);
+		m_statistics.workerStolenTaskCounts.assign(m_workerCount, 0);
+	}
+
+	int ThreadPool::getWorkerCount() const
+	{
+		return m_workerCount;
+	}
+
+	ThreadPoolStatistics ThreadPool::getStatistics() const
+	{
+		return m_statistics;
+	}
+}
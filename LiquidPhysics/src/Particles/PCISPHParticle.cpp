@@ -1,4 +1,5 @@
 #include "Particles/PCISPHParticle.h"
+#include "Particles/ParticleStore.h"
 
 namespace LiPhEn {
 	PCISPHParticle::PCISPHParticle() :
@@ -17,53 +18,78 @@ namespace LiPhEn {
 	// GETTER
 	float PCISPHParticle::getPredictedDensity() const
 	{
+		if (m_store)
+			return m_store->getPredictedDensities()[m_index];
 		return m_predictedDensity;
 	}
 
 	float PCISPHParticle::getDensityError() const
 	{
+		if (m_store)
+			return m_store->getDensityErrors()[m_index];
 		return m_densityError;
 	}
 
 	Vector3D PCISPHParticle::getPredictedPosition() const
 	{
+		if (m_store)
+			return m_store->getPredictedPositions()[m_index];
 		return m_predictedPosition;
 	}
 
 	Vector3D PCISPHParticle::getPredictedHalfVelocity() const
 	{
+		if (m_store)
+			return m_store->getPredictedHalfVelocities()[m_index];
 		return m_predictedHalfVelocity;
 	}
 
 	Vector3D PCISPHParticle::getPredictedPressureForce() const
 	{
+		if (m_store)
+			return m_store->getPredictedPressureForces()[m_index];
 		return m_predictedPressureForce;
 	}
 
 	// SETTER
 	void PCISPHParticle::setPredictedDensity(const float predictedDensity)
 	{
-		m_predictedDensity = predictedDensity;
+		if (m_store)
+			m_store->getPredictedDensities()[m_index] = predictedDensity;
+		else
+			m_predictedDensity = predictedDensity;
 	}
 
 	void PCISPHParticle::setDensityError(const float densityError)
 	{
-		m_densityError = densityError;
+		if (m_store)
+			m_store->getDensityErrors()[m_index] = densityError;
+		else
+			m_densityError = densityError;
 	}
 
 	void PCISPHParticle::setPredictedPosition(const Vector3D& predictedPosition)
 	{
-		m_predictedPosition = predictedPosition;
+		if (m_store)
+			m_store->getPredictedPositions()[m_index] = predictedPosition;
+		else
+			m_predictedPosition = predictedPosition;
 	}
 
 	void PCISPHParticle::setPredictedHalfVelocity(const Vector3D& predictedVelocity)
 	{
-		m_predictedHalfVelocity = predictedVelocity;
+		if (m_store)
+			m_store->getPredictedHalfVelocities()[m_index] = predictedVelocity;
+		else
+			m_predictedHalfVelocity = predictedVelocity;
 	}
 
 	void PCISPHParticle::setPredictedPressureForce(const Vector3D& predictedPressureForce)
 	{
-		m_predictedPressureForce = predictedPressureForce;
+		if (m_store)
+			m_store->getPredictedPressureForces()[m_index] = predictedPressureForce;
+		else
+			m_predictedPressureForce = predictedPressureForce;
 	}
 
 }
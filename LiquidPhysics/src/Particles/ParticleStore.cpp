@@ -0,0 +1,271 @@
+#include "Particles/ParticleStore.h"
+#include "Particles/SPHParticle.h"
+#include <algorithm>
+#include <cmath>
+
+namespace LiPhEn {
+	template<typename T>
+	static void permute(std::vector<T>& values, const std::vector<int>& order)
+	{
+		std::vector<T> permutedValues(values.size());
+		for (int i = 0; i < (int)order.size(); i++)
+		{
+			permutedValues[i] = values[order[i]];
+		}
+		values.swap(permutedValues);
+	}
+
+	ParticleStore::ParticleStore()
+	{
+	}
+
+	ParticleStore::~ParticleStore()
+	{
+		clear();
+	}
+
+	void ParticleStore::addParticle(SPHParticle* particle)
+	{
+		m_positions.push_back(particle->getPosition());
+		m_velocities.push_back(particle->getVelocity());
+		m_halfVelocities.push_back(particle->getHalfVelocity());
+		m_oldHalfVelocities.push_back(particle->m_oldHalfVelocity);
+		m_accumulatedForces.push_back(particle->getAccumulatedForces());
+		m_densities.push_back(particle->getDensity());
+		m_pressures.push_back(particle->getPressure());
+		m_isFirstTimeSteps.push_back(particle->getIsFirstTimeStep());
+
+		m_predictedPositions.push_back(Vector3D(0.f, 0.f, 0.f));
+		m_predictedHalfVelocities.push_back(Vector3D(0.f, 0.f, 0.f));
+		m_predictedPressureForces.push_back(Vector3D(0.f, 0.f, 0.f));
+		m_predictedDensities.push_back(0.f);
+		m_densityErrors.push_back(0.f);
+
+		m_dfsphFactors.push_back(0.f);
+		m_dfsphStiffnesses.push_back(0.f);
+
+		particle->m_store = this;
+		particle->m_index = m_particles.size();
+		m_particles.push_back(particle);
+	}
+
+	void ParticleStore::clear()
+	{
+		// The handles are owned by the solver, they only lose their link to the store
+		for (SPHParticle* particle : m_particles)
+		{
+			particle->m_store = NULL;
+			particle->m_index = -1;
+		}
+
+		m_particles.clear();
+
+		m_positions.clear();
+		m_velocities.clear();
+		m_halfVelocities.clear();
+		m_oldHalfVelocities.clear();
+		m_accumulatedForces.clear();
+		m_densities.clear();
+		m_pressures.clear();
+		m_isFirstTimeSteps.clear();
+
+		m_predictedPositions.clear();
+		m_predictedHalfVelocities.clear();
+		m_predictedPressureForces.clear();
+		m_predictedDensities.clear();
+		m_densityErrors.clear();
+
+		m_dfsphFactors.clear();
+		m_dfsphStiffnesses.clear();
+	}
+
+	void ParticleStore::integrate(int index, float deltaTime)
+	{
+		Vector3D acceleration = m_accumulatedForces[index] / m_densities[index];
+		if (m_isFirstTimeSteps[index])
+		{
+			m_halfVelocities[index] = m_velocities[index] - acceleration * deltaTime / 2.f;
+			m_isFirstTimeSteps[index] = false;
+		}
+
+		m_oldHalfVelocities[index] = m_halfVelocities[index];
+		m_halfVelocities[index].addScaledVector(acceleration, deltaTime);
+		m_positions[index].addScaledVector(m_halfVelocities[index], deltaTime);
+
+		m_accumulatedForces[index].clear();
+	}
+
+	void ParticleStore::aproximateVelocity(int index)
+	{
+		m_velocities[index] = (m_oldHalfVelocities[index] + m_halfVelocities[index]) / 2.f;
+	}
+
+	void ParticleStore::reorder(const std::vector<int>& order)
+	{
+		permute(m_particles, order);
+		for (int i = 0; i < (int)m_particles.size(); i++)
+		{
+			m_particles[i]->m_index = i;
+		}
+
+		permute(m_positions, order);
+		permute(m_velocities, order);
+		permute(m_halfVelocities, order);
+		permute(m_oldHalfVelocities, order);
+		permute(m_accumulatedForces, order);
+		permute(m_densities, order);
+		permute(m_pressures, order);
+		permute(m_isFirstTimeSteps, order);
+
+		permute(m_predictedPositions, order);
+		permute(m_predictedHalfVelocities, order);
+		permute(m_predictedPressureForces, order);
+		permute(m_predictedDensities, order);
+		permute(m_densityErrors, order);
+
+		permute(m_dfsphFactors, order);
+		permute(m_dfsphStiffnesses, order);
+	}
+
+	void ParticleStore::sortByMortonCode(float cellSize)
+	{
+		int particleCount = m_positions.size();
+		if (particleCount == 0)
+			return;
+
+		float minPosition[3] = { m_positions[0].getX(), m_positions[0].getY(), m_positions[0].getZ() };
+		for (const Vector3D& position : m_positions)
+		{
+			minPosition[0] = std::min(minPosition[0], position.getX());
+			minPosition[1] = std::min(minPosition[1], position.getY());
+			minPosition[2] = std::min(minPosition[2], position.getZ());
+		}
+
+		// 21 bits per axis fill the 63 bits of the code
+		const float maxCellCoordinate = (1 << 21) - 1;
+		m_mortonCodes.resize(particleCount);
+		for (int index = 0; index < particleCount; index++)
+		{
+			const Vector3D& position = m_positions[index];
+			unsigned int i = std::min(floorf((position.getX() - minPosition[0]) / cellSize), maxCellCoordinate);
+			unsigned int j = std::min(floorf((position.getY() - minPosition[1]) / cellSize), maxCellCoordinate);
+			unsigned int k = std::min(floorf((position.getZ() - minPosition[2]) / cellSize), maxCellCoordinate);
+			m_mortonCodes[index] = std::make_pair(calcMortonCode(i, j, k), index);
+		}
+		std::sort(m_mortonCodes.begin(), m_mortonCodes.end());
+
+		m_sortOrder.resize(particleCount);
+		for (int index = 0; index < particleCount; index++)
+		{
+			m_sortOrder[index] = m_mortonCodes[index].second;
+		}
+		reorder(m_sortOrder);
+	}
+
+	unsigned long long ParticleStore::calcMortonCode(unsigned int i, unsigned int j, unsigned int k)
+	{
+		// Spreads the 21 bits of a coordinate so that two zero bits follow each bit
+		auto spreadBits = [](unsigned long long value) {
+			value &= 0x1fffff;
+			value = (value | (value << 32)) & 0x1f00000000ffffull;
+			value = (value | (value << 16)) & 0x1f0000ff0000ffull;
+			value = (value | (value << 8)) & 0x100f00f00f00f00full;
+			value = (value | (value << 4)) & 0x10c30c30c30c30c3ull;
+			value = (value | (value << 2)) & 0x1249249249249249ull;
+			return value;
+		};
+
+		return spreadBits(i) | (spreadBits(j) << 1) | (spreadBits(k) << 2);
+	}
+
+	// GETTER
+	int ParticleStore::getSize() const
+	{
+		return m_particles.size();
+	}
+
+	SPHParticle* ParticleStore::getParticle(int index) const
+	{
+		return m_particles[index];
+	}
+
+	const std::vector<SPHParticle*>& ParticleStore::getParticles() const
+	{
+		return m_particles;
+	}
+
+	std::vector<Vector3D>& ParticleStore::getPositions()
+	{
+		return m_positions;
+	}
+
+	std::vector<Vector3D>& ParticleStore::getVelocities()
+	{
+		return m_velocities;
+	}
+
+	std::vector<Vector3D>& ParticleStore::getHalfVelocities()
+	{
+		return m_halfVelocities;
+	}
+
+	std::vector<Vector3D>& ParticleStore::getOldHalfVelocities()
+	{
+		return m_oldHalfVelocities;
+	}
+
+	std::vector<Vector3D>& ParticleStore::getAccumulatedForces()
+	{
+		return m_accumulatedForces;
+	}
+
+	std::vector<float>& ParticleStore::getDensities()
+	{
+		return m_densities;
+	}
+
+	std::vector<float>& ParticleStore::getPressures()
+	{
+		return m_pressures;
+	}
+
+	std::vector<unsigned int>& ParticleStore::getIsFirstTimeSteps()
+	{
+		return m_isFirstTimeSteps;
+	}
+
+	std::vector<Vector3D>& ParticleStore::getPredictedPositions()
+	{
+		return m_predictedPositions;
+	}
+
+	std::vector<Vector3D>& ParticleStore::getPredictedHalfVelocities()
+	{
+		return m_predictedHalfVelocities;
+	}
+
+	std::vector<Vector3D>& ParticleStore::getPredictedPressureForces()
+	{
+		return m_predictedPressureForces;
+	}
+
+	std::vector<float>& ParticleStore::getPredictedDensities()
+	{
+		return m_predictedDensities;
+	}
+
+	std::vector<float>& ParticleStore::getDensityErrors()
+	{
+		return m_densityErrors;
+	}
+
+	std::vector<float>& ParticleStore::getDFSPHFactors()
+	{
+		return m_dfsphFactors;
+	}
+
+	std::vector<float>& ParticleStore::getDFSPHStiffnesses()
+	{
+		return m_dfsphStiffnesses;
+	}
+}
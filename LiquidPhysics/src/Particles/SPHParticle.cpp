@@ -1,7 +1,10 @@
 #include "Particles/SPHParticle.h"
+#include "Particles/ParticleStore.h"
 
 namespace LiPhEn {
 	SPHParticle::SPHParticle() :
+		m_store(NULL),
+		m_index(-1),
 		m_isFirstTimeStep(true),
 		m_position(Vector3D(0.f, 0.f, 0.f)),
 		m_velocity(Vector3D(0.f, 0.f, 0.f)),
@@ -19,104 +22,124 @@ namespace LiPhEn {
 
 	void SPHParticle::clearAccumulatedForces()
 	{
-		m_accumulatedForces.clear();
+		if (m_store)
+			m_store->getAccumulatedForces()[m_index].clear();
+		else
+			m_accumulatedForces.clear();
 	}
 
 	void SPHParticle::addForce(const Vector3D& force)
 	{
-		m_accumulatedForces += force;
-	}
-
-	void SPHParticle::integrate(float deltaTime)
-	{
-		Vector3D acceleration = m_accumulatedForces / m_density;
-		if (m_isFirstTimeStep)
-		{
-			m_halfVelocity = m_velocity - acceleration * deltaTime / 2.f;
-			m_isFirstTimeStep = false;
-		}
-
-		m_oldHalfVelocity = m_halfVelocity;
-		m_halfVelocity.addScaledVector(acceleration, deltaTime);
-		m_position.addScaledVector(m_halfVelocity, deltaTime);
-
-		clearAccumulatedForces();
-	}
-
-	void SPHParticle::aproximateVelocity()
-	{
-		m_velocity = (m_oldHalfVelocity + m_halfVelocity) / 2.f;
+		if (m_store)
+			m_store->getAccumulatedForces()[m_index] += force;
+		else
+			m_accumulatedForces += force;
 	}
 
 	// GETTERS
 	Vector3D SPHParticle::getPosition() const
 	{
+		if (m_store)
+			return m_store->getPositions()[m_index];
 		return m_position;
 	}
 
 	Vector3D SPHParticle::getVelocity() const
 	{
+		if (m_store)
+			return m_store->getVelocities()[m_index];
 		return m_velocity;
 	}
 
 	Vector3D SPHParticle::getHalfVelocity() const
 	{
+		if (m_store)
+			return m_store->getHalfVelocities()[m_index];
 		return m_halfVelocity;
 	}
 
 	Vector3D SPHParticle::getAccumulatedForces() const
 	{
+		if (m_store)
+			return m_store->getAccumulatedForces()[m_index];
 		return m_accumulatedForces;
 	}
 
 	float SPHParticle::getDensity() const
 	{
+		if (m_store)
+			return m_store->getDensities()[m_index];
 		return m_density;
 	}
 
 	float SPHParticle::getPressure() const
 	{
+		if (m_store)
+			return m_store->getPressures()[m_index];
 		return m_pressure;
 	}
 
 	bool SPHParticle::getIsFirstTimeStep() const
 	{
+		if (m_store)
+			return m_store->getIsFirstTimeSteps()[m_index] != 0;
 		return m_isFirstTimeStep;
 	}
 
 	// SETTERS
 	void SPHParticle::setPosition(const Vector3D& position)
 	{
-		m_position = position;
+		if (m_store)
+			m_store->getPositions()[m_index] = position;
+		else
+			m_position = position;
 	}
 
 	void SPHParticle::setVelocity(const Vector3D& velocity)
 	{
-		m_velocity = velocity;
+		if (m_store)
+			m_store->getVelocities()[m_index] = velocity;
+		else
+			m_velocity = velocity;
 	}
 
 	void SPHParticle::setHalfVelocity(const Vector3D& halfVelocity)
 	{
-		m_halfVelocity = halfVelocity;
+		if (m_store)
+			m_store->getHalfVelocities()[m_index] = halfVelocity;
+		else
+			m_halfVelocity = halfVelocity;
 	}
 
 	void SPHParticle::setOldHalfVelocity(const Vector3D& oldHalfVelocity)
 	{
-		m_oldHalfVelocity = oldHalfVelocity;
+		if (m_store)
+			m_store->getOldHalfVelocities()[m_index] = oldHalfVelocity;
+		else
+			m_oldHalfVelocity = oldHalfVelocity;
 	}
 
 	void SPHParticle::setDensity(const float density)
 	{
-		m_density = density;
+		if (m_store)
+			m_store->getDensities()[m_index] = density;
+		else
+			m_density = density;
 	}
 
 	void SPHParticle::setPressure(const float pressure)
 	{
-		m_pressure = pressure;
+		if (m_store)
+			m_store->getPressures()[m_index] = pressure;
+		else
+			m_pressure = pressure;
 	}
 
 	void SPHParticle::setIsFirstTimeStep(const bool isFirstTimeStep)
 	{
-		m_isFirstTimeStep = isFirstTimeStep;
+		if (m_store)
+			m_store->getIsFirstTimeSteps()[m_index] = isFirstTimeStep;
+		else
+			m_isFirstTimeStep = isFirstTimeStep;
 	}
 }
\ No newline at end of file
@@ -1,8 +1,15 @@
 #include "PhysicSolver.h"
 
+#include <algorithm>
+#include <cmath>
+
 namespace LiPhEn {
 	PhysicSolver::PhysicSolver()
 	{
+		m_isAdaptiveTimeStepping = false;
+		m_minTimeStep = 0.0001f;
+		m_maxTimeStep = 0.01f;
+		m_lastTimeStep = 0.f;
 	}
 
 	PhysicSolver::~PhysicSolver()
@@ -11,6 +18,8 @@ namespace LiPhEn {
 
 	void PhysicSolver::update(float deltaTime)
 	{
+		m_lastTimeStep = deltaTime;
+
 		onBeginUpdate();
 
 		accumulateForces(deltaTime);
@@ -19,4 +28,74 @@ namespace LiPhEn {
 
 		onEndUpdate();
 	}
+
+	int PhysicSolver::advance(float frameTime)
+	{
+		int stepCount = 0;
+		if (!std::isfinite(frameTime))
+			return stepCount;
+
+		float remainingTime = frameTime;
+		while (remainingTime > 0.f)
+		{
+			float deltaTime = m_maxTimeStep;
+			if (m_isAdaptiveTimeStepping)
+				deltaTime = std::max(m_minTimeStep, std::min(m_maxTimeStep, calcMaxTimeStep()));
+
+			// The rest of the frame is split into two equal steps instead of ending with a tiny one
+			if (remainingTime <= deltaTime)
+				deltaTime = remainingTime;
+			else if (remainingTime < 2.f * deltaTime)
+				deltaTime = remainingTime / 2.f;
+
+			// A degenerate bound would never finish the frame
+			if (!(deltaTime > 0.f))
+				break;
+
+			update(deltaTime);
+			remainingTime -= deltaTime;
+			stepCount++;
+		}
+
+		return stepCount;
+	}
+
+	// GETTER
+	bool PhysicSolver::isAdaptiveTimeStepping() const
+	{
+		return m_isAdaptiveTimeStepping;
+	}
+
+	float PhysicSolver::getMinTimeStep() const
+	{
+		return m_minTimeStep;
+	}
+
+	float PhysicSolver::getMaxTimeStep() const
+	{
+		return m_maxTimeStep;
+	}
+
+	float PhysicSolver::getLastTimeStep() const
+	{
+		return m_lastTimeStep;
+	}
+
+	// SETTER
+	void PhysicSolver::setAdaptiveTimeStepping(bool isAdaptiveTimeStepping)
+	{
+		m_isAdaptiveTimeStepping = isAdaptiveTimeStepping;
+	}
+
+	void PhysicSolver::setMinTimeStep(float minTimeStep)
+	{
+		if (minTimeStep > 0.f && std::isfinite(minTimeStep))
+			m_minTimeStep = minTimeStep;
+	}
+
+	void PhysicSolver::setMaxTimeStep(float maxTimeStep)
+	{
+		if (maxTimeStep > 0.f && std::isfinite(maxTimeStep))
+			m_maxTimeStep = maxTimeStep;
+	}
 }
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include "SPHNeighborList.h"
+#include <algorithm>
+
+namespace LiPhEn {
+	float SPHNeighborListStatistics::getReuseRatio() const
+	{
+		int stepCount = buildCount + reuseCount;
+		if (stepCount == 0)
+			return 0.f;
+		return (float)reuseCount / stepCount;
+	}
+
+	SPHNeighborList::SPHNeighborList()
+	{
+		m_offsets.push_back(0);
+	}
+
+	SPHNeighborList::~SPHNeighborList()
+	{
+	}
+
+	void SPHNeighborList::beginBuild(int particleCount, int workerCount)
+	{
+		if ((int)m_workerBuffers.size() < workerCount)
+			m_workerBuffers.resize(workerCount);
+
+		for (WorkerBuffer& workerBuffer : m_workerBuffers)
+		{
+			workerBuffer.neighborIndices.clear();
+			workerBuffer.neighborDistances.clear();
+			workerBuffer.neighborDirections.clear();
+			workerBuffer.queryCounts.visitedEntryCount = 0;
+			workerBuffer.queryCounts.falsePositiveCount = 0;
+		}
+
+		m_particleWorkers.resize(particleCount);
+		m_workerOffsets.resize(particleCount);
+		m_offsets.resize(particleCount + 1);
+		m_upperNeighborOffsets.resize(particleCount);
+	}
+
+	void SPHNeighborList::findNeighbors(int particleIndex, int workerIndex, const SPHSpatialGrid& grid, const std::vector<Vector3D>& positions, float searchRadius)
+	{
+		WorkerBuffer& workerBuffer = m_workerBuffers[workerIndex];
+		const Vector3D& position = positions[particleIndex];
+		grid.findNeighborParticles(position, searchRadius, workerBuffer.candidates, workerBuffer.queryCounts);
+
+		m_particleWorkers[particleIndex] = workerIndex;
+		m_workerOffsets[particleIndex] = workerBuffer.neighborIndices.size();
+		m_offsets[particleIndex + 1] = workerBuffer.candidates.size();
+
+		// the neighbors j <= i go first, the upper neighbors j > i after them
+		int lowerNeighborCount = 0;
+		for (int pass = 0; pass < 2; pass++)
+		{
+			for (int j : workerBuffer.candidates)
+			{
+				if ((j > particleIndex) != (pass == 1))
+					continue;
+
+				Vector3D direction = position - positions[j];
+				float distance = direction.magnitude();
+				if (distance > 0.f)
+					direction /= distance;
+				else
+					direction = Vector3D(0.f, 0.f, 0.f);
+
+				workerBuffer.neighborIndices.push_back(j);
+				workerBuffer.neighborDistances.push_back(distance);
+				workerBuffer.neighborDirections.push_back(direction);
+				if (pass == 0)
+					lowerNeighborCount++;
+			}
+		}
+		m_upperNeighborOffsets[particleIndex] = lowerNeighborCount;
+	}
+
+	void SPHNeighborList::calcOffsets()
+	{
+		// the neighbor counts were stored one slot ahead, an inclusive scan turns them into offsets
+		m_offsets[0] = 0;
+		for (int i = 1; i < (int)m_offsets.size(); i++)
+		{
+			m_offsets[i] += m_offsets[i - 1];
+		}
+
+		int totalNeighborCount = m_offsets.back();
+		m_neighborIndices.resize(totalNeighborCount);
+		m_neighborDistances.resize(totalNeighborCount);
+		m_neighborDirections.resize(totalNeighborCount);
+	}
+
+	void SPHNeighborList::mergeNeighbors(int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			const WorkerBuffer& workerBuffer = m_workerBuffers[m_particleWorkers[i]];
+			int workerOffset = m_workerOffsets[i];
+			int neighborCount = m_offsets[i + 1] - m_offsets[i];
+
+			std::copy_n(workerBuffer.neighborIndices.begin() + workerOffset, neighborCount, m_neighborIndices.begin() + m_offsets[i]);
+			std::copy_n(workerBuffer.neighborDistances.begin() + workerOffset, neighborCount, m_neighborDistances.begin() + m_offsets[i]);
+			std::copy_n(workerBuffer.neighborDirections.begin() + workerOffset, neighborCount, m_neighborDirections.begin() + m_offsets[i]);
+		}
+	}
+
+	void SPHNeighborList::updateNeighbors(int begin, int end, const std::vector<Vector3D>& positions)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			const Vector3D& position = positions[i];
+			for (int n = m_offsets[i]; n < m_offsets[i + 1]; n++)
+			{
+				Vector3D direction = position - positions[m_neighborIndices[n]];
+				float distance = direction.magnitude();
+				if (distance > 0.f)
+					direction /= distance;
+				else
+					direction = Vector3D(0.f, 0.f, 0.f);
+
+				m_neighborDistances[n] = distance;
+				m_neighborDirections[n] = direction;
+			}
+		}
+	}
+
+	void SPHNeighborList::clear()
+	{
+		m_particleWorkers.clear();
+		m_workerOffsets.clear();
+		m_offsets.assign(1, 0);
+		m_upperNeighborOffsets.clear();
+		m_neighborIndices.clear();
+		m_neighborDistances.clear();
+		m_neighborDirections.clear();
+	}
+
+	// GETTER
+	int SPHNeighborList::getParticleCount() const
+	{
+		return m_offsets.size() - 1;
+	}
+
+	SPHSpatialGridQueryCounts SPHNeighborList::getQueryCounts() const
+	{
+		SPHSpatialGridQueryCounts queryCounts = { 0, 0 };
+		for (const WorkerBuffer& workerBuffer : m_workerBuffers)
+		{
+			queryCounts.visitedEntryCount += workerBuffer.queryCounts.visitedEntryCount;
+			queryCounts.falsePositiveCount += workerBuffer.queryCounts.falsePositiveCount;
+		}
+		return queryCounts;
+	}
+
+	int SPHNeighborList::getTotalNeighborCount() const
+	{
+		return m_offsets.back();
+	}
+
+	int SPHNeighborList::getNeighborCount(int particleIndex) const
+	{
+		return m_offsets[particleIndex + 1] - m_offsets[particleIndex];
+	}
+
+	int SPHNeighborList::getUpperNeighborOffset(int particleIndex) const
+	{
+		return m_upperNeighborOffsets[particleIndex];
+	}
+
+	const int* SPHNeighborList::getNeighborIndices(int particleIndex) const
+	{
+		return m_neighborIndices.data() + m_offsets[particleIndex];
+	}
+
+	const float* SPHNeighborList::getNeighborDistances(int particleIndex) const
+	{
+		return m_neighborDistances.data() + m_offsets[particleIndex];
+	}
+
+	const Vector3D* SPHNeighborList::getNeighborDirections(int particleIndex) const
+	{
+		return m_neighborDirections.data() + m_offsets[particleIndex];
+	}
+}
@@ -1,7 +1,8 @@
 #include "Parallelization/OpenCLInterface.h"
 #include "SPHSolver.h"
+#include "SPHKernelsSource.h"
 
-#include <fstream>
+#include <cstring>
 #include "float.h"
 
 namespace LiPhEn {
@@ -19,18 +20,28 @@ namespace LiPhEn {
 		m_surfaceTensionThreshold = 7.065f;
 		m_restitutionCoefficient = 0.5f;
 		m_frictionCoefficient = 1.f;
+		m_courantFactor = 0.4f;
+		m_neighborSkinFactor = 0.f;
+		m_hasNeighborListChanged = true;
+		m_neighborListStatistics.buildCount = 0;
+		m_neighborListStatistics.reuseCount = 0;
+		m_particleReorderInterval = 32;
+		m_stepsSinceParticleReorder = 0;
+		m_isForceEvaluationSymmetric = false;
 
 		setParticleRadius(0.017f);
 
 		m_workGroupSize = 64;
+		m_scanWorkGroupSize = 128;	// power of two, every work group scans 2 * 128 values
 		m_radixThreadCount = 256;
 		m_radixWidth = 8;
 		m_radixBucketCount = 256;	// 8 bit
-		m_radixPassCount = 4;		// 4*8 bit = 32 bit = sizeof(unsinged int)
+		m_radixPassCount = 4;		// 4*8 bit = 32 bit = sizeof(unsinged int), reduced to the bits of the grid indices in buildParallelGrid
 		m_hasParallelContextChanged = true;
 		m_hasCollisionObjectDataChanged = true;
 		m_hasParticleDataChanged = true;
 		m_hasKernelWeightDataChanged = true;
+		m_hasParticleMassChanged = true;
 
 		m_positionsBuffer1 = NULL;
 		m_positionsBuffer2 = NULL;
@@ -42,6 +53,8 @@ namespace LiPhEn {
 		m_isFirstTimeStepsBuffer2 = NULL;
 		m_gridIndicesBuffer1 = NULL;
 		m_gridIndicesBuffer2 = NULL;
+		m_particleIndicesBuffer1 = NULL;
+		m_particleIndicesBuffer2 = NULL;
 		m_oldHalfVelocitiesBuffer = NULL;
 		m_accumulatedForcesBuffer = NULL;
 		m_densitiesBuffer = NULL;
@@ -55,18 +68,78 @@ namespace LiPhEn {
 		m_collisionBoxesBuffer = NULL;
 		m_collisionSpheresBuffer = NULL;
 		m_bucketCountsBuffer = NULL;
-		m_cellListBuffer = NULL;
+		m_cellStartsBuffer = NULL;
+		m_cellEndsBuffer = NULL;
+		m_cellListCapacity = 0;
+		m_particleCapacity = 0;
+		m_uploadedParticleCount = 0;
+		m_firstNewParticleIndex = 0;
+		m_minBoundsBuffer = NULL;
+		m_maxBoundsBuffer = NULL;
+		m_timeStepBoundsBuffer = NULL;
+		m_parametersBuffer = NULL;
+		m_parametersUploadIndex = 0;
+		m_hasUploadedParameters = false;
+		for (int i = 0; i < 2; i++)
+		{
+			m_parametersUploadEvents[i] = NULL;
+			m_isParametersUploadPending[i] = false;
+		}
 
+		m_reduceBoundsKernel = NULL;
+		m_reduceTimeStepBoundsKernel = NULL;
 		m_calcGridIndicesKernel = NULL;
 		m_countDigitsInBucketsKernel = NULL;
 		m_scanBucketsKernel = NULL;
-		m_permuteParticlesKernel = NULL;
+		m_addBlockOffsetsKernel = NULL;
+		m_permuteSortKeysKernel = NULL;
+		m_gatherParticlesKernel = NULL;
 		m_buildCellListKernel = NULL;
 		m_calcDensityPressureKernel = NULL;
 		m_accumulateNonPressureForcesKernel = NULL;
 		m_accumulatePressureForcesKernel = NULL;
 		m_integrateKernel = NULL;
 		m_handleCollisionsKernel = NULL;
+		m_writeInstanceDataKernel = NULL;
+
+		m_isDeviceResident = false;
+		m_particleReadbackInterval = 1;
+		m_stepsSinceParticleReadback = 0;
+		m_particleReadbackIndex = 0;
+		for (ParallelParticleReadback& readback : m_particleReadbacks)
+		{
+			readback.positionsBuffer = NULL;
+			readback.velocitiesBuffer = NULL;
+			readback.halfVelocitiesBuffer = NULL;
+			readback.isFirstTimeStepsBuffer = NULL;
+			readback.completionEvent = NULL;
+			readback.capacity = 0;
+			readback.particleCount = 0;
+			readback.isPending = false;
+		}
+		m_boundsGroupCount = 64;
+		m_boundsReadbackIndex = 0;
+		for (int i = 0; i < 2; i++)
+		{
+			m_boundsReadbackEvents[i] = NULL;
+			m_hasBoundsReadback[i] = false;
+		}
+		m_timeStepBoundsReadbackEvent = NULL;
+		m_hasTimeStepBoundsReadback = false;
+
+		m_uploadEvent = NULL;
+		m_isUploadPending = false;
+		m_computeMarkerEvent = NULL;
+		m_pendingReadbackEvent = NULL;
+
+		m_isGraphicsSharingEnabled = false;
+		m_hasGraphicsSharingFailed = false;
+		m_sharedTranslationsBuffer = NULL;
+		m_sharedColorsBuffer = NULL;
+		m_sharedTranslationsGraphicsBuffer = 0;
+		m_sharedColorsGraphicsBuffer = 0;
+
+		m_threadPool = NULL;
 
 		m_parallelComputationInterface = new OpenCLInterface();
 		m_parallelComputationInterface->initialize(true);
@@ -81,7 +154,9 @@ namespace LiPhEn {
 		}
 		else
 		{
-			m_parallelizationType = ParallelizationType::NONE;
+			// Without an OpenCL runtime the native threads take over
+			m_parallelizationType = ParallelizationType::THREADS;
+			m_threadPool = new ThreadPool();
 		}
 	}
 
@@ -89,6 +164,11 @@ namespace LiPhEn {
 	{
         cleanUp();
 
+		releaseParticleReadbacks();
+		for (ParallelEvent* boundsReadbackEvent : m_boundsReadbackEvents)
+			delete boundsReadbackEvent;
+		delete m_timeStepBoundsReadbackEvent;
+
 		delete m_positionsBuffer1;
 		delete m_positionsBuffer2;
 		delete m_velocitiesBuffer1;
@@ -99,6 +179,8 @@ namespace LiPhEn {
 		delete m_isFirstTimeStepsBuffer2;
 		delete m_gridIndicesBuffer1;
 		delete m_gridIndicesBuffer2;
+		delete m_particleIndicesBuffer1;
+		delete m_particleIndicesBuffer2;
 		delete m_oldHalfVelocitiesBuffer;
 		delete m_accumulatedForcesBuffer;
 		delete m_densitiesBuffer;
@@ -112,49 +194,76 @@ namespace LiPhEn {
 		delete m_collisionBoxesBuffer;
 		delete m_collisionSpheresBuffer;
 		delete m_bucketCountsBuffer;
-		delete m_cellListBuffer;
-
+		delete m_cellStartsBuffer;
+		delete m_cellEndsBuffer;
+		for (ParallelBuffer* blockSumsBuffer : m_scanBlockSumsBuffers)
+			delete blockSumsBuffer;
+		delete m_minBoundsBuffer;
+		delete m_maxBoundsBuffer;
+		delete m_timeStepBoundsBuffer;
+		delete m_parametersBuffer;
+
+		delete m_reduceBoundsKernel;
+		delete m_reduceTimeStepBoundsKernel;
 		delete m_calcGridIndicesKernel;
 		delete m_countDigitsInBucketsKernel;
 		delete m_scanBucketsKernel;
-		delete m_permuteParticlesKernel;
+		delete m_addBlockOffsetsKernel;
+		delete m_permuteSortKeysKernel;
+		delete m_gatherParticlesKernel;
 		delete m_buildCellListKernel;
 		delete m_calcDensityPressureKernel;
 		delete m_accumulateNonPressureForcesKernel;
 		delete m_accumulatePressureForcesKernel;
 		delete m_integrateKernel;
 		delete m_handleCollisionsKernel;
+		delete m_writeInstanceDataKernel;
+		releaseGraphicsBuffers();
+
+		if (m_isUploadPending)
+			m_uploadEvent->wait();
+		delete m_uploadEvent;
+		delete m_computeMarkerEvent;
+		for (int i = 0; i < 2; i++)
+		{
+			if (m_isParametersUploadPending[i])
+				m_parametersUploadEvents[i]->wait();
+			delete m_parametersUploadEvents[i];
+		}
+
+		delete m_threadPool;
 	}
 
 	void SPHSolver::addParticle(SPHParticle* particle)
 	{
-		m_particles.push_back(particle);
+		m_particleStore.addParticle(particle);
 
-		m_hasParticleDataChanged = true;
-		m_parallelSPHParameters.particleCount = m_particles.size();
+		// new particles are appended to the device buffers, no full upload needed
+		m_hasNeighborListChanged = true;
+		m_parallelSPHParameters.particleCount = m_particleStore.getSize();
 	}
 
 	void SPHSolver::removeParticles()
 	{
-		int particleCount = m_particles.size();
-		for (int i = 0; i < particleCount; i++)
+		std::vector<SPHParticle*> particlesToRemove = m_particleStore.getParticles();
+		m_particleStore.clear();
+		for (SPHParticle* particleToRemove : particlesToRemove)
 		{
-			SPHParticle* particleToRemove = m_particles.back();
-			m_particles.pop_back();
 			delete particleToRemove;
 		}
 
         m_spatialGrid.clear();
-
-        // clear cachedNeighborLists
-        for (std::vector<SPHParticle*> neightborList : m_cachedNeighborLists)
-        {
-            neightborList.clear();
-        }
-        m_cachedNeighborLists.clear();
+        m_neighborList.clear();
 
 		m_hasParticleDataChanged = true;
-		m_parallelSPHParameters.particleCount = m_particles.size();
+		m_hasNeighborListChanged = true;
+		m_parallelSPHParameters.particleCount = m_particleStore.getSize();
+
+		// pending readbacks and bounds belong to the removed particles
+		for (ParallelParticleReadback& readback : m_particleReadbacks)
+			readback.isPending = false;
+		m_hasBoundsReadback[0] = m_hasBoundsReadback[1] = false;
+		m_hasTimeStepBoundsReadback = false;
 	}
 
 	void SPHSolver::addStaticCollisionObject(StaticCollisionObject* collisionObject)
@@ -185,8 +294,12 @@ namespace LiPhEn {
 
 	void SPHSolver::onBeginUpdate()
 	{
-		if (m_parallelizationType == ParallelizationType::NONE)
+		if (isComputedOnHost())
 		{
+			m_stepsSinceParticleReorder++;
+			if (m_particleReorderInterval > 0 && m_stepsSinceParticleReorder >= m_particleReorderInterval)
+				reorderParticles();
+
 			buildCachedNeighborLists();	
 		}
 		else
@@ -200,50 +313,88 @@ namespace LiPhEn {
 
 	void SPHSolver::accumulateNonPressureForces(float deltaTime)
 	{
-		if (m_parallelizationType == ParallelizationType::NONE)
+		if (isComputedOnHost())
 		{
-			for (int i = 0; i < m_particles.size(); i++) {
-				SPHParticle* particle = m_particles[i];
-
-				// compute gravity force
-				particle->addForce(m_gravity * particle->getDensity());
-
-				// compute surface tension force
-				Vector3D surfaceNormal;
-				for (SPHParticle* neighborParticle : m_cachedNeighborLists[i])
-				{
-					Vector3D direction = (particle->getPosition() - neighborParticle->getPosition());
-					float distance = (neighborParticle->getPosition() - particle->getPosition()).magnitude();
-					surfaceNormal += direction * m_defaultKernel.getFirstDerivativeWeight(distance) / neighborParticle->getDensity();
-				}
-				surfaceNormal *= m_particleMass;
-
-				float surfaceNormalLength = surfaceNormal.magnitude();
-				if (surfaceNormalLength > m_surfaceTensionThreshold)
-				{
-					float laplacianColor = 0.f;
-					for (SPHParticle* neighborParticle : m_cachedNeighborLists[i])
+			std::vector<Vector3D>& velocities = m_particleStore.getVelocities();
+			std::vector<Vector3D>& accumulatedForces = m_particleStore.getAccumulatedForces();
+			std::vector<float>& densities = m_particleStore.getDensities();
+			const std::vector<int>& sortedParticleIndices = m_spatialGrid.getSortedParticleIndices();
+
+			if (m_isForceEvaluationSymmetric)
+				clearWorkerPairSums();
+
+			forEachParticleBalanced([&](int begin, int end, int workerIndex) {
+				for (int sortedIndex = begin; sortedIndex < end; sortedIndex++) {
+					int i = sortedParticleIndices[sortedIndex];
+					int neighborCount = m_neighborList.getNeighborCount(i);
+					const int* neighborIndices = m_neighborList.getNeighborIndices(i);
+					const float* neighborDistances = m_neighborList.getNeighborDistances(i);
+					const Vector3D* neighborDirections = m_neighborList.getNeighborDirections(i);
+
+					// compute gravity force
+					accumulatedForces[i] += m_gravity * densities[i];
+
+					// compute surface tension force
+					Vector3D surfaceNormal;
+					for (int n = 0; n < neighborCount; n++)
 					{
-						float distance = (particle->getPosition() - neighborParticle->getPosition()).magnitude();
-						laplacianColor += m_defaultKernel.getSecondDerivativeWeight(distance) / neighborParticle->getDensity();
+						float distance = neighborDistances[n];
+						surfaceNormal += neighborDirections[n] * (distance * m_defaultKernel.getFirstDerivativeWeight(distance) / densities[neighborIndices[n]]);
 					}
-					Vector3D surfaceTensionForce = (surfaceNormal / surfaceNormalLength) * (-m_surfaceTensionCoefficient * laplacianColor * m_particleMass);
+					surfaceNormal *= m_particleMass;
 
-					particle->addForce(surfaceTensionForce);
-				}
+					float surfaceNormalLength = surfaceNormal.magnitude();
+					if (surfaceNormalLength > m_surfaceTensionThreshold)
+					{
+						float laplacianColor = 0.f;
+						for (int n = 0; n < neighborCount; n++)
+						{
+							laplacianColor += m_defaultKernel.getSecondDerivativeWeight(neighborDistances[n]) / densities[neighborIndices[n]];
+						}
+						Vector3D surfaceTensionForce = (surfaceNormal / surfaceNormalLength) * (-m_surfaceTensionCoefficient * laplacianColor * m_particleMass);
+
+						accumulatedForces[i] += surfaceTensionForce;
+					}
 
-				// compute viscosity force
-				Vector3D viscosityForce;
-				for (SPHParticle* neighborParticle : m_cachedNeighborLists[i])
-				{
-					if (neighborParticle != particle)
+					// compute viscosity force
+					if (m_isForceEvaluationSymmetric)
+					{
+						// the pair (i, j) is only visited from i < j, j gets the opposite term scaled with i's density
+						std::vector<Vector3D>& pairSums = m_workerPairSums[workerIndex];
+						Vector3D viscositySum;
+						for (int n = m_neighborList.getUpperNeighborOffset(i); n < neighborCount; n++)
+						{
+							int j = neighborIndices[n];
+							Vector3D pairTerm = (velocities[j] - velocities[i]) * m_viscosityKernel.getSecondDerivativeWeight(neighborDistances[n]);
+							viscositySum += pairTerm / densities[j];
+							pairSums[j] -= pairTerm / densities[i];
+						}
+						pairSums[i] += viscositySum;
+					}
+					else
 					{
-						float distance = (particle->getPosition() - neighborParticle->getPosition()).magnitude();
-						viscosityForce += ((neighborParticle->getVelocity() - particle->getVelocity()) / neighborParticle->getDensity()) * m_viscosityKernel.getSecondDerivativeWeight(distance);
+						Vector3D viscosityForce;
+						for (int n = 0; n < neighborCount; n++)
+						{
+							int j = neighborIndices[n];
+							if (j != i)
+							{
+								viscosityForce += ((velocities[j] - velocities[i]) / densities[j]) * m_viscosityKernel.getSecondDerivativeWeight(neighborDistances[n]);
+							}
+						}
+						viscosityForce *= m_viscosityCoefficient * m_particleMass;
+						accumulatedForces[i] += viscosityForce;
 					}
 				}
-				viscosityForce *= m_viscosityCoefficient * m_particleMass;
-				particle->addForce(viscosityForce);
+			});
+
+			if (m_isForceEvaluationSymmetric)
+			{
+				forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+					for (int i = begin; i < end; i++) {
+						accumulatedForces[i] += reduceWorkerPairSums(i) * (m_viscosityCoefficient * m_particleMass);
+					}
+				});
 			}
 		}
 		else
@@ -252,14 +403,16 @@ namespace LiPhEn {
 			m_accumulateNonPressureForcesKernel->setArgument(1, m_velocitiesBuffer1);
 			m_accumulateNonPressureForcesKernel->setArgument(2, m_densitiesBuffer);
 			m_accumulateNonPressureForcesKernel->setArgument(3, m_accumulatedForcesBuffer);
-			m_accumulateNonPressureForcesKernel->setArgument(4, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
-			m_accumulateNonPressureForcesKernel->setArgument(5, m_cellListBuffer);
-			m_accumulateNonPressureForcesKernel->setArgument(6, m_defaultKernelFirstDerivativeWeightsBuffer);
-			m_accumulateNonPressureForcesKernel->setArgument(7, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
-			m_accumulateNonPressureForcesKernel->setArgument(8, m_defaultKernelSecondDerivativeWeightsBuffer);
+			m_accumulateNonPressureForcesKernel->setArgument(4, m_parametersBuffer);
+			m_accumulateNonPressureForcesKernel->setArgument(5, m_cellStartsBuffer);
+			m_accumulateNonPressureForcesKernel->setArgument(6, m_cellEndsBuffer);
+			m_accumulateNonPressureForcesKernel->setArgument(7, m_particleIndicesBuffer1);
+			m_accumulateNonPressureForcesKernel->setArgument(8, m_defaultKernelFirstDerivativeWeightsBuffer);
 			m_accumulateNonPressureForcesKernel->setArgument(9, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
-			m_accumulateNonPressureForcesKernel->setArgument(10, m_viscosityKernelSecondDerivativeWeightsBuffer);
+			m_accumulateNonPressureForcesKernel->setArgument(10, m_defaultKernelSecondDerivativeWeightsBuffer);
 			m_accumulateNonPressureForcesKernel->setArgument(11, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
+			m_accumulateNonPressureForcesKernel->setArgument(12, m_viscosityKernelSecondDerivativeWeightsBuffer);
+			m_accumulateNonPressureForcesKernel->setArgument(13, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
 
 			m_parallelComputationInterface->executeKernel(m_accumulateNonPressureForcesKernel, m_dummyParticleCount, m_workGroupSize);
 		}
@@ -267,26 +420,65 @@ namespace LiPhEn {
 
 	void SPHSolver::accumulatePressureForces(float deltaTime)
 	{
-		if (m_parallelizationType == ParallelizationType::NONE)
+		if (isComputedOnHost())
 		{
+			std::vector<Vector3D>& accumulatedForces = m_particleStore.getAccumulatedForces();
+			std::vector<float>& densities = m_particleStore.getDensities();
+			std::vector<float>& pressures = m_particleStore.getPressures();
+			const std::vector<int>& sortedParticleIndices = m_spatialGrid.getSortedParticleIndices();
+
 			// compute pressure gradient force
-			for (int i = 0; i < m_particles.size(); i++) {
-				SPHParticle* particle = m_particles[i];
+			if (m_isForceEvaluationSymmetric)
+			{
+				// the pair (i, j) is only visited from i < j, j gets the opposite term
+				float pressureGradientCoefficient = m_pressureKernel.getFirstDerivativeCoefficient();
+				clearWorkerPairSums();
+				forEachParticleBalanced([&](int begin, int end, int workerIndex) {
+					std::vector<Vector3D>& pairSums = m_workerPairSums[workerIndex];
+					for (int sortedIndex = begin; sortedIndex < end; sortedIndex++) {
+						int i = sortedParticleIndices[sortedIndex];
+						int neighborCount = m_neighborList.getNeighborCount(i);
+						const int* neighborIndices = m_neighborList.getNeighborIndices(i);
+						const float* neighborDistances = m_neighborList.getNeighborDistances(i);
+						const Vector3D* neighborDirections = m_neighborList.getNeighborDirections(i);
+
+						float tempFactor = pressures[i] / (densities[i] * densities[i]);
+						Vector3D pressureGradientSum;
+						for (int n = m_neighborList.getUpperNeighborOffset(i); n < neighborCount; n++)
+						{
+							float distance = neighborDistances[n];
+							if (distance >= m_kernelRadius)
+								continue;
+
+							int j = neighborIndices[n];
+							float temp = m_kernelRadius - distance;
+							Vector3D pairTerm = neighborDirections[n] * (pressureGradientCoefficient * temp * temp *
+								(tempFactor + pressures[j] / (densities[j] * densities[j])));
+							pressureGradientSum += pairTerm;
+							pairSums[j] -= pairTerm;
+						}
+						pairSums[i] += pressureGradientSum;
+					}
+				});
 
-				Vector3D pressureForce;
-				float tempFactor = particle->getPressure() / (particle->getDensity() * particle->getDensity());
-				for (SPHParticle* neighborParticle : m_cachedNeighborLists[i])
-				{
-					if (neighborParticle != particle)
-					{
-						float distance = (particle->getPosition() - neighborParticle->getPosition()).magnitude();
-						Vector3D direction = (particle->getPosition() - neighborParticle->getPosition()) / distance;
-						pressureForce += direction * m_pressureKernel.getFirstDerivativeWeight(distance) *
-							(tempFactor + neighborParticle->getPressure() / (neighborParticle->getDensity() * neighborParticle->getDensity()));
+				forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+					for (int i = begin; i < end; i++) {
+						accumulatedForces[i] += reduceWorkerPairSums(i) * -(m_particleMass * densities[i]);
 					}
-				}
-				pressureForce *= -(m_particleMass * particle->getDensity());
-				particle->addForce(pressureForce);
+				});
+			}
+			else
+			{
+				forEachParticleBalanced([&](int begin, int end, int /*workerIndex*/) {
+					for (int sortedIndex = begin; sortedIndex < end; sortedIndex++) {
+						int i = sortedParticleIndices[sortedIndex];
+						Vector3D pressureForce = m_simdKernels.calcPressureGradientSum(densities.data(), pressures.data(), i, m_neighborList.getNeighborIndices(i),
+																					   m_neighborList.getNeighborDistances(i), m_neighborList.getNeighborDirections(i),
+																					   m_neighborList.getNeighborCount(i));
+						pressureForce *= -(m_particleMass * densities[i]);
+						accumulatedForces[i] += pressureForce;
+					}
+				});
 			}
 		}
 		else
@@ -295,10 +487,12 @@ namespace LiPhEn {
 			m_accumulatePressureForcesKernel->setArgument(1, m_densitiesBuffer);
 			m_accumulatePressureForcesKernel->setArgument(2, m_pressuresBuffer);
 			m_accumulatePressureForcesKernel->setArgument(3, m_accumulatedForcesBuffer);
-			m_accumulatePressureForcesKernel->setArgument(4, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
-			m_accumulatePressureForcesKernel->setArgument(5, m_cellListBuffer);
-			m_accumulatePressureForcesKernel->setArgument(6, m_pressureKernelFirstDerivativeWeightsBuffer);
-			m_accumulatePressureForcesKernel->setArgument(7, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
+			m_accumulatePressureForcesKernel->setArgument(4, m_parametersBuffer);
+			m_accumulatePressureForcesKernel->setArgument(5, m_cellStartsBuffer);
+			m_accumulatePressureForcesKernel->setArgument(6, m_cellEndsBuffer);
+			m_accumulatePressureForcesKernel->setArgument(7, m_particleIndicesBuffer1);
+			m_accumulatePressureForcesKernel->setArgument(8, m_pressureKernelFirstDerivativeWeightsBuffer);
+			m_accumulatePressureForcesKernel->setArgument(9, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
 
 			m_parallelComputationInterface->executeKernel(m_accumulatePressureForcesKernel, m_dummyParticleCount, m_workGroupSize);
 		}	
@@ -312,11 +506,21 @@ namespace LiPhEn {
 
 	void SPHSolver::integrate(float deltaTime)
 	{
-		if (m_parallelizationType == ParallelizationType::NONE)
+		if (isComputedOnHost())
 		{
-			for (int i = 0; i < m_particles.size(); i++) {
-			    m_particles[i]->integrate(deltaTime);
-			}
+			std::vector<Vector3D>& accumulatedForces = m_particleStore.getAccumulatedForces();
+			std::vector<float>& densities = m_particleStore.getDensities();
+
+			// the forces are cleared by the integration, their maximum is kept for the next time step bound
+			m_workerMaxAccelerations2.assign(getWorkerCount(), 0.f);
+			forEachParticle([&](int begin, int end, int workerIndex) {
+				float workerMaxAcceleration2 = 0.f;
+				for (int i = begin; i < end; i++) {
+					workerMaxAcceleration2 = std::max(workerMaxAcceleration2, accumulatedForces[i].squareMagnitude() / (densities[i] * densities[i]));
+				    m_particleStore.integrate(i, deltaTime);
+				}
+				m_workerMaxAccelerations2[workerIndex] = workerMaxAcceleration2;
+			});
 		}
 		else
 		{
@@ -327,31 +531,41 @@ namespace LiPhEn {
 			m_integrateKernel->setArgument(4, m_accumulatedForcesBuffer);
 			m_integrateKernel->setArgument(5, m_densitiesBuffer);
 			m_integrateKernel->setArgument(6, m_oldHalfVelocitiesBuffer);
-			m_integrateKernel->setArgument(7, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
+			m_integrateKernel->setArgument(7, m_parametersBuffer);
 			m_integrateKernel->setArgument(8, sizeof(deltaTime), &deltaTime);
 
+			// The forces were computed concurrently to the readback of the last step, the particles are only overwritten now
+			if (m_pendingReadbackEvent)
+			{
+				m_parallelComputationInterface->enqueueWait({ m_pendingReadbackEvent });
+				m_pendingReadbackEvent = NULL;
+			}
+
 			m_parallelComputationInterface->executeKernel(m_integrateKernel, m_dummyParticleCount, m_workGroupSize);
 		}	
 	}
 
 	void SPHSolver::handleCollisions()
 	{
-		if (m_parallelizationType == ParallelizationType::NONE)
+		if (isComputedOnHost())
 		{
-			for (int i = 0; i < m_particles.size(); i++) {
-			    SPHParticle* particle = m_particles[i];
+			std::vector<Vector3D>& positions = m_particleStore.getPositions();
+			std::vector<Vector3D>& halfVelocities = m_particleStore.getHalfVelocities();
 
-			    ParticleCollisionData particleData;
-			    particleData.position = particle->getPosition();
-				particleData.velocity = particle->getHalfVelocity();
+			forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+				for (int i = begin; i < end; i++) {
+				    ParticleCollisionData particleData;
+				    particleData.position = positions[i];
+					particleData.velocity = halfVelocities[i];
 
-				particleData = handleCollision(particleData);
+					particleData = handleCollision(particleData);
 
-			    particle->setPosition(particleData.position);
-			    particle->setHalfVelocity(particleData.velocity);
+				    positions[i] = particleData.position;
+				    halfVelocities[i] = particleData.velocity;
 
-			    particle->aproximateVelocity();
-			}
+				    m_particleStore.aproximateVelocity(i);
+				}
+			});
 		}
 		else
 		{
@@ -359,7 +573,7 @@ namespace LiPhEn {
 			m_handleCollisionsKernel->setArgument(1, m_halfVelocitiesBuffer1);
 			m_handleCollisionsKernel->setArgument(2, m_oldHalfVelocitiesBuffer);
 			m_handleCollisionsKernel->setArgument(3, m_velocitiesBuffer1);
-			m_handleCollisionsKernel->setArgument(4, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
+			m_handleCollisionsKernel->setArgument(4, m_parametersBuffer);
 			m_handleCollisionsKernel->setArgument(5, m_collisionBoxesBuffer);
 			m_handleCollisionsKernel->setArgument(6, m_collisionSpheresBuffer);
 
@@ -383,100 +597,328 @@ namespace LiPhEn {
 
 	void SPHSolver::onEndUpdate()
 	{
-		if (m_parallelizationType == ParallelizationType::NONE)
+		if (!isComputedOnHost())
 		{
-			// clear grid and neighborlists
-			m_spatialGrid.clear();
+			if (m_isDeviceResident)
+			{
+				reduceParallelBounds();
 
-			// clear cachedNeighborLists
-			for (std::vector<SPHParticle*> neightborList : m_cachedNeighborLists)
+				m_stepsSinceParticleReadback++;
+				if (m_particleReadbackInterval > 0 && m_stepsSinceParticleReadback >= m_particleReadbackInterval)
+				{
+					m_stepsSinceParticleReadback = 0;
+					readParticleDataAsync();
+				}
+			}
+			else
 			{
-				neightborList.clear();
+				readParticleData();
 			}
-			m_cachedNeighborLists.clear();
 		}
-		else
+	}
+
+	float SPHSolver::calcMaxTimeStep()
+	{
+		int particleCount = m_particleStore.getSize();
+		float maxSpeed2 = 0.f;
+		float maxAcceleration2 = 0.f;
+
+		// The device data is newer than the host data, apart from particles that were not uploaded yet
+		int firstHostParticleIndex = 0;
+		bool isBoundLagging = false;
+		if (!isComputedOnHost() && !m_hasParallelContextChanged && !m_hasParticleDataChanged && m_uploadedParticleCount > 0)
 		{
-			// read particle data for rendering
-			float4* positionsBuffer = new float4[m_particles.size()];
-			float4* velocitesBuffer = new float4[m_particles.size()];
-			float4* halfVelocitiesBuffer = new float4[m_particles.size()];
-			unsigned int* isFirstTimeStepsBuffer = new unsigned int[m_particles.size()];
-
-			m_parallelComputationInterface->readFromBuffer(m_positionsBuffer1, positionsBuffer, m_particles.size() * sizeof(float4), true);
-			m_parallelComputationInterface->readFromBuffer(m_velocitiesBuffer1, velocitesBuffer, m_particles.size() * sizeof(float4), true);
-			m_parallelComputationInterface->readFromBuffer(m_halfVelocitiesBuffer1, halfVelocitiesBuffer, m_particles.size() * sizeof(float4), true);
-			m_parallelComputationInterface->readFromBuffer(m_isFirstTimeStepsBuffer1, isFirstTimeStepsBuffer, m_particles.size() * sizeof(unsigned int), true);
-			m_parallelComputationInterface->waitUntilFinished();
-
-			for (int i = 0; i < m_particles.size(); i++)
+			firstHostParticleIndex = m_uploadedParticleCount;
+
+			// Like the grid bounds, the maxima of the previous step are used while the current ones are read back, only the
+			// first readback after a reset is waited for right away
+			isBoundLagging = m_hasTimeStepBoundsReadback;
+			if (!m_hasTimeStepBoundsReadback)
+				reduceParallelTimeStepBounds();
+
+			m_timeStepBoundsReadbackEvent->wait();
+			for (unsigned int group = 0; group < m_boundsGroupCount; group++)
 			{
-				float4 position = positionsBuffer[i];
-				float4 velocity = velocitesBuffer[i];
-				float4 halfVelocity = halfVelocitiesBuffer[i];
-				bool isFirstTimeStep = isFirstTimeStepsBuffer[i];
-				m_particles[i]->setPosition(Vector3D(position.x, position.y, position.z));
-				m_particles[i]->setVelocity(Vector3D(velocity.x, velocity.y, velocity.z));
-				m_particles[i]->setHalfVelocity(Vector3D(halfVelocity.x, halfVelocity.y, halfVelocity.z));
-				m_particles[i]->setIsFirstTimeStep(isFirstTimeStep);
+				maxSpeed2 = std::max(maxSpeed2, m_timeStepBoundsReadback[group * 2]);
+				maxAcceleration2 = std::max(maxAcceleration2, m_timeStepBoundsReadback[group * 2 + 1]);
 			}
 
-			delete[] positionsBuffer;
-			delete[] velocitesBuffer;
-			delete[] halfVelocitiesBuffer;
-			delete[] isFirstTimeStepsBuffer;
+			reduceParallelTimeStepBounds();
 		}
+
+		if (firstHostParticleIndex < particleCount)
+		{
+			std::vector<Vector3D>& velocities = m_particleStore.getVelocities();
+
+			m_workerMaxSpeeds2.assign(getWorkerCount(), 0.f);
+			forEachParticle([&](int begin, int end, int workerIndex) {
+				float workerMaxSpeed2 = 0.f;
+				for (int i = std::max(begin, firstHostParticleIndex); i < end; i++) {
+					workerMaxSpeed2 = std::max(workerMaxSpeed2, velocities[i].squareMagnitude());
+				}
+				m_workerMaxSpeeds2[workerIndex] = workerMaxSpeed2;
+			});
+
+			for (float workerMaxSpeed2 : m_workerMaxSpeeds2)
+			{
+				maxSpeed2 = std::max(maxSpeed2, workerMaxSpeed2);
+			}
+		}
+
+		// the host forces are already cleared, integrate kept their maximum
+		if (isComputedOnHost())
+		{
+			for (float workerMaxAcceleration2 : m_workerMaxAccelerations2)
+			{
+				maxAcceleration2 = std::max(maxAcceleration2, workerMaxAcceleration2);
+			}
+		}
+
+		float maxTimeStep = FLT_MAX;
+
+		// CFL condition, a particle moves at most a fraction of its diameter per step
+		float maxSpeed = sqrtf(maxSpeed2);
+		if (maxSpeed > 0.f)
+			maxTimeStep = std::min(maxTimeStep, m_courantFactor * 2.f * m_particleRadius / maxSpeed);
+
+		// Force bound of Monaghan, the forces of the last step stand in for the ones of the next step
+		float maxAcceleration = sqrtf(maxAcceleration2);
+		if (maxAcceleration > 0.f)
+			maxTimeStep = std::min(maxTimeStep, 0.25f * sqrtf(m_kernelRadius / maxAcceleration));
+
+		// Viscous diffusion bound, m_viscosityCoefficient is the dynamic viscosity
+		float kinematicViscosity = m_viscosityCoefficient / m_restDensity;
+		if (kinematicViscosity > 0.f)
+			maxTimeStep = std::min(maxTimeStep, 0.125f * m_kernelRadius * m_kernelRadius / kinematicViscosity);
+
+		// The device maxima are one step old, the particles may have sped up since then
+		if (isBoundLagging)
+			maxTimeStep *= 0.8f;
+
+		return maxTimeStep;
+	}
+
+	void SPHSolver::reduceParallelTimeStepBounds()
+	{
+		unsigned int deviceParticleCount = m_uploadedParticleCount;
+		m_reduceTimeStepBoundsKernel->setArgument(0, m_velocitiesBuffer1);
+		m_reduceTimeStepBoundsKernel->setArgument(1, m_accumulatedForcesBuffer);
+		m_reduceTimeStepBoundsKernel->setArgument(2, m_densitiesBuffer);
+		m_reduceTimeStepBoundsKernel->setArgument(3, m_timeStepBoundsBuffer);
+		m_reduceTimeStepBoundsKernel->setArgument(4, sizeof(deviceParticleCount), &deviceParticleCount);
+		m_reduceTimeStepBoundsKernel->setArgument(5, m_workGroupSize * 2 * sizeof(float), NULL);
+
+		m_parallelComputationInterface->executeKernel(m_reduceTimeStepBoundsKernel, m_boundsGroupCount * m_workGroupSize, m_workGroupSize);
+
+		// The few group results are combined on the host, the time step is needed there anyway
+		m_timeStepBoundsReadback.resize(m_boundsGroupCount * 2);
+		m_parallelComputationInterface->readFromBuffer(m_timeStepBoundsBuffer, m_timeStepBoundsReadback.data(), m_boundsGroupCount * 2 * sizeof(float), false,
+													   m_timeStepBoundsReadbackEvent);
+		m_hasTimeStepBoundsReadback = true;
+	}
+
+	void SPHSolver::reorderParticles()
+	{
+		m_particleStore.sortByMortonCode(m_kernelRadius);
+		m_stepsSinceParticleReorder = 0;
+
+		// all per particle indices are invalid now
+		m_hasNeighborListChanged = true;
+		m_hasParticleDataChanged = true;
 	}
 
 	void SPHSolver::buildCachedNeighborLists()
 	{
-		m_spatialGrid.build(m_particles);
+		std::vector<Vector3D>& positions = m_particleStore.getPositions();
+		float neighborSkin = m_neighborSkinFactor * m_kernelRadius;
 
-		// build cached neighbor lists
-		for (int i = 0; i < m_particles.size(); i++)
+		// As long as no particle moved more than half the skin, no pair can have come closer than the kernel radius
+		// without being in the lists already, so only the distances and directions have to be updated
+		if (neighborSkin > 0.f && !m_hasNeighborListChanged && calcMaxNeighborListDisplacement() <= 0.5f * neighborSkin)
 		{
-			m_cachedNeighborLists.push_back(m_spatialGrid.findNeighborParticles(m_particles[i], m_kernelRadius));
+			forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+				m_neighborList.updateNeighbors(begin, end, positions);
+			});
+			m_neighborListStatistics.reuseCount++;
+			return;
 		}
+
+		m_spatialGrid.build(positions);
+
+		// build the neighbor list, every worker collects its particles' neighbors before they are merged
+		m_neighborList.beginBuild(m_particleStore.getSize(), getWorkerCount());
+		forEachParticle([&](int begin, int end, int workerIndex) {
+			for (int i = begin; i < end; i++) {
+				m_neighborList.findNeighbors(i, workerIndex, m_spatialGrid, positions, m_kernelRadius + neighborSkin);
+			}
+		});
+
+		m_neighborList.calcOffsets();
+		m_spatialGrid.addQueryCounts(m_neighborList.getQueryCounts());
+		forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+			m_neighborList.mergeNeighbors(begin, end);
+		});
+
+		if (m_parallelizationType == ParallelizationType::THREADS)
+			buildParticleTasks();
+
+		if (neighborSkin > 0.f)
+			m_neighborListPositions.assign(positions.begin(), positions.end());
+		m_hasNeighborListChanged = false;
+		m_neighborListStatistics.buildCount++;
 	}
 
-	void SPHSolver::calcParticleDensityPressure()
+	float SPHSolver::calcMaxNeighborListDisplacement()
 	{
-		if (m_parallelizationType == ParallelizationType::NONE)
+		std::vector<Vector3D>& positions = m_particleStore.getPositions();
+
+		m_workerMaxDisplacements.assign(getWorkerCount(), 0.f);
+		forEachParticle([&](int begin, int end, int workerIndex) {
+			float workerMaxDisplacement2 = 0.f;
+			for (int i = begin; i < end; i++) {
+				workerMaxDisplacement2 = std::max(workerMaxDisplacement2, (positions[i] - m_neighborListPositions[i]).squareMagnitude());
+			}
+			m_workerMaxDisplacements[workerIndex] = workerMaxDisplacement2;
+		});
+
+		float maxDisplacement2 = 0.f;
+		for (float workerMaxDisplacement2 : m_workerMaxDisplacements)
 		{
-			for (int i = 0; i < m_particles.size(); i++) {
-				SPHParticle* particle = m_particles[i];
+			maxDisplacement2 = std::max(maxDisplacement2, workerMaxDisplacement2);
+		}
+		return sqrtf(maxDisplacement2);
+	}
 
-				// Measure the density with particles' current locations
-				float weightedSum = 0.f;
-				for (SPHParticle* neighborParticle : m_cachedNeighborLists[i])
-				{
-					float distance = (neighborParticle->getPosition() - particle->getPosition()).magnitude();
-					weightedSum += m_defaultKernel.getKernelWeight(distance);
-				}
-				particle->setDensity(m_particleMass * weightedSum);
+	void SPHSolver::buildParticleTasks()
+	{
+		// Split the particles in grid order into tasks of whole cells with about the same number of neighbors,
+		// so sparse splash regions and the dense pool end up in tasks of similar cost
+		const std::vector<int>& cellStarts = m_spatialGrid.getCellStarts();
+		const std::vector<int>& sortedParticleIndices = m_spatialGrid.getSortedParticleIndices();
+
+		long long totalWeight = 0;
+		for (int i = 0; i < m_particleStore.getSize(); i++)
+		{
+			totalWeight += m_neighborList.getNeighborCount(i);
+		}
+		long long targetTaskWeight = std::max(1ll, totalWeight / (m_threadPool->getWorkerCount() * s_tasksPerWorker));
 
-				// Compute pressure based on the density
-				float pressure = m_pressureStiffnessCoefficient * (particle->getDensity() - m_restDensity);
-				if (pressure < 0.f)
-					pressure *= m_negativePressureFactor;
-				particle->setPressure(pressure);
+		m_particleTaskBounds.clear();
+		m_particleTaskBounds.push_back(0);
+		long long taskWeight = 0;
+		for (int cellIndex = 0; cellIndex < m_spatialGrid.getCellCount(); cellIndex++)
+		{
+			for (int sortedIndex = cellStarts[cellIndex]; sortedIndex < cellStarts[cellIndex + 1]; sortedIndex++)
+			{
+				taskWeight += m_neighborList.getNeighborCount(sortedParticleIndices[sortedIndex]);
+			}
+
+			if (taskWeight >= targetTaskWeight)
+			{
+				m_particleTaskBounds.push_back(cellStarts[cellIndex + 1]);
+				taskWeight = 0;
 			}
 		}
+
+		if (m_particleTaskBounds.back() != m_particleStore.getSize())
+			m_particleTaskBounds.push_back(m_particleStore.getSize());
+	}
+
+	void SPHSolver::calcParticleDensityPressure()
+	{
+		if (isComputedOnHost())
+		{
+			std::vector<float>& densities = m_particleStore.getDensities();
+			std::vector<float>& pressures = m_particleStore.getPressures();
+			const std::vector<int>& sortedParticleIndices = m_spatialGrid.getSortedParticleIndices();
+
+			forEachParticleBalanced([&](int begin, int end, int /*workerIndex*/) {
+				for (int sortedIndex = begin; sortedIndex < end; sortedIndex++) {
+					int i = sortedParticleIndices[sortedIndex];
+					// Measure the density with particles' current locations
+					densities[i] = m_particleMass * m_simdKernels.calcDensityKernelSum(m_neighborList.getNeighborDistances(i), m_neighborList.getNeighborCount(i));
+
+					// Compute pressure based on the density
+					float pressure = m_pressureStiffnessCoefficient * (densities[i] - m_restDensity);
+					if (pressure < 0.f)
+						pressure *= m_negativePressureFactor;
+					pressures[i] = pressure;
+				}
+			});
+		}
 		else
 		{
 			//-------- CALC DENSITY AND PRESSURE --------
 			m_calcDensityPressureKernel->setArgument(0, m_positionsBuffer1);
 			m_calcDensityPressureKernel->setArgument(1, m_densitiesBuffer);
 			m_calcDensityPressureKernel->setArgument(2, m_pressuresBuffer);
-			m_calcDensityPressureKernel->setArgument(3, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
-			m_calcDensityPressureKernel->setArgument(4, m_cellListBuffer);
-			m_calcDensityPressureKernel->setArgument(5, m_defaultKernelWeightsBuffer);
-			m_calcDensityPressureKernel->setArgument(6, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
+			m_calcDensityPressureKernel->setArgument(3, m_parametersBuffer);
+			m_calcDensityPressureKernel->setArgument(4, m_cellStartsBuffer);
+			m_calcDensityPressureKernel->setArgument(5, m_cellEndsBuffer);
+			m_calcDensityPressureKernel->setArgument(6, m_particleIndicesBuffer1);
+			m_calcDensityPressureKernel->setArgument(7, m_defaultKernelWeightsBuffer);
+			m_calcDensityPressureKernel->setArgument(8, m_parallelSPHParameters.kernelWeightCount * sizeof(float), NULL);
 
 			m_parallelComputationInterface->executeKernel(m_calcDensityPressureKernel, m_dummyParticleCount, m_workGroupSize);
 		}
 	}
 
+	void SPHSolver::forEachParticle(const ParallelRangeFunction& function)
+	{
+		int particleCount = m_particleStore.getSize();
+		if (m_parallelizationType == ParallelizationType::THREADS)
+			m_threadPool->parallelFor(particleCount, function);
+		else
+			function(0, particleCount, 0);
+	}
+
+	void SPHSolver::forEachParticleBalanced(const ParallelRangeFunction& function)
+	{
+		if (m_parallelizationType == ParallelizationType::THREADS)
+			m_threadPool->parallelForTasks(m_particleTaskBounds, function);
+		else
+			function(0, m_particleStore.getSize(), 0);
+	}
+
+	void SPHSolver::clearWorkerPairSums()
+	{
+		int particleCount = m_particleStore.getSize();
+		m_workerPairSums.resize(getWorkerCount());
+		for (std::vector<Vector3D>& pairSums : m_workerPairSums)
+		{
+			pairSums.resize(particleCount);
+		}
+
+		forEachParticle([&](int begin, int end, int /*workerIndex*/) {
+			for (std::vector<Vector3D>& pairSums : m_workerPairSums)
+			{
+				std::fill(pairSums.begin() + begin, pairSums.begin() + end, Vector3D(0.f, 0.f, 0.f));
+			}
+		});
+	}
+
+	Vector3D SPHSolver::reduceWorkerPairSums(int particleIndex) const
+	{
+		Vector3D sum = m_workerPairSums[0][particleIndex];
+		for (int workerIndex = 1; workerIndex < (int)m_workerPairSums.size(); workerIndex++)
+		{
+			sum += m_workerPairSums[workerIndex][particleIndex];
+		}
+		return sum;
+	}
+
+	int SPHSolver::getWorkerCount() const
+	{
+		if (m_parallelizationType == ParallelizationType::THREADS)
+			return m_threadPool->getWorkerCount();
+		return 1;
+	}
+
+	bool SPHSolver::isComputedOnHost() const
+	{
+		return m_parallelizationType == ParallelizationType::NONE || m_parallelizationType == ParallelizationType::THREADS;
+	}
+
 	void SPHSolver::recalcParticleMass()
 	{
 		//compute mass
@@ -495,15 +937,21 @@ namespace LiPhEn {
 			}
 		}
 
-		float weightedSum = 0.f;
+		// The host measures densities with the analytic poly6 kernel and the device with the cached weights, each path
+		// gets the mass that makes the rest configuration measure exactly the rest density
+		std::vector<float> neighborDistances;
+		float cachedWeightedSum = 0.f;
 		for (Vector3D neighborPoint : neighborPoints)
 		{
 			float distance = neighborPoint.magnitude();
-			weightedSum += m_defaultKernel.getKernelWeight(distance);
+			neighborDistances.push_back(distance);
+			cachedWeightedSum += m_defaultKernel.getKernelWeight(distance);
 		}
+		float weightedSum = m_simdKernels.calcDensityKernelSum(neighborDistances.data(), neighborDistances.size());
         m_particleMass = m_restDensity / weightedSum;
+		m_hasParticleMassChanged = true;
 
-		m_parallelSPHParameters.particleMass = m_particleMass;
+		m_parallelSPHParameters.particleMass = m_restDensity / cachedWeightedSum;
 	}
 
 	void SPHSolver::recalcKernelRadius()
@@ -511,10 +959,12 @@ namespace LiPhEn {
 		m_hasKernelWeightDataChanged = true;
 
 		m_kernelRadius = m_kernelRadiusFactor * m_particleRadius;
+		m_hasNeighborListChanged = true;
 		m_defaultKernel.setRadius(m_kernelRadius);
 		m_pressureKernel.setRadius(m_kernelRadius);
 		m_viscosityKernel.setRadius(m_kernelRadius);
 		m_spatialGrid.setGridSpacing(m_kernelRadius);
+		m_simdKernels.setKernelConstants(m_kernelRadius, m_defaultKernel.getKernelCoefficient(), m_pressureKernel.getFirstDerivativeCoefficient());
 
 		m_parallelSPHParameters.kernelRadius = m_kernelRadius;
 		m_parallelSPHParameters.kernelDivisionStep = m_defaultKernel.getDivisionStep();
@@ -528,6 +978,58 @@ namespace LiPhEn {
 		return m_parallelizationType;
 	}
 
+	SPHSpatialGridType SPHSolver::getSpatialGridType() const
+	{
+		return m_spatialGrid.getType();
+	}
+
+	SPHSpatialGridStatistics SPHSolver::getSpatialGridStatistics() const
+	{
+		return m_spatialGrid.getStatistics();
+	}
+
+	ThreadPoolStatistics SPHSolver::getThreadPoolStatistics() const
+	{
+		if (m_threadPool)
+			return m_threadPool->getStatistics();
+		return ThreadPoolStatistics();
+	}
+
+	SIMDInstructionSet SPHSolver::getSIMDInstructionSet() const
+	{
+		return m_simdKernels.getInstructionSet();
+	}
+
+	float SPHSolver::getNeighborSkinFactor() const
+	{
+		return m_neighborSkinFactor;
+	}
+
+	SPHNeighborListStatistics SPHSolver::getNeighborListStatistics() const
+	{
+		return m_neighborListStatistics;
+	}
+
+	int SPHSolver::getParticleReorderInterval() const
+	{
+		return m_particleReorderInterval;
+	}
+
+	bool SPHSolver::isForceEvaluationSymmetric() const
+	{
+		return m_isForceEvaluationSymmetric;
+	}
+
+	bool SPHSolver::isDeviceResident() const
+	{
+		return m_isDeviceResident;
+	}
+
+	int SPHSolver::getParticleReadbackInterval() const
+	{
+		return m_particleReadbackInterval;
+	}
+
     Vector3D SPHSolver::getGravity() const
     {
         return m_gravity;
@@ -535,7 +1037,7 @@ namespace LiPhEn {
 
     int SPHSolver::getParticleCount() const
     {
-        return m_particles.size();
+        return m_particleStore.getSize();
     }
 
 	float SPHSolver::getParticleRadius() const
@@ -598,6 +1100,11 @@ namespace LiPhEn {
         return m_frictionCoefficient;
     }
 
+	float SPHSolver::getCourantFactor() const
+	{
+		return m_courantFactor;
+	}
+
 	bool SPHSolver::hasGPU() const
 	{
 		return m_parallelComputationInterface->hasGPU();
@@ -607,6 +1114,21 @@ namespace LiPhEn {
 	{
 		return m_parallelComputationInterface->hasCPU();
 	}
+
+	bool SPHSolver::isGraphicsSharingEnabled() const
+	{
+		return m_isGraphicsSharingEnabled;
+	}
+
+	bool SPHSolver::hasGraphicsSharing() const
+	{
+		return m_isGraphicsSharingEnabled && !m_hasGraphicsSharingFailed && !isComputedOnHost() && m_parallelComputationInterface->hasGraphicsSharing();
+	}
+
+	bool SPHSolver::canWriteGraphicsBuffers() const
+	{
+		return m_isGraphicsSharingEnabled && !m_hasGraphicsSharingFailed && !isComputedOnHost();
+	}
 	
 	// SETTER
 	void SPHSolver::setHasCollisionObjectDataChanged(bool hasCollisionObjectDataChanged)
@@ -616,15 +1138,172 @@ namespace LiPhEn {
 
 	void SPHSolver::setParallelizationType(ParallelizationType parallelizationType)
 	{
+		// the host particles have to be up to date before they are computed on the host or uploaded to a new context
+		if (m_isDeviceResident)
+			synchronizeParticleData();
+
 		m_parallelizationType = parallelizationType;
+		m_hasNeighborListChanged = true;
+		// the host and the device normalize the particle mass with different kernel evaluations
+		m_hasParticleMassChanged = true;
+		// sharing is tried again for the new device
+		m_hasGraphicsSharingFailed = false;
+
+		if (m_parallelizationType == ParallelizationType::THREADS && !m_threadPool)
+			m_threadPool = new ThreadPool();
+
+		if (!isComputedOnHost())
+		{
+			m_hasParallelContextChanged = true;
+			reinitParallelContext();
+		}
+	}
+
+	void SPHSolver::resetThreadPoolStatistics()
+	{
+		if (m_threadPool)
+			m_threadPool->resetStatistics();
+	}
+
+	void SPHSolver::setSIMDInstructionSet(SIMDInstructionSet instructionSet)
+	{
+		m_simdKernels.setInstructionSet(instructionSet);
+	}
+
+	void SPHSolver::setNeighborSkinFactor(float neighborSkinFactor)
+	{
+		m_neighborSkinFactor = std::max(0.f, neighborSkinFactor);
+		m_hasNeighborListChanged = true;
+	}
+
+	void SPHSolver::setParticleReorderInterval(int particleReorderInterval)
+	{
+		m_particleReorderInterval = std::max(0, particleReorderInterval);
+	}
+
+	void SPHSolver::setForceEvaluationSymmetric(bool isForceEvaluationSymmetric)
+	{
+		m_isForceEvaluationSymmetric = isForceEvaluationSymmetric;
+
+		// The per worker sums are only needed while pairs are evaluated once
+		if (!m_isForceEvaluationSymmetric)
+			std::vector<std::vector<Vector3D>>().swap(m_workerPairSums);
+	}
+
+	void SPHSolver::setDeviceResident(bool isDeviceResident)
+	{
+		if (m_isDeviceResident && !isDeviceResident)
+			synchronizeParticleData();
+
+		m_isDeviceResident = isDeviceResident;
+		m_hasBoundsReadback[0] = false;
+		m_hasBoundsReadback[1] = false;
+		m_hasTimeStepBoundsReadback = false;
+	}
+
+	void SPHSolver::setParticleReadbackInterval(int particleReadbackInterval)
+	{
+		m_particleReadbackInterval = std::max(0, particleReadbackInterval);
+	}
+
+	void SPHSolver::setGraphicsSharingEnabled(bool isGraphicsSharingEnabled)
+	{
+		m_isGraphicsSharingEnabled = isGraphicsSharingEnabled;
+		m_hasGraphicsSharingFailed = false;
+		m_parallelComputationInterface->setGraphicsSharingRequested(isGraphicsSharingEnabled);
+	}
+
+	int SPHSolver::writeGraphicsBuffers(unsigned int translationsBuffer, unsigned int colorsBuffer, int instanceCapacity, bool haveBuffersChanged)
+	{
+		if (!m_isGraphicsSharingEnabled || isComputedOnHost() || m_hasGraphicsSharingFailed)
+			return -1;
 
-		if (m_parallelizationType != ParallelizationType::NONE)
+		// The device context has to be created while the OpenGL context is current to share buffers with it
+		if (!m_parallelComputationInterface->hasGraphicsSharing())
 		{
+			if (m_isDeviceResident)
+				synchronizeParticleData();
 			m_hasParallelContextChanged = true;
 			reinitParallelContext();
+
+			if (!m_parallelComputationInterface->hasGraphicsSharing())
+			{
+				m_hasGraphicsSharingFailed = true;
+				return -1;
+			}
+		}
+
+		// The particles are uploaded with the next step
+		if (m_uploadedParticleCount == 0)
+			return -1;
+
+		// Reallocated OpenGL buffers have to be wrapped again
+		if (haveBuffersChanged || translationsBuffer != m_sharedTranslationsGraphicsBuffer || colorsBuffer != m_sharedColorsGraphicsBuffer)
+		{
+			releaseGraphicsBuffers();
+			m_sharedTranslationsBuffer = m_parallelComputationInterface->createSharedBuffer(ParallelBufferType::WRITE_ONLY, translationsBuffer);
+			m_sharedColorsBuffer = m_parallelComputationInterface->createSharedBuffer(ParallelBufferType::WRITE_ONLY, colorsBuffer);
+			if (!m_sharedTranslationsBuffer || !m_sharedColorsBuffer)
+			{
+				releaseGraphicsBuffers();
+				m_hasGraphicsSharingFailed = true;
+				return -1;
+			}
+			m_sharedTranslationsGraphicsBuffer = translationsBuffer;
+			m_sharedColorsGraphicsBuffer = colorsBuffer;
+		}
+
+		unsigned int instanceCount = std::min(instanceCapacity, m_uploadedParticleCount);
+		if (instanceCount == 0)
+			return 0;
+
+		std::vector<ParallelBuffer*> sharedBuffers = { m_sharedTranslationsBuffer, m_sharedColorsBuffer };
+		m_parallelComputationInterface->acquireSharedBuffers(sharedBuffers);
+
+		m_writeInstanceDataKernel->setArgument(0, m_positionsBuffer1);
+		m_writeInstanceDataKernel->setArgument(1, m_velocitiesBuffer1);
+		m_writeInstanceDataKernel->setArgument(2, m_sharedTranslationsBuffer);
+		m_writeInstanceDataKernel->setArgument(3, m_sharedColorsBuffer);
+		m_writeInstanceDataKernel->setArgument(4, sizeof(instanceCount), &instanceCount);
+
+		unsigned int globalSize = ((instanceCount + m_workGroupSize - 1) / m_workGroupSize) * m_workGroupSize;
+		m_parallelComputationInterface->executeKernel(m_writeInstanceDataKernel, globalSize, m_workGroupSize);
+
+		// OpenGL may only use the buffers once the device is done with them
+		m_parallelComputationInterface->releaseSharedBuffers(sharedBuffers);
+		m_parallelComputationInterface->waitUntilFinished();
+
+		return instanceCount;
+	}
+
+	void SPHSolver::synchronizeParticleData()
+	{
+		if (isComputedOnHost() || m_uploadedParticleCount == 0)
+			return;
+
+		readParticleData();
+
+		// the pending readbacks are older than the data that was just read
+		for (ParallelParticleReadback& readback : m_particleReadbacks)
+		{
+			if (readback.isPending)
+				readback.completionEvent->wait();
+			readback.isPending = false;
 		}
 	}
 
+	void SPHSolver::resetNeighborListStatistics()
+	{
+		m_neighborListStatistics.buildCount = 0;
+		m_neighborListStatistics.reuseCount = 0;
+	}
+
+	void SPHSolver::setSpatialGridType(SPHSpatialGridType spatialGridType)
+	{
+		m_spatialGrid.setType(spatialGridType);
+		m_spatialGrid.resetStatistics();
+	}
+
     void SPHSolver::setGravity(const Vector3D& gravity)
     {
         m_gravity = gravity;
@@ -709,6 +1388,11 @@ namespace LiPhEn {
 		m_parallelSPHParameters.frictionCoefficient = m_frictionCoefficient;
     }
 
+	void SPHSolver::setCourantFactor(float courantFactor)
+	{
+		m_courantFactor = courantFactor;
+	}
+
 	// OPEN CL METHODS
 	void SPHSolver::reinitParallelContext()
 	{
@@ -723,21 +1407,44 @@ namespace LiPhEn {
 			deviceType = ParallelDeviceType::GPU;
 		}
 
-		std::ifstream kernelFile("cl_kernels/SPHKernels.cl");
-		std::string kernelString(std::istreambuf_iterator<char>(kernelFile), (std::istreambuf_iterator<char>()));
 		ParallelSources sources;
-		sources.push_back(std::make_pair(kernelString.c_str(), kernelString.length() + 1));
+		// The length excludes the terminating null of the embedded array
+		sources.push_back(std::make_pair((const char*)s_sphKernelsSource, (unsigned int)sizeof(s_sphKernelsSource) - 1));
+
+		// the readback memory is mapped on the queue of the old context and the device particles are gone with it
+		releaseParticleReadbacks();
+		m_uploadedParticleCount = 0;
+		if (m_isUploadPending)
+			m_uploadEvent->wait();
+		m_isUploadPending = false;
+		m_pendingReadbackEvent = NULL;
+		for (int i = 0; i < 2; i++)
+		{
+			if (m_isParametersUploadPending[i])
+				m_parametersUploadEvents[i]->wait();
+			m_isParametersUploadPending[i] = false;
+		}
 
+		// The solver stages are enqueued without events and rely on an in order compute queue
+		m_parallelComputationInterface->setOutOfOrderExecutionRequested(false);
 		m_parallelComputationInterface->reinitContext(sources, deviceType, true);
 		
+		if (m_reduceBoundsKernel)
+			delete m_reduceBoundsKernel;
+		if (m_reduceTimeStepBoundsKernel)
+			delete m_reduceTimeStepBoundsKernel;
 		if (m_calcGridIndicesKernel)
 			delete m_calcGridIndicesKernel;
 		if (m_countDigitsInBucketsKernel)
 			delete m_countDigitsInBucketsKernel;
 		if (m_scanBucketsKernel)
 			delete m_scanBucketsKernel;
-		if (m_permuteParticlesKernel)
-			delete m_permuteParticlesKernel;
+		if (m_addBlockOffsetsKernel)
+			delete m_addBlockOffsetsKernel;
+		if (m_permuteSortKeysKernel)
+			delete m_permuteSortKeysKernel;
+		if (m_gatherParticlesKernel)
+			delete m_gatherParticlesKernel;
 		if (m_buildCellListKernel)
 			delete m_buildCellListKernel;
 		if (m_calcDensityPressureKernel)
@@ -750,22 +1457,74 @@ namespace LiPhEn {
 			delete m_integrateKernel;
 		if (m_handleCollisionsKernel)
 			delete m_handleCollisionsKernel;
+		if (m_writeInstanceDataKernel)
+			delete m_writeInstanceDataKernel;
+		// the shared buffers belong to the old context
+		releaseGraphicsBuffers();
 
+		m_reduceBoundsKernel = m_parallelComputationInterface->createKernel("reduceBounds");
+		m_reduceTimeStepBoundsKernel = m_parallelComputationInterface->createKernel("reduceTimeStepBounds");
 		m_calcGridIndicesKernel = m_parallelComputationInterface->createKernel("calcGridIndices");
 		m_countDigitsInBucketsKernel = m_parallelComputationInterface->createKernel("countDigitsInBuckets");
 		m_scanBucketsKernel = m_parallelComputationInterface->createKernel("scanBuckets");
-		m_permuteParticlesKernel = m_parallelComputationInterface->createKernel("permuteParticles");
+		m_addBlockOffsetsKernel = m_parallelComputationInterface->createKernel("addBlockOffsets");
+		m_permuteSortKeysKernel = m_parallelComputationInterface->createKernel("permuteSortKeys");
+		m_gatherParticlesKernel = m_parallelComputationInterface->createKernel("gatherParticles");
 		m_buildCellListKernel = m_parallelComputationInterface->createKernel("buildCellList");
 		m_calcDensityPressureKernel = m_parallelComputationInterface->createKernel("calcDensityPressure");
 		m_accumulateNonPressureForcesKernel = m_parallelComputationInterface->createKernel("accumulateNonPressureForces");
 		m_accumulatePressureForcesKernel = m_parallelComputationInterface->createKernel("accumulatePressureForces");
 		m_integrateKernel = m_parallelComputationInterface->createKernel("integrate");
 		m_handleCollisionsKernel = m_parallelComputationInterface->createKernel("handleCollisions");
+		m_writeInstanceDataKernel = m_parallelComputationInterface->createKernel("writeInstanceData");
 
 		unsigned int kernelWeightsBufferSize = m_defaultKernel.getKernelWeights().size() * sizeof(float);
 
 		if (m_bucketCountsBuffer)
 			delete m_bucketCountsBuffer;
+		for (ParallelBuffer* blockSumsBuffer : m_scanBlockSumsBuffers)
+			delete blockSumsBuffer;
+		m_scanBlockSumsBuffers.clear();
+		if (m_cellStartsBuffer)
+			delete m_cellStartsBuffer;
+		if (m_cellEndsBuffer)
+			delete m_cellEndsBuffer;
+		m_cellStartsBuffer = NULL;
+		m_cellEndsBuffer = NULL;
+		m_cellListCapacity = 0;
+		if (m_minBoundsBuffer)
+			delete m_minBoundsBuffer;
+		if (m_maxBoundsBuffer)
+			delete m_maxBoundsBuffer;
+		if (m_timeStepBoundsBuffer)
+			delete m_timeStepBoundsBuffer;
+		for (int i = 0; i < 2; i++)
+		{
+			if (m_boundsReadbackEvents[i])
+				delete m_boundsReadbackEvents[i];
+			m_boundsReadbackEvents[i] = m_parallelComputationInterface->createEvent();
+			m_hasBoundsReadback[i] = false;
+		}
+		if (m_timeStepBoundsReadbackEvent)
+			delete m_timeStepBoundsReadbackEvent;
+		m_timeStepBoundsReadbackEvent = m_parallelComputationInterface->createEvent();
+		m_hasTimeStepBoundsReadback = false;
+		if (m_uploadEvent)
+			delete m_uploadEvent;
+		if (m_computeMarkerEvent)
+			delete m_computeMarkerEvent;
+		m_uploadEvent = m_parallelComputationInterface->createEvent();
+		m_computeMarkerEvent = m_parallelComputationInterface->createEvent();
+		if (m_parametersBuffer)
+			delete m_parametersBuffer;
+		m_parametersBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_ONLY, sizeof(ParallelSPHParameters));
+		for (int i = 0; i < 2; i++)
+		{
+			if (m_parametersUploadEvents[i])
+				delete m_parametersUploadEvents[i];
+			m_parametersUploadEvents[i] = m_parallelComputationInterface->createEvent();
+		}
+		m_hasUploadedParameters = false;
 		if (m_defaultKernelWeightsBuffer)
 			delete m_defaultKernelWeightsBuffer;
 		if (m_defaultKernelFirstDerivativeWeightsBuffer)
@@ -778,6 +1537,9 @@ namespace LiPhEn {
 			delete m_viscosityKernelSecondDerivativeWeightsBuffer;
 
 		m_bucketCountsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_radixThreadCount * m_radixBucketCount * sizeof(unsigned int));
+		m_minBoundsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_boundsGroupCount * sizeof(float4));
+		m_maxBoundsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_boundsGroupCount * sizeof(float4));
+		m_timeStepBoundsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_boundsGroupCount * 2 * sizeof(float));
 		m_defaultKernelWeightsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_ONLY, kernelWeightsBufferSize);
 		m_defaultKernelFirstDerivativeWeightsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_ONLY, kernelWeightsBufferSize);
 		m_defaultKernelSecondDerivativeWeightsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_ONLY, kernelWeightsBufferSize);
@@ -788,101 +1550,162 @@ namespace LiPhEn {
 	void SPHSolver::initParallelBuffers()
 	{
 		// PARTICLES
-		if (m_hasParallelContextChanged || m_hasParticleDataChanged)
+		int particleCount = m_particleStore.getSize();
+		m_dummyParticleCount = particleCount;
+		if (m_dummyParticleCount < 512)
+		{
+			m_dummyParticleCount = 512;
+		}
+		if (m_dummyParticleCount % m_workGroupSize != 0)
 		{
+			m_dummyParticleCount += (m_workGroupSize - (m_dummyParticleCount % m_workGroupSize));
+		}
+
+		if (m_hasParallelContextChanged || m_hasParticleDataChanged || m_dummyParticleCount > m_particleCapacity)
+		{
+			// If the buffers only grow, the device data is kept, in device resident mode it is newer than the host data
+			bool isKeepingDeviceData = !m_hasParallelContextChanged && !m_hasParticleDataChanged;
 			m_hasParticleDataChanged = false;
 
-			// Write particle data into temp buffer
-			m_dummyParticleCount = m_particles.size();
-			if (m_dummyParticleCount < 512)
+			// Only reallocate if the capacity is exceeded, it is doubled so continuously emitted particles rarely cause a reallocation
+			if (m_hasParallelContextChanged || m_dummyParticleCount > m_particleCapacity)
 			{
-				m_dummyParticleCount = 512;
+				if (m_hasParallelContextChanged)
+					m_particleCapacity = m_dummyParticleCount;
+				else
+					m_particleCapacity = std::max(m_dummyParticleCount, 2 * m_particleCapacity);
+
+				ParallelBuffer* oldPositionsBuffer = m_positionsBuffer1;
+				ParallelBuffer* oldVelocitiesBuffer = m_velocitiesBuffer1;
+				ParallelBuffer* oldHalfVelocitiesBuffer = m_halfVelocitiesBuffer1;
+				ParallelBuffer* oldIsFirstTimeStepsBuffer = m_isFirstTimeStepsBuffer1;
+				if (m_positionsBuffer2)
+					delete m_positionsBuffer2;
+				if (m_velocitiesBuffer2)
+					delete m_velocitiesBuffer2;
+				if (m_halfVelocitiesBuffer2)
+					delete m_halfVelocitiesBuffer2;
+				if (m_isFirstTimeStepsBuffer2)
+					delete m_isFirstTimeStepsBuffer2;
+				if (m_gridIndicesBuffer1)
+					delete m_gridIndicesBuffer1;
+				if (m_gridIndicesBuffer2)
+					delete m_gridIndicesBuffer2;
+				if (m_particleIndicesBuffer1)
+					delete m_particleIndicesBuffer1;
+				if (m_particleIndicesBuffer2)
+					delete m_particleIndicesBuffer2;
+				if (m_oldHalfVelocitiesBuffer)
+					delete m_oldHalfVelocitiesBuffer;
+				if (m_accumulatedForcesBuffer)
+					delete m_accumulatedForcesBuffer;
+				if (m_densitiesBuffer)
+					delete m_densitiesBuffer;
+				if (m_pressuresBuffer)
+					delete m_pressuresBuffer;
+
+				m_positionsBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(float4));
+				m_positionsBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(float4));
+				m_velocitiesBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(float4));
+				m_velocitiesBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(float4));
+				m_halfVelocitiesBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(float4));
+				m_halfVelocitiesBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(float4));
+				m_isFirstTimeStepsBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(unsigned int));
+				m_isFirstTimeStepsBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(unsigned int));
+				m_gridIndicesBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(unsigned int));
+				m_gridIndicesBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(unsigned int));
+				m_particleIndicesBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(unsigned int));
+				m_particleIndicesBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(unsigned int));
+				m_oldHalfVelocitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(float4));
+				m_accumulatedForcesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(float4));
+				m_densitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(float));
+				m_pressuresBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_particleCapacity * sizeof(float));
+
+				if (isKeepingDeviceData && m_uploadedParticleCount > 0)
+				{
+					m_parallelComputationInterface->copyBuffer(oldPositionsBuffer, m_positionsBuffer1, m_uploadedParticleCount * sizeof(float4));
+					m_parallelComputationInterface->copyBuffer(oldVelocitiesBuffer, m_velocitiesBuffer1, m_uploadedParticleCount * sizeof(float4));
+					m_parallelComputationInterface->copyBuffer(oldHalfVelocitiesBuffer, m_halfVelocitiesBuffer1, m_uploadedParticleCount * sizeof(float4));
+					m_parallelComputationInterface->copyBuffer(oldIsFirstTimeStepsBuffer, m_isFirstTimeStepsBuffer1, m_uploadedParticleCount * sizeof(unsigned int));
+				}
+
+				if (oldPositionsBuffer)
+					delete oldPositionsBuffer;
+				if (oldVelocitiesBuffer)
+					delete oldVelocitiesBuffer;
+				if (oldHalfVelocitiesBuffer)
+					delete oldHalfVelocitiesBuffer;
+				if (oldIsFirstTimeStepsBuffer)
+					delete oldIsFirstTimeStepsBuffer;
 			}
-			if (m_dummyParticleCount % m_workGroupSize != 0)
+
+			// Otherwise the device data is replaced with the host data
+			if (!isKeepingDeviceData)
+				m_uploadedParticleCount = 0;
+		}
+
+		// Upload the particles added since the last upload
+		m_firstNewParticleIndex = m_uploadedParticleCount;
+		if (m_uploadedParticleCount < particleCount)
+		{
+			int newParticleCount = particleCount - m_uploadedParticleCount;
+
+			// The staging data of the last upload may still be in use
+			if (m_isUploadPending)
+				m_uploadEvent->wait();
+
+			// Write particle data into the staging buffers
+			m_uploadPositions.resize(newParticleCount);
+			m_uploadVelocities.resize(newParticleCount);
+			m_uploadHalfVelocities.resize(newParticleCount);
+			m_uploadIsFirstTimeSteps.resize(newParticleCount);
+			std::vector<Vector3D>& positions = m_particleStore.getPositions();
+			std::vector<Vector3D>& velocities = m_particleStore.getVelocities();
+			std::vector<Vector3D>& halfVelocities = m_particleStore.getHalfVelocities();
+			std::vector<unsigned int>& isFirstTimeSteps = m_particleStore.getIsFirstTimeSteps();
+			for (int i = 0; i < newParticleCount; i++)
 			{
-				m_dummyParticleCount += (m_workGroupSize - (m_dummyParticleCount % m_workGroupSize));
+				int particleIndex = m_uploadedParticleCount + i;
+
+				m_uploadPositions[i].x = positions[particleIndex].getX();
+				m_uploadPositions[i].y = positions[particleIndex].getY();
+				m_uploadPositions[i].z = positions[particleIndex].getZ();
+				m_uploadPositions[i].w = 0.f;
+
+				m_uploadVelocities[i].x = velocities[particleIndex].getX();
+				m_uploadVelocities[i].y = velocities[particleIndex].getY();
+				m_uploadVelocities[i].z = velocities[particleIndex].getZ();
+				m_uploadVelocities[i].w = 0.f;
+
+				m_uploadHalfVelocities[i].x = halfVelocities[particleIndex].getX();
+				m_uploadHalfVelocities[i].y = halfVelocities[particleIndex].getY();
+				m_uploadHalfVelocities[i].z = halfVelocities[particleIndex].getZ();
+				m_uploadHalfVelocities[i].w = 0.f;
+
+				m_uploadIsFirstTimeSteps[i] = isFirstTimeSteps[particleIndex];
 			}
 
-			float4* positionsBuffer = new float4[m_dummyParticleCount];
-			float4* velocitesBuffer = new float4[m_dummyParticleCount];
-			float4* halfVelocitiesBuffer = new float4[m_dummyParticleCount];
-			unsigned int* isFirstTimeStepsBuffer = new unsigned int[m_dummyParticleCount];
-			for (int i = 0; i < m_particles.size(); i++)
+			// Appended particles don't overlap with the particles the last step may still be computing, a full upload waits for it
+			ParallelEvents waitEvents;
+			if (m_uploadedParticleCount == 0)
 			{
-				positionsBuffer[i].x = m_particles[i]->getPosition().getX();
-				positionsBuffer[i].y = m_particles[i]->getPosition().getY();
-				positionsBuffer[i].z = m_particles[i]->getPosition().getZ();
-				positionsBuffer[i].w = 0.f;
-
-				velocitesBuffer[i].x = m_particles[i]->getVelocity().getX();
-				velocitesBuffer[i].y = m_particles[i]->getVelocity().getY();
-				velocitesBuffer[i].z = m_particles[i]->getVelocity().getZ();
-				velocitesBuffer[i].w = 0.f;
-
-				halfVelocitiesBuffer[i].x = m_particles[i]->getHalfVelocity().getX();
-				halfVelocitiesBuffer[i].y = m_particles[i]->getHalfVelocity().getY();
-				halfVelocitiesBuffer[i].z = m_particles[i]->getHalfVelocity().getZ();
-				halfVelocitiesBuffer[i].w = 0.f;
-
-				isFirstTimeStepsBuffer[i] = m_particles[i]->getIsFirstTimeStep();
+				m_parallelComputationInterface->enqueueMarker(m_computeMarkerEvent);
+				waitEvents.push_back(m_computeMarkerEvent);
 			}
 
-			if (m_positionsBuffer1)
-				delete m_positionsBuffer1;
-			if (m_positionsBuffer2)
-				delete m_positionsBuffer2;
-			if (m_velocitiesBuffer1)
-				delete m_velocitiesBuffer1;
-			if (m_velocitiesBuffer2)
-				delete m_velocitiesBuffer2;
-			if (m_halfVelocitiesBuffer1)
-				delete m_halfVelocitiesBuffer1;
-			if (m_halfVelocitiesBuffer2)
-				delete m_halfVelocitiesBuffer2;
-			if (m_isFirstTimeStepsBuffer1)
-				delete m_isFirstTimeStepsBuffer1;
-			if (m_isFirstTimeStepsBuffer2)
-				delete m_isFirstTimeStepsBuffer2;
-			if (m_gridIndicesBuffer1)
-				delete m_gridIndicesBuffer1;
-			if (m_gridIndicesBuffer2)
-				delete m_gridIndicesBuffer2;
-			if (m_oldHalfVelocitiesBuffer)
-				delete m_oldHalfVelocitiesBuffer;
-			if (m_accumulatedForcesBuffer)
-				delete m_accumulatedForcesBuffer;
-			if (m_densitiesBuffer)
-				delete m_densitiesBuffer;
-			if (m_pressuresBuffer)
-				delete m_pressuresBuffer;
-
-			// Create new OpenCL buffers because the size might have changed
-			m_positionsBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-			m_positionsBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-			m_velocitiesBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-			m_velocitiesBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-			m_halfVelocitiesBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-			m_halfVelocitiesBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-			m_isFirstTimeStepsBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(unsigned int));
-			m_isFirstTimeStepsBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(unsigned int));
-			m_gridIndicesBuffer1 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(unsigned int));
-			m_gridIndicesBuffer2 = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(unsigned int));
-			m_oldHalfVelocitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-			m_accumulatedForcesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float4));
-			m_densitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float));
-			m_pressuresBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_dummyParticleCount * sizeof(float));
-
 			// Write data to Multiprocessor Device
-			m_parallelComputationInterface->writeToBuffer(m_positionsBuffer1, positionsBuffer, m_dummyParticleCount * sizeof(float4), true);
-			m_parallelComputationInterface->writeToBuffer(m_velocitiesBuffer1, velocitesBuffer, m_dummyParticleCount * sizeof(float4), true);
-			m_parallelComputationInterface->writeToBuffer(m_halfVelocitiesBuffer1, halfVelocitiesBuffer, m_dummyParticleCount * sizeof(float4), true);
-			m_parallelComputationInterface->writeToBuffer(m_isFirstTimeStepsBuffer1, isFirstTimeStepsBuffer, m_dummyParticleCount * sizeof(unsigned int), true);
-
-			// Delete dynamically created temporary arrays
-			delete[] positionsBuffer;
-			delete[] velocitesBuffer;
-			delete[] halfVelocitiesBuffer;
-			delete[] isFirstTimeStepsBuffer;
+			unsigned int offset = m_uploadedParticleCount;
+			m_parallelComputationInterface->writeToBuffer(m_positionsBuffer1, m_uploadPositions.data(), newParticleCount * sizeof(float4), false, offset * sizeof(float4), NULL, waitEvents, ParallelQueueType::TRANSFER);
+			m_parallelComputationInterface->writeToBuffer(m_velocitiesBuffer1, m_uploadVelocities.data(), newParticleCount * sizeof(float4), false, offset * sizeof(float4), NULL, waitEvents, ParallelQueueType::TRANSFER);
+			m_parallelComputationInterface->writeToBuffer(m_halfVelocitiesBuffer1, m_uploadHalfVelocities.data(), newParticleCount * sizeof(float4), false, offset * sizeof(float4), NULL, waitEvents, ParallelQueueType::TRANSFER);
+			m_parallelComputationInterface->writeToBuffer(m_isFirstTimeStepsBuffer1, m_uploadIsFirstTimeSteps.data(), newParticleCount * sizeof(unsigned int), false, offset * sizeof(unsigned int), NULL, waitEvents, ParallelQueueType::TRANSFER);
+			m_parallelComputationInterface->enqueueMarker(m_uploadEvent, ParallelQueueType::TRANSFER);
+			m_isUploadPending = true;
+
+			// The grid build is the first computation that needs the new particles
+			m_parallelComputationInterface->enqueueWait({ m_uploadEvent });
+
+			m_uploadedParticleCount = particleCount;
 		}
 
 		// KERNEL WEIGHTS
@@ -1012,12 +1835,30 @@ namespace LiPhEn {
 		float minX, maxX, minY, maxY, minZ, maxZ;
 		minX = minY = minZ = FLT_MAX;
 		maxX = maxY = maxZ = FLT_MIN;
+		int firstHostBoundsParticle = 0;
+
+		// In device resident mode the host positions are stale, the bounds reduced on the device two steps ago are
+		// padded by one cell for the movement since then, particles leaving the grid are clamped to its border cells
+		if (m_isDeviceResident && m_hasBoundsReadback[m_boundsReadbackIndex])
+		{
+			m_boundsReadbackEvents[m_boundsReadbackIndex]->wait();
+			float padding = m_kernelRadius * m_gridSpacingFactor;
+			minX = m_boundsReadbacks[m_boundsReadbackIndex][0].x - padding;
+			minY = m_boundsReadbacks[m_boundsReadbackIndex][0].y - padding;
+			minZ = m_boundsReadbacks[m_boundsReadbackIndex][0].z - padding;
+			maxX = m_boundsReadbacks[m_boundsReadbackIndex][1].x + padding;
+			maxY = m_boundsReadbacks[m_boundsReadbackIndex][1].y + padding;
+			maxZ = m_boundsReadbacks[m_boundsReadbackIndex][1].z + padding;
+			// Only the particles uploaded this step are missing in the device bounds
+			firstHostBoundsParticle = m_firstNewParticleIndex;
+		}
 
-		for (SPHParticle* particle : m_particles)
+		const std::vector<Vector3D>& positions = m_particleStore.getPositions();
+		for (int i = firstHostBoundsParticle; i < (int)positions.size(); i++)
 		{
-			float xPos = particle->getPosition().getX();
-			float yPos = particle->getPosition().getY();
-			float zPos = particle->getPosition().getZ();
+			float xPos = positions[i].getX();
+			float yPos = positions[i].getY();
+			float zPos = positions[i].getZ();
 
 			if (xPos < minX) minX = xPos;
 			if (yPos < minY) minY = yPos;
@@ -1039,22 +1880,31 @@ namespace LiPhEn {
 		m_parallelSPHParameters.gridSize.w = 0;
 		m_parallelSPHParameters.cellCount = m_parallelSPHParameters.gridSize.x * m_parallelSPHParameters.gridSize.y * m_parallelSPHParameters.gridSize.z;
 
+		// All parameters of this step are known now
+		uploadParallelParameters();
+
 		// Calc grid indices for particles
 		m_calcGridIndicesKernel->setArgument(0, m_positionsBuffer1);
 		m_calcGridIndicesKernel->setArgument(1, m_gridIndicesBuffer1);
-		m_calcGridIndicesKernel->setArgument(2, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
+		m_calcGridIndicesKernel->setArgument(2, m_particleIndicesBuffer1);
+		m_calcGridIndicesKernel->setArgument(3, m_parametersBuffer);
 
 		m_parallelComputationInterface->executeKernel(m_calcGridIndicesKernel, m_dummyParticleCount, m_workGroupSize);
 
-		// Sort Particles by grid index with Radix Sort
-		unsigned int* bucketCountBuffer = new unsigned int[m_radixThreadCount * m_radixBucketCount];
+		// Only sort the digits the largest grid index actually uses
+		unsigned int maxGridIndex = m_parallelSPHParameters.cellCount - 1;
+		unsigned int maxRadixPassCount = 8 * sizeof(unsigned int) / m_radixWidth;
+		m_radixPassCount = 1;
+		while (m_radixPassCount < maxRadixPassCount && (maxGridIndex >> (m_radixPassCount * m_radixWidth)) != 0)
+			m_radixPassCount++;
 
+		// Sort Particles by grid index with Radix Sort, all passes stay on the device
 		for (int pass = 0; pass < m_radixPassCount; pass++)
 		{
 			// Count digits of grid index in buckets
 			m_countDigitsInBucketsKernel->setArgument(0, m_gridIndicesBuffer1);
 			m_countDigitsInBucketsKernel->setArgument(1, m_bucketCountsBuffer);
-			m_countDigitsInBucketsKernel->setArgument(2, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
+			m_countDigitsInBucketsKernel->setArgument(2, m_parametersBuffer);
 			m_countDigitsInBucketsKernel->setArgument(3, sizeof(m_radixThreadCount), &m_radixThreadCount);
 			m_countDigitsInBucketsKernel->setArgument(4, sizeof(pass), &pass);
 			m_countDigitsInBucketsKernel->setArgument(5, sizeof(m_radixWidth), &m_radixWidth);
@@ -1063,38 +1913,50 @@ namespace LiPhEn {
 
 			m_parallelComputationInterface->executeKernel(m_countDigitsInBucketsKernel, m_radixThreadCount);
 
-			m_parallelComputationInterface->readFromBuffer(m_bucketCountsBuffer, bucketCountBuffer, m_radixThreadCount * m_radixBucketCount * sizeof(unsigned int), true);
-			m_parallelComputationInterface->waitUntilFinished();
-
 			// Scan buckets
-			unsigned int sum = 0;
-			for (int i = 0; i < m_radixThreadCount * m_radixBucketCount; i++)
-			{
-				unsigned int val = bucketCountBuffer[i];
-				bucketCountBuffer[i] = sum;
-				sum += val;
-			}
+			scanParallelBuffer(m_bucketCountsBuffer, m_radixThreadCount * m_radixBucketCount);
+
+			// Permute grid and particle indices
+			m_permuteSortKeysKernel->setArgument(0, m_gridIndicesBuffer1);
+			m_permuteSortKeysKernel->setArgument(1, m_gridIndicesBuffer2);
+			m_permuteSortKeysKernel->setArgument(2, m_particleIndicesBuffer1);
+			m_permuteSortKeysKernel->setArgument(3, m_particleIndicesBuffer2);
+			m_permuteSortKeysKernel->setArgument(4, m_bucketCountsBuffer);
+			m_permuteSortKeysKernel->setArgument(5, m_parametersBuffer);
+			m_permuteSortKeysKernel->setArgument(6, sizeof(m_radixThreadCount), &m_radixThreadCount);
+			m_permuteSortKeysKernel->setArgument(7, sizeof(pass), &pass);
+			m_permuteSortKeysKernel->setArgument(8, sizeof(m_radixWidth), &m_radixWidth);
+
+			m_parallelComputationInterface->executeKernel(m_permuteSortKeysKernel, m_radixThreadCount);
+
+			// Swap Index Buffers
+			ParallelBuffer* temp = m_gridIndicesBuffer1;
+			m_gridIndicesBuffer1 = m_gridIndicesBuffer2;
+			m_gridIndicesBuffer2 = temp;
 
-			m_parallelComputationInterface->writeToBuffer(m_bucketCountsBuffer, bucketCountBuffer, m_radixThreadCount * m_radixBucketCount * sizeof(unsigned int), true);
-
-			// Permute particles
-			m_permuteParticlesKernel->setArgument(0, m_positionsBuffer1);
-			m_permuteParticlesKernel->setArgument(1, m_positionsBuffer2);
-			m_permuteParticlesKernel->setArgument(2, m_velocitiesBuffer1);
-			m_permuteParticlesKernel->setArgument(3, m_velocitiesBuffer2);
-			m_permuteParticlesKernel->setArgument(4, m_halfVelocitiesBuffer1);
-			m_permuteParticlesKernel->setArgument(5, m_halfVelocitiesBuffer2);
-			m_permuteParticlesKernel->setArgument(6, m_isFirstTimeStepsBuffer1);
-			m_permuteParticlesKernel->setArgument(7, m_isFirstTimeStepsBuffer2);
-			m_permuteParticlesKernel->setArgument(8, m_gridIndicesBuffer1);
-			m_permuteParticlesKernel->setArgument(9, m_gridIndicesBuffer2);
-			m_permuteParticlesKernel->setArgument(10, m_bucketCountsBuffer);
-			m_permuteParticlesKernel->setArgument(11, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
-			m_permuteParticlesKernel->setArgument(12, sizeof(m_radixThreadCount), &m_radixThreadCount);
-			m_permuteParticlesKernel->setArgument(13, sizeof(pass), &pass);
-			m_permuteParticlesKernel->setArgument(14, sizeof(m_radixWidth), &m_radixWidth);
-
-			m_parallelComputationInterface->executeKernel(m_permuteParticlesKernel, m_radixThreadCount);
+			temp = m_particleIndicesBuffer1;
+			m_particleIndicesBuffer1 = m_particleIndicesBuffer2;
+			m_particleIndicesBuffer2 = temp;
+		}
+
+		// Gather particles in sorted order, in between the neighbor search goes through the sorted particle indices
+		m_stepsSinceParticleReorder++;
+		if (m_particleReorderInterval > 0 && m_stepsSinceParticleReorder >= m_particleReorderInterval)
+		{
+			m_stepsSinceParticleReorder = 0;
+
+			m_gatherParticlesKernel->setArgument(0, m_positionsBuffer1);
+			m_gatherParticlesKernel->setArgument(1, m_positionsBuffer2);
+			m_gatherParticlesKernel->setArgument(2, m_velocitiesBuffer1);
+			m_gatherParticlesKernel->setArgument(3, m_velocitiesBuffer2);
+			m_gatherParticlesKernel->setArgument(4, m_halfVelocitiesBuffer1);
+			m_gatherParticlesKernel->setArgument(5, m_halfVelocitiesBuffer2);
+			m_gatherParticlesKernel->setArgument(6, m_isFirstTimeStepsBuffer1);
+			m_gatherParticlesKernel->setArgument(7, m_isFirstTimeStepsBuffer2);
+			m_gatherParticlesKernel->setArgument(8, m_particleIndicesBuffer1);
+			m_gatherParticlesKernel->setArgument(9, m_parametersBuffer);
+
+			m_parallelComputationInterface->executeKernel(m_gatherParticlesKernel, m_dummyParticleCount, m_workGroupSize);
 
 			// Swap Particle Buffers
 			ParallelBuffer* temp = m_positionsBuffer1;
@@ -1112,22 +1974,251 @@ namespace LiPhEn {
 			temp = m_isFirstTimeStepsBuffer1;
 			m_isFirstTimeStepsBuffer1 = m_isFirstTimeStepsBuffer2;
 			m_isFirstTimeStepsBuffer2 = temp;
-
-			temp = m_gridIndicesBuffer1;
-			m_gridIndicesBuffer1 = m_gridIndicesBuffer2;
-			m_gridIndicesBuffer2 = temp;
 		}
-		delete bucketCountBuffer;
 
 		// Build cell list
-		if (m_cellListBuffer)
-			delete m_cellListBuffer;
-		m_cellListBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_parallelSPHParameters.cellCount * sizeof(unsigned int));
+		// The cell buffers only grow, so they are not reallocated whenever the bounding box changes
+		if (m_parallelSPHParameters.cellCount > m_cellListCapacity)
+		{
+			m_cellListCapacity = std::max(m_parallelSPHParameters.cellCount, 2 * m_cellListCapacity);
+
+			if (m_cellStartsBuffer)
+				delete m_cellStartsBuffer;
+			if (m_cellEndsBuffer)
+				delete m_cellEndsBuffer;
+			m_cellStartsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_cellListCapacity * sizeof(unsigned int));
+			m_cellEndsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, m_cellListCapacity * sizeof(unsigned int));
+		}
+
+		m_parallelComputationInterface->fillBuffer(m_cellStartsBuffer, 0, m_parallelSPHParameters.cellCount * sizeof(unsigned int));
+		m_parallelComputationInterface->fillBuffer(m_cellEndsBuffer, 0, m_parallelSPHParameters.cellCount * sizeof(unsigned int));
 
 		m_buildCellListKernel->setArgument(0, m_gridIndicesBuffer1);
-		m_buildCellListKernel->setArgument(1, sizeof(m_parallelSPHParameters), &m_parallelSPHParameters);
-		m_buildCellListKernel->setArgument(2, m_cellListBuffer);
+		m_buildCellListKernel->setArgument(1, m_parametersBuffer);
+		m_buildCellListKernel->setArgument(2, m_cellStartsBuffer);
+		m_buildCellListKernel->setArgument(3, m_cellEndsBuffer);
 
 		m_parallelComputationInterface->executeKernel(m_buildCellListKernel, m_dummyParticleCount, m_workGroupSize);
 	}
+
+	void SPHSolver::scanParallelBuffer(ParallelBuffer* buffer, unsigned int valueCount, unsigned int level)
+	{
+		unsigned int blockSize = 2 * m_scanWorkGroupSize;
+		unsigned int blockCount = (valueCount + blockSize - 1) / blockSize;
+
+		if (m_scanBlockSumsBuffers.size() <= level)
+			m_scanBlockSumsBuffers.push_back(m_parallelComputationInterface->createBuffer(ParallelBufferType::READ_WRITE, blockCount * sizeof(unsigned int)));
+		ParallelBuffer* blockSumsBuffer = m_scanBlockSumsBuffers[level];
+
+		m_scanBucketsKernel->setArgument(0, buffer);
+		m_scanBucketsKernel->setArgument(1, blockSumsBuffer);
+		m_scanBucketsKernel->setArgument(2, sizeof(valueCount), &valueCount);
+		m_scanBucketsKernel->setArgument(3, blockSize * sizeof(unsigned int), NULL);
+
+		m_parallelComputationInterface->executeKernel(m_scanBucketsKernel, blockCount * m_scanWorkGroupSize, m_scanWorkGroupSize);
+
+		if (blockCount > 1)
+		{
+			// The scanned block sums are the offsets of the blocks
+			scanParallelBuffer(blockSumsBuffer, blockCount, level + 1);
+
+			m_addBlockOffsetsKernel->setArgument(0, buffer);
+			m_addBlockOffsetsKernel->setArgument(1, blockSumsBuffer);
+			m_addBlockOffsetsKernel->setArgument(2, sizeof(valueCount), &valueCount);
+
+			m_parallelComputationInterface->executeKernel(m_addBlockOffsetsKernel, blockCount * m_scanWorkGroupSize, m_scanWorkGroupSize);
+		}
+	}
+	void SPHSolver::uploadParallelParameters()
+	{
+		const ParallelSPHParameters& lastUpload = m_parametersUploads[1 - m_parametersUploadIndex];
+		if (m_hasUploadedParameters && memcmp(&lastUpload, &m_parallelSPHParameters, sizeof(ParallelSPHParameters)) == 0)
+			return;
+
+		int slot = m_parametersUploadIndex;
+		if (m_isParametersUploadPending[slot])
+			m_parametersUploadEvents[slot]->wait();
+
+		// Kernels enqueued before still read the old parameters, the in order queue writes the new ones after them
+		m_parametersUploads[slot] = m_parallelSPHParameters;
+		m_parallelComputationInterface->writeToBuffer(m_parametersBuffer, &m_parametersUploads[slot], sizeof(ParallelSPHParameters), false, 0, m_parametersUploadEvents[slot]);
+		m_isParametersUploadPending[slot] = true;
+		m_parametersUploadIndex = 1 - slot;
+		m_hasUploadedParameters = true;
+	}
+
+	void SPHSolver::reduceParallelBounds()
+	{
+		unsigned int particleCount = m_particleStore.getSize();
+		int slot = m_boundsReadbackIndex;
+
+		m_reduceBoundsKernel->setArgument(0, m_positionsBuffer1);
+		m_reduceBoundsKernel->setArgument(1, m_positionsBuffer1);
+		m_reduceBoundsKernel->setArgument(2, m_minBoundsBuffer);
+		m_reduceBoundsKernel->setArgument(3, m_maxBoundsBuffer);
+		m_reduceBoundsKernel->setArgument(4, sizeof(particleCount), &particleCount);
+		m_reduceBoundsKernel->setArgument(5, m_workGroupSize * sizeof(float4), NULL);
+		m_reduceBoundsKernel->setArgument(6, m_workGroupSize * sizeof(float4), NULL);
+
+		m_parallelComputationInterface->executeKernel(m_reduceBoundsKernel, m_boundsGroupCount * m_workGroupSize, m_workGroupSize);
+
+		// Reduce the results of the work groups in place
+		m_reduceBoundsKernel->setArgument(0, m_minBoundsBuffer);
+		m_reduceBoundsKernel->setArgument(1, m_maxBoundsBuffer);
+		m_reduceBoundsKernel->setArgument(4, sizeof(m_boundsGroupCount), &m_boundsGroupCount);
+
+		m_parallelComputationInterface->executeKernel(m_reduceBoundsKernel, m_workGroupSize, m_workGroupSize);
+
+		m_parallelComputationInterface->readFromBuffer(m_minBoundsBuffer, &m_boundsReadbacks[slot][0], sizeof(float4), false);
+		m_parallelComputationInterface->readFromBuffer(m_maxBoundsBuffer, &m_boundsReadbacks[slot][1], sizeof(float4), false, m_boundsReadbackEvents[slot]);
+
+		m_hasBoundsReadback[slot] = true;
+		m_boundsReadbackIndex = 1 - slot;
+	}
+
+	void SPHSolver::readParticleData()
+	{
+		// particles added after the last upload are not on the device yet
+		int particleCount = m_uploadedParticleCount;
+
+		// read particle data for rendering
+		float4* positionsBuffer = new float4[particleCount];
+		float4* velocitesBuffer = new float4[particleCount];
+		float4* halfVelocitiesBuffer = new float4[particleCount];
+
+		m_parallelComputationInterface->readFromBuffer(m_positionsBuffer1, positionsBuffer, particleCount * sizeof(float4), true);
+		m_parallelComputationInterface->readFromBuffer(m_velocitiesBuffer1, velocitesBuffer, particleCount * sizeof(float4), true);
+		m_parallelComputationInterface->readFromBuffer(m_halfVelocitiesBuffer1, halfVelocitiesBuffer, particleCount * sizeof(float4), true);
+		m_parallelComputationInterface->readFromBuffer(m_isFirstTimeStepsBuffer1, m_particleStore.getIsFirstTimeSteps().data(), particleCount * sizeof(unsigned int), true);
+		m_parallelComputationInterface->waitUntilFinished();
+
+		std::vector<Vector3D>& positions = m_particleStore.getPositions();
+		std::vector<Vector3D>& velocities = m_particleStore.getVelocities();
+		std::vector<Vector3D>& halfVelocities = m_particleStore.getHalfVelocities();
+		for (int i = 0; i < particleCount; i++)
+		{
+			float4 position = positionsBuffer[i];
+			float4 velocity = velocitesBuffer[i];
+			float4 halfVelocity = halfVelocitiesBuffer[i];
+			positions[i] = Vector3D(position.x, position.y, position.z);
+			velocities[i] = Vector3D(velocity.x, velocity.y, velocity.z);
+			halfVelocities[i] = Vector3D(halfVelocity.x, halfVelocity.y, halfVelocity.z);
+		}
+
+		delete[] positionsBuffer;
+		delete[] velocitesBuffer;
+		delete[] halfVelocitiesBuffer;
+	}
+
+	void SPHSolver::readParticleDataAsync()
+	{
+		ParallelParticleReadback& readback = m_particleReadbacks[m_particleReadbackIndex];
+		int particleCount = m_uploadedParticleCount;
+
+		if (readback.capacity < particleCount)
+		{
+			int capacity = std::max(particleCount, 2 * readback.capacity);
+			releaseParticleReadback(readback);
+
+			readback.positionsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::HOST_PINNED, capacity * sizeof(float4));
+			readback.velocitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::HOST_PINNED, capacity * sizeof(float4));
+			readback.halfVelocitiesBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::HOST_PINNED, capacity * sizeof(float4));
+			readback.isFirstTimeStepsBuffer = m_parallelComputationInterface->createBuffer(ParallelBufferType::HOST_PINNED, capacity * sizeof(unsigned int));
+			readback.positions = (float4*)m_parallelComputationInterface->mapBuffer(readback.positionsBuffer, capacity * sizeof(float4));
+			readback.velocities = (float4*)m_parallelComputationInterface->mapBuffer(readback.velocitiesBuffer, capacity * sizeof(float4));
+			readback.halfVelocities = (float4*)m_parallelComputationInterface->mapBuffer(readback.halfVelocitiesBuffer, capacity * sizeof(float4));
+			readback.isFirstTimeSteps = (unsigned int*)m_parallelComputationInterface->mapBuffer(readback.isFirstTimeStepsBuffer, capacity * sizeof(unsigned int));
+			readback.capacity = capacity;
+			if (!readback.completionEvent)
+				readback.completionEvent = m_parallelComputationInterface->createEvent();
+		}
+
+		// The readback runs on the transfer queue once the step has been computed, concurrently to the next step
+		m_parallelComputationInterface->enqueueMarker(m_computeMarkerEvent);
+		ParallelEvents waitEvents = { m_computeMarkerEvent };
+		m_parallelComputationInterface->readFromBuffer(m_positionsBuffer1, readback.positions, particleCount * sizeof(float4), false, NULL, waitEvents, ParallelQueueType::TRANSFER);
+		m_parallelComputationInterface->readFromBuffer(m_velocitiesBuffer1, readback.velocities, particleCount * sizeof(float4), false, NULL, waitEvents, ParallelQueueType::TRANSFER);
+		m_parallelComputationInterface->readFromBuffer(m_halfVelocitiesBuffer1, readback.halfVelocities, particleCount * sizeof(float4), false, NULL, waitEvents, ParallelQueueType::TRANSFER);
+		m_parallelComputationInterface->readFromBuffer(m_isFirstTimeStepsBuffer1, readback.isFirstTimeSteps, particleCount * sizeof(unsigned int), false, NULL, waitEvents, ParallelQueueType::TRANSFER);
+		m_parallelComputationInterface->enqueueMarker(readback.completionEvent, ParallelQueueType::TRANSFER);
+		m_parallelComputationInterface->flush();
+		readback.particleCount = particleCount;
+		readback.isPending = true;
+		m_pendingReadbackEvent = readback.completionEvent;
+
+		// The previous readback had the time of a whole readback interval to complete, so it is handed to the particles now
+		m_particleReadbackIndex = 1 - m_particleReadbackIndex;
+		if (m_particleReadbacks[m_particleReadbackIndex].isPending)
+			applyParticleReadback(m_particleReadbacks[m_particleReadbackIndex]);
+	}
+
+	void SPHSolver::applyParticleReadback(ParallelParticleReadback& readback)
+	{
+		readback.completionEvent->wait();
+		readback.isPending = false;
+
+		std::vector<Vector3D>& positions = m_particleStore.getPositions();
+		std::vector<Vector3D>& velocities = m_particleStore.getVelocities();
+		std::vector<Vector3D>& halfVelocities = m_particleStore.getHalfVelocities();
+		std::vector<unsigned int>& isFirstTimeSteps = m_particleStore.getIsFirstTimeSteps();
+		int particleCount = std::min(readback.particleCount, m_particleStore.getSize());
+		for (int i = 0; i < particleCount; i++)
+		{
+			float4 position = readback.positions[i];
+			float4 velocity = readback.velocities[i];
+			float4 halfVelocity = readback.halfVelocities[i];
+			positions[i] = Vector3D(position.x, position.y, position.z);
+			velocities[i] = Vector3D(velocity.x, velocity.y, velocity.z);
+			halfVelocities[i] = Vector3D(halfVelocity.x, halfVelocity.y, halfVelocity.z);
+			isFirstTimeSteps[i] = readback.isFirstTimeSteps[i];
+		}
+	}
+
+	void SPHSolver::releaseParticleReadback(ParallelParticleReadback& readback)
+	{
+		// the device may still write into the mapped memory
+		if (readback.isPending)
+			readback.completionEvent->wait();
+
+		if (readback.positionsBuffer)
+		{
+			m_parallelComputationInterface->unmapBuffer(readback.positionsBuffer, readback.positions);
+			m_parallelComputationInterface->unmapBuffer(readback.velocitiesBuffer, readback.velocities);
+			m_parallelComputationInterface->unmapBuffer(readback.halfVelocitiesBuffer, readback.halfVelocities);
+			m_parallelComputationInterface->unmapBuffer(readback.isFirstTimeStepsBuffer, readback.isFirstTimeSteps);
+			delete readback.positionsBuffer;
+			delete readback.velocitiesBuffer;
+			delete readback.halfVelocitiesBuffer;
+			delete readback.isFirstTimeStepsBuffer;
+		}
+
+		readback.positionsBuffer = NULL;
+		readback.velocitiesBuffer = NULL;
+		readback.halfVelocitiesBuffer = NULL;
+		readback.isFirstTimeStepsBuffer = NULL;
+		readback.capacity = 0;
+		readback.isPending = false;
+	}
+
+	void SPHSolver::releaseParticleReadbacks()
+	{
+		for (ParallelParticleReadback& readback : m_particleReadbacks)
+		{
+			releaseParticleReadback(readback);
+			delete readback.completionEvent;
+			readback.completionEvent = NULL;
+		}
+	}
+
+	void SPHSolver::releaseGraphicsBuffers()
+	{
+		if (m_sharedTranslationsBuffer)
+			delete m_sharedTranslationsBuffer;
+		if (m_sharedColorsBuffer)
+			delete m_sharedColorsBuffer;
+		m_sharedTranslationsBuffer = NULL;
+		m_sharedColorsBuffer = NULL;
+		m_sharedTranslationsGraphicsBuffer = 0;
+		m_sharedColorsGraphicsBuffer = 0;
+	}
 }
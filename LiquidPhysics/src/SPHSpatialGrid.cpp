@@ -1,14 +1,41 @@
 #include "SPHSpatialGrid.h"
 
+#include <algorithm>
+#include <math.h>
+#include "float.h"
+
 namespace LiPhEn {
+	float SPHSpatialGridStatistics::getBucketOccupancy() const
+	{
+		if (bucketCount == 0)
+			return 0.f;
+		return (float)occupiedBucketCount / (float)bucketCount;
+	}
+
+	float SPHSpatialGridStatistics::getFalsePositiveRate() const
+	{
+		if (visitedEntryCount == 0)
+			return 0.f;
+		return (float)((double)falsePositiveCount / (double)visitedEntryCount);
+	}
+
 	SPHSpatialGrid::SPHSpatialGrid() :
 		SPHSpatialGrid(0.1f)
 	{
 	}
 
 	SPHSpatialGrid::SPHSpatialGrid(float gridSize) :
-		m_gridSpacing(gridSize)
+		m_type(SPHSpatialGridType::AUTOMATIC),
+		m_isHashed(false),
+		m_cellCount(0),
+		m_gridSpacing(gridSize),
+		m_occupiedBucketCount(0),
+		m_maxBucketLoad(0),
+		m_visitedEntryCount(0),
+		m_falsePositiveCount(0)
 	{
+		m_gridOffset[0] = m_gridOffset[1] = m_gridOffset[2] = 0.f;
+		m_gridSize[0] = m_gridSize[1] = m_gridSize[2] = 0;
 	}
 
 
@@ -16,77 +43,309 @@ namespace LiPhEn {
 	{
 	}
 
-	void SPHSpatialGrid::build(std::vector<SPHParticle*> particles)
+	void SPHSpatialGrid::build(const std::vector<Vector3D>& positions)
 	{
-		for (SPHParticle* particle : particles)
+		int particleCount = positions.size();
+
+		float minPosition[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+		float maxPosition[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+		for (int i = 0; i < particleCount; i++)
 		{
-			int hashValue = calcHashValue(particle);
+			const Vector3D& position = positions[i];
+			float coordinates[3] = { position.getX(), position.getY(), position.getZ() };
+			for (int axis = 0; axis < 3; axis++)
+			{
+				minPosition[axis] = std::min(minPosition[axis], coordinates[axis]);
+				maxPosition[axis] = std::max(maxPosition[axis], coordinates[axis]);
+			}
+		}
 
-			// if no element with the hashValue exists, it inserts a new element and calls the constructor of the value m_type (std::vector<SPHParticle*>)
-			m_hashedGrid[hashValue].push_back(particle);
+		if (particleCount == 0)
+		{
+			for (int axis = 0; axis < 3; axis++)
+				minPosition[axis] = maxPosition[axis] = 0.f;
+		}
+
+		m_isHashed = m_type == SPHSpatialGridType::HASHED;
+		if (m_type == SPHSpatialGridType::AUTOMATIC)
+		{
+			// Sparse or widely spread particles would leave most cells of a dense grid empty
+			double denseCellCount = 1.0;
+			for (int axis = 0; axis < 3; axis++)
+				denseCellCount *= floor((maxPosition[axis] - minPosition[axis]) / m_gridSpacing) + 1.0;
+			m_isHashed = denseCellCount > (double)s_maxDenseCellsPerParticle * std::max(particleCount, 1);
+		}
+
+		if (m_isHashed)
+			buildHashed(positions);
+		else
+			buildDense(positions, minPosition, maxPosition);
+
+		// Bucket statistics
+		m_occupiedBucketCount = 0;
+		m_maxBucketLoad = 0;
+		for (int cellIndex = 0; cellIndex < m_cellCount; cellIndex++)
+		{
+			int bucketLoad = m_cellStarts[cellIndex + 1] - m_cellStarts[cellIndex];
+			if (bucketLoad > 0)
+				m_occupiedBucketCount++;
+			m_maxBucketLoad = std::max(m_maxBucketLoad, bucketLoad);
 		}
 	}
 
-	void SPHSpatialGrid::clear()
+	void SPHSpatialGrid::buildDense(const std::vector<Vector3D>& positions, float minPosition[3], float maxPosition[3])
 	{
-		for (std::pair<int, std::vector<SPHParticle*>> gridElement : m_hashedGrid)
+		int particleCount = positions.size();
+
+		m_cellCount = 1;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			m_gridOffset[axis] = -minPosition[axis];
+			m_gridSize[axis] = (int)((maxPosition[axis] - minPosition[axis]) / m_gridSpacing) + 1;
+			m_cellCount *= m_gridSize[axis];
+		}
+
+		// Count particles per cell
+		m_cellStarts.assign(m_cellCount + 1, 0);
+		m_particleCellIndices.resize(particleCount);
+		for (int i = 0; i < particleCount; i++)
 		{
-			gridElement.second.clear();
+			const Vector3D& position = positions[i];
+			int cellIndex = calcCellIndex(calcCellCoordinate(position.getX(), m_gridOffset[0], m_gridSize[0]),
+										  calcCellCoordinate(position.getY(), m_gridOffset[1], m_gridSize[1]),
+										  calcCellCoordinate(position.getZ(), m_gridOffset[2], m_gridSize[2]));
+			m_particleCellIndices[i] = cellIndex;
+			m_cellStarts[cellIndex + 1]++;
+		}
+
+		// Scan counts into cell starts
+		for (int cellIndex = 0; cellIndex < m_cellCount; cellIndex++)
+		{
+			m_cellStarts[cellIndex + 1] += m_cellStarts[cellIndex];
+		}
+
+		// Scatter particles into their cells
+		m_cellCursors.assign(m_cellStarts.begin(), m_cellStarts.end() - 1);
+		m_sortedParticleIndices.resize(particleCount);
+		m_sortedPositions.resize(particleCount);
+		m_sortedCellCoordinates.clear();
+		for (int i = 0; i < particleCount; i++)
+		{
+			int sortedIndex = m_cellCursors[m_particleCellIndices[i]]++;
+			m_sortedParticleIndices[sortedIndex] = i;
+			m_sortedPositions[sortedIndex] = positions[i];
 		}
-		m_hashedGrid.clear();
 	}
 
-	std::vector<SPHParticle*> SPHSpatialGrid::findNeighborParticles(SPHParticle* particle, float searchRadius)
+	void SPHSpatialGrid::buildHashed(const std::vector<Vector3D>& positions)
 	{
-		std::vector<SPHParticle*> neighborParticles;
-		std::vector<SPHParticle*> potentialNeighborParticles;
-		
-		int iMin = (int)((particle->getPosition().getX() - searchRadius) / m_gridSpacing);
-		int iMax = (int)((particle->getPosition().getX() + searchRadius) / m_gridSpacing);
-		int jMin = (int)((particle->getPosition().getY() - searchRadius) / m_gridSpacing);
-		int jMax = (int)((particle->getPosition().getY() + searchRadius) / m_gridSpacing);
-		int kMin = (int)((particle->getPosition().getZ() - searchRadius) / m_gridSpacing);
-		int kMax = (int)((particle->getPosition().getZ() + searchRadius) / m_gridSpacing);
+		int particleCount = positions.size();
+
+		// Power of two table with about two buckets per particle keeps the load factor at or below 0.5
+		m_cellCount = 1;
+		while (m_cellCount < 2 * particleCount)
+			m_cellCount <<= 1;
+
+		// Count particles per bucket
+		m_cellStarts.assign(m_cellCount + 1, 0);
+		m_particleCellIndices.resize(particleCount);
+		m_sortedCellCoordinates.resize(3 * particleCount);
+		for (int i = 0; i < particleCount; i++)
+		{
+			const Vector3D& position = positions[i];
+			int bucketIndex = calcHashValue(calcUnboundedCellCoordinate(position.getX()),
+											calcUnboundedCellCoordinate(position.getY()),
+											calcUnboundedCellCoordinate(position.getZ()));
+			m_particleCellIndices[i] = bucketIndex;
+			m_cellStarts[bucketIndex + 1]++;
+		}
+
+		// Scan counts into bucket starts
+		for (int bucketIndex = 0; bucketIndex < m_cellCount; bucketIndex++)
+		{
+			m_cellStarts[bucketIndex + 1] += m_cellStarts[bucketIndex];
+		}
 
-		for (int i = iMin; i <= iMax; i++)
+		// Scatter particles into their buckets together with their cell coordinates
+		m_cellCursors.assign(m_cellStarts.begin(), m_cellStarts.end() - 1);
+		m_sortedParticleIndices.resize(particleCount);
+		m_sortedPositions.resize(particleCount);
+		for (int i = 0; i < particleCount; i++)
+		{
+			const Vector3D& position = positions[i];
+			int sortedIndex = m_cellCursors[m_particleCellIndices[i]]++;
+			m_sortedParticleIndices[sortedIndex] = i;
+			m_sortedPositions[sortedIndex] = position;
+			m_sortedCellCoordinates[3 * sortedIndex + 0] = calcUnboundedCellCoordinate(position.getX());
+			m_sortedCellCoordinates[3 * sortedIndex + 1] = calcUnboundedCellCoordinate(position.getY());
+			m_sortedCellCoordinates[3 * sortedIndex + 2] = calcUnboundedCellCoordinate(position.getZ());
+		}
+	}
+
+	void SPHSpatialGrid::clear()
+	{
+		m_cellStarts.clear();
+		m_cellCursors.clear();
+		m_particleCellIndices.clear();
+		m_sortedParticleIndices.clear();
+		m_sortedPositions.clear();
+		m_sortedCellCoordinates.clear();
+		m_cellCount = 0;
+		m_occupiedBucketCount = 0;
+		m_maxBucketLoad = 0;
+	}
+
+	void SPHSpatialGrid::findNeighborParticles(const Vector3D& position, float searchRadius, std::vector<int>& neighborIndices, SPHSpatialGridQueryCounts& queryCounts) const
+	{
+		neighborIndices.clear();
+
+		if (m_cellCount == 0)
+			return;
+
+		if (m_isHashed)
+			findNeighborParticlesHashed(position, searchRadius, neighborIndices, queryCounts);
+		else
+			findNeighborParticlesDense(position, searchRadius, neighborIndices);
+	}
+
+	void SPHSpatialGrid::findNeighborParticlesDense(const Vector3D& position, float searchRadius, std::vector<int>& neighborIndices) const
+	{
+		int iMin = calcCellCoordinate(position.getX() - searchRadius, m_gridOffset[0], m_gridSize[0]);
+		int iMax = calcCellCoordinate(position.getX() + searchRadius, m_gridOffset[0], m_gridSize[0]);
+		int jMin = calcCellCoordinate(position.getY() - searchRadius, m_gridOffset[1], m_gridSize[1]);
+		int jMax = calcCellCoordinate(position.getY() + searchRadius, m_gridOffset[1], m_gridSize[1]);
+		int kMin = calcCellCoordinate(position.getZ() - searchRadius, m_gridOffset[2], m_gridSize[2]);
+		int kMax = calcCellCoordinate(position.getZ() + searchRadius, m_gridOffset[2], m_gridSize[2]);
+
+		float searchRadius2 = searchRadius * searchRadius;
+
+		for (int k = kMin; k <= kMax; k++)
 		{
 			for (int j = jMin; j <= jMax; j++)
 			{
-				for (int k = kMin; k <= kMax; k++)
+				// The cells of one row along the x axis are stored consecutively
+				int sortedStart = m_cellStarts[calcCellIndex(iMin, j, k)];
+				int sortedEnd = m_cellStarts[calcCellIndex(iMax, j, k) + 1];
+				for (int sortedIndex = sortedStart; sortedIndex < sortedEnd; sortedIndex++)
 				{
-					int hashValue = calcHashValue(i, j, k);
-					if (m_hashedGrid.find(hashValue) != m_hashedGrid.end())
+					if ((position - m_sortedPositions[sortedIndex]).squareMagnitude() <= searchRadius2)
 					{
-						std::vector<SPHParticle*> gridParticles = m_hashedGrid[hashValue];
-						potentialNeighborParticles.insert(potentialNeighborParticles.end(), gridParticles.begin(), gridParticles.end());
+						neighborIndices.push_back(m_sortedParticleIndices[sortedIndex]);
 					}
 				}
 			}
 		}
+	}
 
-		for (SPHParticle* potentialNeighborParticle : potentialNeighborParticles)
+	void SPHSpatialGrid::findNeighborParticlesHashed(const Vector3D& position, float searchRadius, std::vector<int>& neighborIndices, SPHSpatialGridQueryCounts& queryCounts) const
+	{
+		int iMin = calcUnboundedCellCoordinate(position.getX() - searchRadius);
+		int iMax = calcUnboundedCellCoordinate(position.getX() + searchRadius);
+		int jMin = calcUnboundedCellCoordinate(position.getY() - searchRadius);
+		int jMax = calcUnboundedCellCoordinate(position.getY() + searchRadius);
+		int kMin = calcUnboundedCellCoordinate(position.getZ() - searchRadius);
+		int kMax = calcUnboundedCellCoordinate(position.getZ() + searchRadius);
+
+		float searchRadius2 = searchRadius * searchRadius;
+		long long visitedEntryCount = 0;
+		long long falsePositiveCount = 0;
+
+		for (int k = kMin; k <= kMax; k++)
 		{
-			if ((particle->getPosition() - potentialNeighborParticle->getPosition()).squareMagnitude() <= searchRadius * searchRadius)
+			for (int j = jMin; j <= jMax; j++)
 			{
-				neighborParticles.push_back(potentialNeighborParticle);
+				for (int i = iMin; i <= iMax; i++)
+				{
+					int bucketIndex = calcHashValue(i, j, k);
+					int sortedStart = m_cellStarts[bucketIndex];
+					int sortedEnd = m_cellStarts[bucketIndex + 1];
+					visitedEntryCount += sortedEnd - sortedStart;
+					for (int sortedIndex = sortedStart; sortedIndex < sortedEnd; sortedIndex++)
+					{
+						// Entries of other cells that hash into the same bucket are skipped without a distance test
+						const int* cellCoordinates = &m_sortedCellCoordinates[3 * sortedIndex];
+						if (cellCoordinates[0] != i || cellCoordinates[1] != j || cellCoordinates[2] != k)
+						{
+							falsePositiveCount++;
+							continue;
+						}
+
+						if ((position - m_sortedPositions[sortedIndex]).squareMagnitude() <= searchRadius2)
+						{
+							neighborIndices.push_back(m_sortedParticleIndices[sortedIndex]);
+						}
+					}
+				}
 			}
 		}
 
-		return neighborParticles;
+		queryCounts.visitedEntryCount += visitedEntryCount;
+		queryCounts.falsePositiveCount += falsePositiveCount;
+	}
+
+	void SPHSpatialGrid::addQueryCounts(const SPHSpatialGridQueryCounts& queryCounts)
+	{
+		m_visitedEntryCount += queryCounts.visitedEntryCount;
+		m_falsePositiveCount += queryCounts.falsePositiveCount;
+	}
+
+	void SPHSpatialGrid::resetStatistics()
+	{
+		m_visitedEntryCount = 0;
+		m_falsePositiveCount = 0;
+	}
+
+	int SPHSpatialGrid::calcCellCoordinate(float position, float gridOffset, int gridSize) const
+	{
+		// Clamping keeps the query box inside the grid, every particle lies inside it anyway
+		float coordinate = floorf((position + gridOffset) / m_gridSpacing);
+		if (coordinate < 0.f)
+			return 0;
+		if (coordinate >= gridSize)
+			return gridSize - 1;
+		return (int)coordinate;
+	}
+
+	int SPHSpatialGrid::calcCellIndex(int i, int j, int k) const
+	{
+		return i + m_gridSize[0] * (j + m_gridSize[1] * k);
+	}
+
+	int SPHSpatialGrid::calcUnboundedCellCoordinate(float position) const
+	{
+		return (int)floorf(position / m_gridSpacing);
+	}
+
+	int SPHSpatialGrid::calcHashValue(int i, int j, int k) const
+	{
+		unsigned int hashValue = ((unsigned int)i * 73856093u) ^ ((unsigned int)j * 19349663u) ^ ((unsigned int)k * 83492791u);
+		return (int)(hashValue & (unsigned int)(m_cellCount - 1));
+	}
+
+	SPHSpatialGridType SPHSpatialGrid::getType() const
+	{
+		return m_type;
+	}
+
+	bool SPHSpatialGrid::isHashed() const
+	{
+		return m_isHashed;
+	}
+
+	int SPHSpatialGrid::getCellCount() const
+	{
+		return m_cellCount;
 	}
 
-	int SPHSpatialGrid::calcHashValue(SPHParticle* particle)
+	const std::vector<int>& SPHSpatialGrid::getCellStarts() const
 	{
-		int i = (int)(particle->getPosition().getX() / m_gridSpacing);
-		int j = (int)(particle->getPosition().getY() / m_gridSpacing);
-		int k = (int)(particle->getPosition().getZ() / m_gridSpacing);
-		
-		return calcHashValue(i, j, k);
+		return m_cellStarts;
 	}
 
-	int SPHSpatialGrid::calcHashValue(int i, int j, int k)
+	const std::vector<int>& SPHSpatialGrid::getSortedParticleIndices() const
 	{
-		return 541 * i + 79 * j + 31 * k;
+		return m_sortedParticleIndices;
 	}
 
 	float SPHSpatialGrid::getGridSpacing() const
@@ -94,8 +353,24 @@ namespace LiPhEn {
 		return m_gridSpacing;
 	}
 
+	SPHSpatialGridStatistics SPHSpatialGrid::getStatistics() const
+	{
+		SPHSpatialGridStatistics statistics;
+		statistics.bucketCount = m_cellCount;
+		statistics.occupiedBucketCount = m_occupiedBucketCount;
+		statistics.maxBucketLoad = m_maxBucketLoad;
+		statistics.visitedEntryCount = m_visitedEntryCount;
+		statistics.falsePositiveCount = m_falsePositiveCount;
+		return statistics;
+	}
+
+	void SPHSpatialGrid::setType(SPHSpatialGridType type)
+	{
+		m_type = type;
+	}
+
 	void SPHSpatialGrid::setGridSpacing(float gridSpacing)
 	{
 		m_gridSpacing = gridSpacing;
 	}
-}
\ No newline at end of file
+}
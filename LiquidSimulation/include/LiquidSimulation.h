@@ -3,6 +3,7 @@
 
 #include <QElapsedTimer>
 #include <QTimer>
+#include <QCheckBox>
 #include "Rendering/OpenGLWidget.h"
 #include "SPHLiquidWorld.h"
 #include "Scenarios/WaveBreakerScenario.h"
@@ -13,7 +14,8 @@
 
 enum class SimulationMethod {
 	SPH,
-	PCISPH
+	PCISPH,
+	DFSPH
 };
 
 class LiquidSimulation : public QObject
@@ -35,6 +37,7 @@ private slots:
 	void changeParallelization(int index);
 	void changeSimulationMethod(int index);
     void setTimeStep(int sliderValue);
+    void setAdaptiveTimeStepping(bool isAdaptive);
     void setXGravity(int sliderValue);
     void setYGravity(int sliderValue);
     void setZGravity(int sliderValue);
@@ -69,6 +72,7 @@ private:
 	SimulationMethod m_currentSimulationMethod;
 	SPHSolver* m_sphSolver;
 	PCISPHSolver* m_pcisphSolver;
+	DFSPHSolver* m_dfsphSolver;
     SPHLiquidWorld* m_sphLiquidWorld;
 
     bool m_isSimulationStarted;
@@ -89,6 +93,7 @@ private:
     QSlider* m_timeStepSlider;
     float m_timeStepSliderStep;
     int m_timeStepMinMaxDefault[3];
+    QCheckBox* m_adaptiveTimeStepCheckBox;
 
     QLabel* m_gravityLabel;
     QSlider* m_xGravitySlider;
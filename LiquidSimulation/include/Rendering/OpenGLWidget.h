@@ -21,6 +21,18 @@ struct InstancedDrawable
     QColor color;
 };
 
+// Writes the translations and colors of all instances directly into the instance buffers
+class InstanceDataWriter
+{
+public:
+    virtual ~InstanceDataWriter() {}
+
+    // False if writeInstanceData will not touch the buffers, OpenGL only has to be synchronized before writes
+    virtual bool isWritingInstanceData() const = 0;
+    // Returns the number of written instances, -1 if the instance data has to be taken from the instanced drawables
+    virtual int writeInstanceData(GLuint translationBuffer, GLuint colorBuffer, int instanceCapacity, bool haveBuffersChanged) = 0;
+};
+
 struct Drawable
 {
     Mesh* mesh;
@@ -41,6 +53,8 @@ public:
     void addDrawable(Drawable* drawable);
     void cleanUp();
 
+    void setInstanceDataWriter(InstanceDataWriter* instanceDataWriter);
+
 protected:
     void initializeGL();
     void resizeGL(int width, int height);
@@ -60,6 +74,10 @@ private:
     QOpenGLShaderProgram* m_instancedShaderProgram;
     GLuint m_instancedViewMatrixUniform;
     GLuint m_instancedProjectionMatrixUniform;
+    // The instance buffers are only reallocated if the number of instances changed
+    int m_instanceCapacity;
+    bool m_haveInstanceBuffersChanged;
+    InstanceDataWriter* m_instanceDataWriter;
 
     QOpenGLVertexArrayObject m_vao;
     QOpenGLBuffer m_meshBuffer;
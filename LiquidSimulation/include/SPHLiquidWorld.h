@@ -4,9 +4,11 @@
 #include "SPHParticleDrawable.h"
 #include "StaticCollisionObjectDrawable.h"
 #include <PCISPHSolver.h>
+#include <DFSPHSolver.h>
 #include <Collision/StaticCollisionBox.h>
 
-class SPHLiquidWorld
+// Particles computed on a device that shares buffers with OpenGL are rendered directly from the device data
+class SPHLiquidWorld : public InstanceDataWriter
 {
 public:
     SPHLiquidWorld(SPHSolver* sphSolver, OpenGLWidget* root);
@@ -14,14 +16,21 @@ public:
     void addSPHParticleDrawable(SPHParticleDrawable* particleDrawable);
     void addStaticCollisionObjectDrawable(StaticCollisionObjectDrawable* collisionObjectDrawable);
     void update(float deltaTime);
+    // Covers frameTime with as many time steps as the solver's stability bound requires
+    void advance(float frameTime);
     void cleanUp();
 
+    bool isWritingInstanceData() const override;
+    int writeInstanceData(GLuint translationBuffer, GLuint colorBuffer, int instanceCapacity, bool haveBuffersChanged) override;
+
     SPHSolver* getSPHSolver();
     OpenGLWidget* getRoot();
 
 	void setSPHSolver(SPHSolver* solver);
 
 private:
+    void updateDrawables();
+
     SPHSolver* m_sphSolver;
     OpenGLWidget* m_root;
 
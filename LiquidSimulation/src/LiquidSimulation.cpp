@@ -114,6 +114,7 @@ void LiquidSimulation::initializeSimulation()
 	m_currentSimulationMethod = SimulationMethod::SPH;
 	m_sphSolver = new SPHSolver();
 	m_pcisphSolver = NULL;
+	m_dfsphSolver = NULL;
 
     m_sphLiquidWorld = new SPHLiquidWorld(m_sphSolver, m_graphicsWidget);
 
@@ -176,7 +177,13 @@ void LiquidSimulation::stepSimulation()
 {
     m_currentScenario->updateScenario(m_simulationTimeStep);
 	if(m_sphLiquidWorld->getSPHSolver()->getParticleCount() >= 512)
-		m_sphLiquidWorld->update(m_simulationTimeStep);
+	{
+		// The time step slider sets the frame time, the solver picks its own steps within it
+		if(m_adaptiveTimeStepCheckBox->isChecked())
+			m_sphLiquidWorld->advance(m_simulationTimeStep);
+		else
+			m_sphLiquidWorld->update(m_simulationTimeStep);
+	}
     m_simulatedTime += m_simulationTimeStep;
 }
 
@@ -201,6 +208,11 @@ void LiquidSimulation::changeSimulationMethod(int index)
 		delete m_pcisphSolver;
 		m_pcisphSolver = NULL;
 	}
+	if (m_dfsphSolver)
+	{
+		delete m_dfsphSolver;
+		m_dfsphSolver = NULL;
+	}
 
 	switch (index)
 	{
@@ -216,10 +228,17 @@ void LiquidSimulation::changeSimulationMethod(int index)
 		m_pcisphSolver = new PCISPHSolver();
 		m_sphLiquidWorld->setSPHSolver(m_pcisphSolver);
 		break;
+
+	case 2:
+		m_currentSimulationMethod = SimulationMethod::DFSPH;
+		m_dfsphSolver = new DFSPHSolver();
+		m_sphLiquidWorld->setSPHSolver(m_dfsphSolver);
+		break;
 	}
 
 	// Set parameters of solver
 	m_sphLiquidWorld->getSPHSolver()->setParallelizationType(oldParallelType);
+	m_sphLiquidWorld->getSPHSolver()->setAdaptiveTimeStepping(m_adaptiveTimeStepCheckBox->isChecked());
 
 	float xGravity = m_xGravitySliderStep * m_xGravitySlider->value();
 	float yGravity = m_yGravitySliderStep * m_yGravitySlider->value();
@@ -246,31 +265,8 @@ void LiquidSimulation::changeSimulationMethod(int index)
 
 void LiquidSimulation::changeParallelization(int index)
 {
-    if (m_sphLiquidWorld->getSPHSolver()->hasGPU() && m_sphLiquidWorld->getSPHSolver()->hasCPU())
-    {
-        if(index == 0)
-            m_sphLiquidWorld->getSPHSolver()->setParallelizationType(ParallelizationType::GPU);
-        else if (index == 1)
-            m_sphLiquidWorld->getSPHSolver()->setParallelizationType(ParallelizationType::CPU);
-        else
-            m_sphLiquidWorld->getSPHSolver()->setParallelizationType(ParallelizationType::NONE);
-    }
-    else if (m_sphLiquidWorld->getSPHSolver()->hasGPU())
-    {
-        if (index == 0)
-            m_sphLiquidWorld->getSPHSolver()->setParallelizationType(ParallelizationType::GPU);
-        else
-            m_sphLiquidWorld->getSPHSolver()->setParallelizationType(ParallelizationType::NONE);
-    }
-    else if (m_sphLiquidWorld->getSPHSolver()->hasCPU())
-    {
-        if (index == 0)
-            m_sphLiquidWorld->getSPHSolver()->setParallelizationType(ParallelizationType::CPU);
-        else
-            m_sphLiquidWorld->getSPHSolver()->setParallelizationType(ParallelizationType::NONE);
-    }
-    else
-        m_sphLiquidWorld->getSPHSolver()->setParallelizationType(ParallelizationType::NONE);
+    ParallelizationType parallelizationType = (ParallelizationType)m_parallelizationSelection->itemData(index).toInt();
+    m_sphLiquidWorld->getSPHSolver()->setParallelizationType(parallelizationType);
 }
 
 void LiquidSimulation::setTimeStep(int sliderValue)
@@ -279,6 +275,11 @@ void LiquidSimulation::setTimeStep(int sliderValue)
     m_timeStepLabel->setText(QString().setNum(m_simulationTimeStep, 'g', 6) + " s");
 }
 
+void LiquidSimulation::setAdaptiveTimeStepping(bool isAdaptive)
+{
+    m_sphLiquidWorld->getSPHSolver()->setAdaptiveTimeStepping(isAdaptive);
+}
+
 void LiquidSimulation::setXGravity(int sliderValue)
 {
     float xGravity = m_xGravitySliderStep * sliderValue;
@@ -456,10 +457,11 @@ void LiquidSimulation::buildControlWidget(QWidget* parent)
 	simulationControlsLayout->addWidget(parallelizationSelectionLabel);
 	m_parallelizationSelection = new QComboBox();
     if(m_sphLiquidWorld->getSPHSolver()->hasGPU())
-	    m_parallelizationSelection->addItem("GPU");
+	    m_parallelizationSelection->addItem("GPU", (int)ParallelizationType::GPU);
     if (m_sphLiquidWorld->getSPHSolver()->hasCPU())
-	    m_parallelizationSelection->addItem("CPU");
-	m_parallelizationSelection->addItem("NONE");
+	    m_parallelizationSelection->addItem("CPU", (int)ParallelizationType::CPU);
+	m_parallelizationSelection->addItem("THREADS", (int)ParallelizationType::THREADS);
+	m_parallelizationSelection->addItem("NONE", (int)ParallelizationType::NONE);
 	simulationControlsLayout->addWidget(m_parallelizationSelection);
 	connect(m_parallelizationSelection, QOverload<int>::of(&QComboBox::currentIndexChanged), [=](int index) { this->changeParallelization(index); });
 
@@ -469,6 +471,7 @@ void LiquidSimulation::buildControlWidget(QWidget* parent)
 	m_simulationMethodSelection = new QComboBox();
 	m_simulationMethodSelection->addItem("SPH");
 	m_simulationMethodSelection->addItem("PCISPH");
+	m_simulationMethodSelection->addItem("DFSPH");
 	simulationControlsLayout->addWidget(m_simulationMethodSelection);
 	connect(m_simulationMethodSelection, QOverload<int>::of(&QComboBox::currentIndexChanged), [=](int index) { this->changeSimulationMethod(index); });
 
@@ -486,6 +489,10 @@ void LiquidSimulation::buildControlWidget(QWidget* parent)
     simulationControlsLayout->addWidget(m_timeStepSlider);
     connect(m_timeStepSlider, &QSlider::valueChanged, this, &LiquidSimulation::setTimeStep);
 
+    m_adaptiveTimeStepCheckBox = new QCheckBox("Adaptive Time Steps");
+    simulationControlsLayout->addWidget(m_adaptiveTimeStepCheckBox);
+    connect(m_adaptiveTimeStepCheckBox, &QCheckBox::toggled, this, &LiquidSimulation::setAdaptiveTimeStepping);
+
     // Gravity
     QHBoxLayout* gravityLayout = new QHBoxLayout();
     simulationControlsLayout->addLayout(gravityLayout);
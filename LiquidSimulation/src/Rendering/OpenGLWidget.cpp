@@ -5,6 +5,9 @@ Mesh* InstancedDrawable::mesh;
 OpenGLWidget::OpenGLWidget(QWidget *parent) :
     QOpenGLWidget(parent),
     m_instancedShaderProgram(NULL),
+    m_instanceCapacity(0),
+    m_haveInstanceBuffersChanged(false),
+    m_instanceDataWriter(NULL),
     m_shaderProgram(NULL),
     m_camera(new Camera3D())
 {
@@ -60,6 +63,11 @@ void OpenGLWidget::cleanUp()
     }
 }
 
+void OpenGLWidget::setInstanceDataWriter(InstanceDataWriter* instanceDataWriter)
+{
+    m_instanceDataWriter = instanceDataWriter;
+}
+
 void OpenGLWidget::initializeGL()
 {
     initializeOpenGLFunctions();
@@ -180,24 +188,64 @@ void OpenGLWidget::paintGL()
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // Execute instanced rendering
-	int translationDataSize = 3 * m_instancedDrawables.size();
-	int scaleDataSize = 3 * m_instancedDrawables.size();
-	int colorDataSize = 4 * m_instancedDrawables.size();
+    int instanceCount = m_instancedDrawables.size();
+	int translationDataSize = 3 * instanceCount;
+	int scaleDataSize = 3 * instanceCount;
+	int colorDataSize = 4 * instanceCount;
+
+    if(m_instanceCapacity != instanceCount)
+    {
+        m_instancedTranslationBuffer.bind();
+        m_instancedTranslationBuffer.allocate(translationDataSize * sizeof(GLfloat));
+        m_instancedTranslationBuffer.release();
+
+        m_instancedScaleBuffer.bind();
+        m_instancedScaleBuffer.allocate(scaleDataSize * sizeof(GLfloat));
+        m_instancedScaleBuffer.release();
+
+        m_instancedColorBuffer.bind();
+        m_instancedColorBuffer.allocate(colorDataSize * sizeof(GLfloat));
+        m_instancedColorBuffer.release();
+
+        m_instanceCapacity = instanceCount;
+        m_haveInstanceBuffersChanged = true;
+    }
+
+    // Translations and colors written by the instance data writer don't have to be copied from the drawables
+    bool isInstanceDataWritten = false;
+    if(m_instanceDataWriter && instanceCount > 0)
+    {
+        // Nothing may use the buffers while they are written
+        if(m_instanceDataWriter->isWritingInstanceData())
+            glFinish();
+        int writtenInstanceCount = m_instanceDataWriter->writeInstanceData(m_instancedTranslationBuffer.bufferId(), m_instancedColorBuffer.bufferId(),
+                                                                           instanceCount, m_haveInstanceBuffersChanged);
+        if(writtenInstanceCount >= 0)
+        {
+            instanceCount = writtenInstanceCount;
+            isInstanceDataWritten = true;
+            m_haveInstanceBuffersChanged = false;
+        }
+    }
+
     GLfloat* translationData = new GLfloat[translationDataSize];
     GLfloat* scaleData = new GLfloat[scaleDataSize];
     GLfloat* colorData = new GLfloat[colorDataSize];
 
-    for(int i = 0; i < m_instancedDrawables.size(); i++)
+    for(int i = 0; i < instanceCount; i++)
     {
         InstancedDrawable* instancedDrawable = m_instancedDrawables[i];
-        translationData[3*i] = instancedDrawable->translation.x();
-        translationData[3*i + 1] = instancedDrawable->translation.y();
-        translationData[3*i + 2] = instancedDrawable->translation.z();
-
         scaleData[3*i] = instancedDrawable->scale.x();
         scaleData[3*i + 1] = instancedDrawable->scale.y();
         scaleData[3*i + 2] = instancedDrawable->scale.z();
 
+        if(isInstanceDataWritten)
+            continue;
+
+        translationData[3*i] = instancedDrawable->translation.x();
+        translationData[3*i + 1] = instancedDrawable->translation.y();
+        translationData[3*i + 2] = instancedDrawable->translation.z();
+
         colorData[4*i] = (float)instancedDrawable->color.red() / 255.f;
         colorData[4*i + 1] = (float)instancedDrawable->color.green() / 255.f;
         colorData[4*i + 2] = (float)instancedDrawable->color.blue() / 255.f;
@@ -210,24 +258,27 @@ void OpenGLWidget::paintGL()
 
     m_instancedVao.bind();
 
-    m_instancedTranslationBuffer.bind();
-    m_instancedTranslationBuffer.allocate(translationData, translationDataSize * sizeof(GLfloat));
-    m_instancedTranslationBuffer.release();
-
     m_instancedScaleBuffer.bind();
-    m_instancedScaleBuffer.allocate(scaleData, scaleDataSize * sizeof(GLfloat));
+    m_instancedScaleBuffer.write(0, scaleData, 3 * instanceCount * sizeof(GLfloat));
     m_instancedScaleBuffer.release();
 
-    m_instancedColorBuffer.bind();
-    m_instancedColorBuffer.allocate(colorData, colorDataSize * sizeof(GLfloat));
-    m_instancedColorBuffer.release();
+    if(!isInstanceDataWritten)
+    {
+        m_instancedTranslationBuffer.bind();
+        m_instancedTranslationBuffer.write(0, translationData, translationDataSize * sizeof(GLfloat));
+        m_instancedTranslationBuffer.release();
+
+        m_instancedColorBuffer.bind();
+        m_instancedColorBuffer.write(0, colorData, colorDataSize * sizeof(GLfloat));
+        m_instancedColorBuffer.release();
+    }
 
     GLenum drawMode;
     if(InstancedDrawable::mesh->getMeshType() == MeshType::TRIANGLE_MESH)
         drawMode = GL_TRIANGLES;
     else
         drawMode = GL_LINES;
-    glDrawArraysInstanced(drawMode, 0, InstancedDrawable::mesh->getVerticesCount(), m_instancedDrawables.size());
+    glDrawArraysInstanced(drawMode, 0, InstancedDrawable::mesh->getVerticesCount(), instanceCount);
 
     m_instancedVao.release();
 
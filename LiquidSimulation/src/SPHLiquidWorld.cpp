@@ -5,7 +5,8 @@ SPHLiquidWorld::SPHLiquidWorld(SPHSolver* sphSolver, OpenGLWidget* root) :
     m_sphSolver(sphSolver),
     m_root(root)
 {
-
+    m_sphSolver->setGraphicsSharingEnabled(true);
+    m_root->setInstanceDataWriter(this);
 }
 
 void SPHLiquidWorld::addSPHParticleDrawable(SPHParticleDrawable* particleDrawable)
@@ -31,10 +32,32 @@ void SPHLiquidWorld::addStaticCollisionObjectDrawable(StaticCollisionObjectDrawa
 void SPHLiquidWorld::update(float deltaTime)
 {
     m_sphSolver->update(deltaTime);
+    updateDrawables();
+}
+
+void SPHLiquidWorld::advance(float frameTime)
+{
+    m_sphSolver->advance(frameTime);
+    updateDrawables();
+}
 
+void SPHLiquidWorld::updateDrawables()
+{
+    // Particles rendered from the device data are only read back on demand
+    bool isRenderedOnDevice = m_sphSolver->hasGraphicsSharing();
+    if(m_sphSolver->isDeviceResident() != isRenderedOnDevice)
+    {
+        m_sphSolver->setParticleReadbackInterval(0);
+        m_sphSolver->setDeviceResident(isRenderedOnDevice);
+    }
+
+    float radius = m_sphSolver->getParticleRadius();
     for(SPHParticleDrawable* particleDrawable : m_particleDrawables)
     {
-        particleDrawable->update(m_sphSolver->getParticleRadius());
+        if(isRenderedOnDevice)
+            particleDrawable->getInstancedDrawable()->scale = QVector3D(radius, radius, radius);
+        else
+            particleDrawable->update(radius);
     }
 
     for(StaticCollisionObjectDrawable* collisionObjectDrawable : m_collisionObjectDrawables)
@@ -61,7 +84,18 @@ OpenGLWidget* SPHLiquidWorld::getRoot()
     return m_root;
 }
 
+bool SPHLiquidWorld::isWritingInstanceData() const
+{
+    return m_sphSolver->canWriteGraphicsBuffers();
+}
+
+int SPHLiquidWorld::writeInstanceData(GLuint translationBuffer, GLuint colorBuffer, int instanceCapacity, bool haveBuffersChanged)
+{
+    return m_sphSolver->writeGraphicsBuffers(translationBuffer, colorBuffer, instanceCapacity, haveBuffersChanged);
+}
+
 void SPHLiquidWorld::setSPHSolver(SPHSolver* solver)
 {
 	m_sphSolver = solver;
+	m_sphSolver->setGraphicsSharingEnabled(true);
 }